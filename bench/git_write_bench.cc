@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "git_api.h"
+#include "metrics.h"
+#include "memory_accounting.h"
+#include "utils/timer.h"
+#include "synthetic_history.h"
+
+/*
+ * p4-fusion-bench-git-write writes a synthetic history through the same blob
+ * writer and WriteChangelistBranch calls p4-fusion uses, without Perforce,
+ * and reports commits/s, objects/s and the peak RSS of the process.
+ *
+ * Options are given as key=value, e.g.
+ *   p4-fusion-bench-git-write files=1000000 import=1000000 changelists=20000 branches=4
+ */
+
+namespace
+{
+int64_t peakRSSBytes()
+{
+	struct rusage usage {};
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return (int64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+bool parseOption(const std::string& arg, SyntheticHistory::Options& options, std::string& repoPath, bool& keep)
+{
+	const std::unordered_map<std::string, std::function<void(const char*)>> setters = {
+		{ "seed", [&options](const char* value)
+		    { options.seed = std::strtoull(value, nullptr, 10); } },
+		{ "changelists", [&options](const char* value)
+		    { options.changelists = std::atoi(value); } },
+		{ "files", [&options](const char* value)
+		    { options.files = std::atoi(value); } },
+		{ "import", [&options](const char* value)
+		    { options.importFiles = std::atoi(value); } },
+		{ "clSize", [&options](const char* value)
+		    { options.meanChangelistSize = std::atof(value); } },
+		{ "clShape", [&options](const char* value)
+		    { options.changelistSizeShape = std::atof(value); } },
+		{ "depth", [&options](const char* value)
+		    { options.depth = std::atoi(value); } },
+		{ "fanout", [&options](const char* value)
+		    { options.fanout = std::atoi(value); } },
+		{ "filesPerDir", [&options](const char* value)
+		    { options.filesPerDirectory = std::atoi(value); } },
+		{ "binaryRatio", [&options](const char* value)
+		    { options.binaryRatio = std::atof(value); } },
+		{ "fileSize", [&options](const char* value)
+		    { options.meanFileSize = std::atoll(value); } },
+		{ "chunkSize", [&options](const char* value)
+		    { options.chunkSize = std::atoi(value); } },
+		{ "branches", [&options](const char* value)
+		    { options.branches = std::atoi(value); } },
+		{ "integrations", [&options](const char* value)
+		    { options.integrationRatio = std::atof(value); } },
+		{ "deletes", [&options](const char* value)
+		    { options.deleteRatio = std::atof(value); } },
+		{ "repo", [&repoPath](const char* value)
+		    { repoPath = value; } },
+		{ "keep", [&keep](const char* value)
+		    { keep = std::string(value) == "true"; } },
+	};
+
+	const size_t pos = arg.find('=');
+	if (pos == std::string::npos || setters.find(arg.substr(0, pos)) == setters.end())
+	{
+		return false;
+	}
+	setters.at(arg.substr(0, pos))(arg.c_str() + pos + 1);
+	return true;
+}
+}
+
+int main(int argc, char** argv)
+{
+	SyntheticHistory::Options options;
+	std::string repoPath = (std::filesystem::temp_directory_path() / ("p4-fusion-bench-git-write-" + std::to_string(getpid()) + ".git")).string();
+	bool keep = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!parseOption(argv[i], options, repoPath, keep))
+		{
+			ERR("Unknown option " << argv[i] << ", options are seed, changelists, files, import, clSize, clShape, depth, fanout, filesPerDir, binaryRatio, fileSize, chunkSize, branches, integrations, deletes, repo and keep")
+			return 1;
+		}
+	}
+
+	PRINT("Writing " << options.changelists << " changelists over " << options.branches << " branches of up to " << options.files
+	                 << " files (seed " << options.seed << ", import " << options.importFiles << ", mean CL size " << options.meanChangelistSize
+	                 << ", shape " << options.changelistSizeShape << ", depth " << options.depth << ", fan-out " << options.fanout
+	                 << ", binary ratio " << options.binaryRatio << ", mean file size " << options.meanFileSize << "B) to " << repoPath)
+
+	int64_t files = 0;
+	int64_t bytes = 0;
+	float blobS = 0;
+	float commitS = 0;
+	int64_t generatorBytes = 0;
+	Timer total;
+	{
+		Libgit2RAII libgit2(false);
+		GitAPI git(repoPath, 0);
+		git.InitializeRepository(false);
+
+		SyntheticHistory history(options);
+		generatorBytes = history.MemoryUsage();
+		int committed = 0;
+		while (history.HasNext())
+		{
+			SyntheticHistory::Change change = history.Next();
+			BranchedFileGroup& group = change.changeList.changedFileGroups->branchedFileGroups.front();
+
+			Timer blobTimer;
+			for (size_t i = 0; i < group.files.size(); i++)
+			{
+				FileData& file = group.files[i];
+				if (file.IsDeleted())
+				{
+					continue;
+				}
+				BlobWriter writer = git.WriteBlob();
+				history.StreamContents(file, change.contents[i], [&writer, &bytes](const char* data, int length)
+				    {
+					    writer.Write(data, length);
+					    bytes += length; });
+				file.SetBlobOID(writer.Close());
+			}
+			blobS += blobTimer.GetTimeS();
+
+			files += (int64_t)group.files.size();
+			Timer commitTimer;
+			git.WriteChangelistBranch("//depot/...", change.changeList, group.files, "", change.changeList.user, change.changeList.user + "@example.com", "");
+			commitS += commitTimer.GetTimeS();
+
+			if (++committed % 1000 == 0)
+			{
+				PRINT("Committed " << committed << " changelists, " << files << " files in " << total.GetTimeS() << "s, peak RSS " << MemoryAccounting::FormatBytes(peakRSSBytes()))
+			}
+		}
+	}
+	const float totalS = total.GetTimeS();
+
+	const double commits = Metrics::Counter("git_commits_written_total", "Commits written.").Get();
+	const double blobs = Metrics::Counter("git_blobs_written_total", "Blobs written to the object database.").Get();
+	PRINT("Files: " << files << ", contents: " << MemoryAccounting::FormatBytes(bytes))
+	PRINT("Blobs: " << blobS << "s, commits including trees: " << commitS << "s, total: " << totalS << "s")
+	PRINT("Throughput: " << (int64_t)(commits / totalS) << " commits/s, " << (int64_t)((commits + blobs) / totalS) << " objects/s (blobs and commits), "
+	                     << MemoryAccounting::FormatBytes((int64_t)(bytes / totalS)) << "/s")
+	PRINT("Peak RSS: " << MemoryAccounting::FormatBytes(peakRSSBytes()) << ", of which the generator holds " << MemoryAccounting::FormatBytes(generatorBytes))
+	PRINT("Peak estimated memory: " << MemoryAccounting::PeakSummary())
+
+	if (!keep)
+	{
+		std::filesystem::remove_all(repoPath);
+	}
+	SUCCESS("Benchmark finished")
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "job_queue.h"
+
+using Clock = std::chrono::steady_clock;
+
+/*
+ * LockedJobQueue is the queue ThreadPool used before JobQueue: a single heap
+ * behind a single mutex, with all idle workers waiting on one condition
+ * variable that is notified on every push.
+ */
+template <class T>
+class LockedJobQueue
+{
+	struct Entry
+	{
+		int64_t priority;
+		uint64_t sequence;
+		T item;
+
+		bool operator<(const Entry& other) const
+		{
+			if (priority != other.priority)
+			{
+				return priority > other.priority;
+			}
+			return sequence > other.sequence;
+		}
+	};
+
+	std::vector<Entry> m_Heap;
+	uint64_t m_Sequence = 0;
+	std::mutex m_Mutex;
+	std::condition_variable m_CV;
+	bool m_Closed = false;
+
+public:
+	explicit LockedJobQueue(size_t) { }
+
+	void Push(T&& item, const int64_t priority, int)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (m_Closed)
+		{
+			return;
+		}
+		m_Heap.push_back(Entry { .priority = priority, .sequence = m_Sequence++, .item = std::move(item) });
+		std::push_heap(m_Heap.begin(), m_Heap.end());
+		m_CV.notify_one();
+	}
+
+	bool Pop(T& out, size_t)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_CV.wait(lock, [this]()
+		    { return !m_Heap.empty() || m_Closed; });
+		if (m_Closed)
+		{
+			return false;
+		}
+		std::pop_heap(m_Heap.begin(), m_Heap.end());
+		out = std::move(m_Heap.back().item);
+		m_Heap.pop_back();
+		return true;
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Closed = true;
+		m_CV.notify_all();
+	}
+};
+
+struct BenchJob
+{
+	Clock::time_point enqueuedAt;
+	int64_t priority = 0;
+	// Changelist jobs queue one follow-up batch job from the worker that runs
+	// them, like ChangeList::StartDownload does for print batches.
+	bool isBatch = false;
+};
+
+struct BenchResult
+{
+	double jobsPerSecond;
+	double p50us;
+	double p99us;
+	double p999us;
+	double maxus;
+};
+
+void spin(const std::chrono::nanoseconds duration)
+{
+	const auto end = Clock::now() + duration;
+	while (Clock::now() < end)
+	{
+	}
+}
+
+// run pushes changelistJobs jobs from one producer, keeping at most
+// lookAhead of them outstanding, and measures how long each job waited in
+// the queue before a worker picked it up.
+template <class Queue>
+BenchResult run(const int threads, const int changelistJobs, const int lookAhead, const std::chrono::nanoseconds work)
+{
+	Queue queue(threads / 4);
+	const int totalJobs = changelistJobs * 2;
+	std::atomic<int> done(0);
+	std::atomic<int> outstanding(0);
+	std::vector<std::vector<int64_t>> latencies(threads);
+
+	std::vector<std::thread> workers;
+	workers.reserve(threads);
+	for (int i = 0; i < threads; i++)
+	{
+		workers.emplace_back([&, i]()
+		    {
+			    BenchJob job;
+			    while (queue.Pop(job, i))
+			    {
+				    latencies[i].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - job.enqueuedAt).count());
+				    spin(work);
+				    if (!job.isBatch)
+				    {
+					    queue.Push(BenchJob { .enqueuedAt = Clock::now(), .priority = job.priority, .isBatch = true }, job.priority, i);
+				    }
+				    else
+				    {
+					    outstanding--;
+				    }
+				    if (++done == totalJobs)
+				    {
+					    queue.Close();
+				    }
+			    } });
+	}
+
+	const auto start = Clock::now();
+	for (int cl = 0; cl < changelistJobs; cl++)
+	{
+		while (outstanding.load() >= lookAhead)
+		{
+			std::this_thread::yield();
+		}
+		outstanding++;
+		queue.Push(BenchJob { .enqueuedAt = Clock::now(), .priority = cl }, cl, -1);
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::vector<int64_t> all;
+	all.reserve(totalJobs);
+	for (auto& workerLatencies : latencies)
+	{
+		all.insert(all.end(), workerLatencies.begin(), workerLatencies.end());
+	}
+	std::sort(all.begin(), all.end());
+	auto percentile = [&all](const double p)
+	{
+		return all[std::min(all.size() - 1, (size_t)(p * (double)all.size()))] / 1000.0;
+	};
+
+	return BenchResult {
+		.jobsPerSecond = totalJobs / seconds,
+		.p50us = percentile(0.5),
+		.p99us = percentile(0.99),
+		.p999us = percentile(0.999),
+		.maxus = all.back() / 1000.0,
+	};
+}
+
+void report(const std::string& name, const int threads, const BenchResult& result)
+{
+	PRINT(name << " threads=" << threads
+	           << " throughput=" << (int64_t)result.jobsPerSecond << " jobs/s"
+	           << " wait p50=" << result.p50us << "us"
+	           << " p99=" << result.p99us << "us"
+	           << " p99.9=" << result.p999us << "us"
+	           << " max=" << result.maxus << "us")
+}
+
+int main(int argc, char** argv)
+{
+	// Usage: p4-fusion-bench-job-queue [changelist jobs per run] [work per job in ns]
+	const int changelistJobs = argc > 1 ? std::atoi(argv[1]) : 100000;
+	const std::chrono::nanoseconds work(argc > 2 ? std::atoi(argv[2]) : 1000);
+
+	PRINT("Running " << changelistJobs << " changelist jobs, each queueing one batch job, with " << work.count() << "ns of work per job")
+
+	for (const int threads : { 16, 200, 1000 })
+	{
+		// Mirror a lookahead that keeps every worker busy.
+		const int lookAhead = threads * 2;
+		report("LockedJobQueue", threads, run<LockedJobQueue<BenchJob>>(threads, changelistJobs, lookAhead, work));
+		report("JobQueue      ", threads, run<JobQueue<BenchJob>>(threads, changelistJobs, lookAhead, work));
+	}
+
+	SUCCESS("Benchmark finished")
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "legacy_label_to_tag.h"
+#include "utils/ref_helpers.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Label names like the ones seen on real servers: mostly plain release and
+// build names, some with spaces, dots and slashes that need sanitizing.
+std::vector<std::string> generateLabels(const int count)
+{
+	const char* words[] = { "release", "build", "v1", "2024", "hotfix", "main", "qa", "nightly" };
+	const char* separators[] = { "_", "-", ".", "/", " ", "..", ".lock/", "@{" };
+	std::mt19937_64 random(7);
+	std::vector<std::string> labels;
+	labels.reserve(count);
+	for (int i = 0; i < count; i++)
+	{
+		std::string label = words[random() % 8];
+		const int parts = 1 + (int)(random() % 5);
+		for (int p = 0; p < parts; p++)
+		{
+			label += separators[random() % 100 < 80 ? random() % 3 : 3 + random() % 5];
+			label += words[random() % 8];
+		}
+		label += std::to_string(i);
+		labels.push_back(std::move(label));
+	}
+	return labels;
+}
+
+template <class F>
+double run(const std::vector<std::string>& labels, F sanitize)
+{
+	size_t length = 0;
+	const auto start = Clock::now();
+	for (const std::string& label : labels)
+	{
+		length += sanitize(label).size();
+	}
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	// Use the result so the loop isn't optimized away.
+	if (length == 0)
+	{
+		ERR("No tags were generated")
+	}
+	return seconds;
+}
+
+int main(int argc, char** argv)
+{
+	// Usage: p4-fusion-bench-ref-name [labels]
+	const int count = argc > 1 ? std::atoi(argv[1]) : 100000;
+	const std::vector<std::string> labels = generateLabels(count);
+
+	PRINT("Sanitizing " << count << " label names")
+	const double legacy = run(labels, [](const std::string& label)
+	    { return LegacyConvertLabelToTag(label); });
+	PRINT("regex       " << legacy << "s " << (int64_t)(count / legacy) << " labels/s")
+	const double singlePass = run(labels, [](const std::string& label)
+	    { return RefHelpers::SanitizeTagName(label); });
+	PRINT("single pass " << singlePass << "s " << (int64_t)(count / singlePass) << " labels/s")
+
+	SUCCESS("Benchmark finished, single pass is " << legacy / singlePass << "x faster")
+	return 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/bash
+# Copyright (c) 2024 Sourcegraph, Inc.
+# All rights reserved.
+# SPDX-License-Identifier: BSD-3-Clause
+# For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+#
+# Runs the full conversion against a recording made with p4-fusion --record,
+# once for every combination of network threads and print batch size, and
+# prints how long every run took. Every run converts into a fresh repository.
+#
+# Usage: replay_bench.sh <p4-fusion> <recording> [arguments of the recording...]
+#
+# The arguments that shape the Perforce commands, like --path, --branch and
+# --maxChanges, have to be the same as when recording. THREADS, BATCHES and
+# LATENCY (milliseconds per command) select what is measured.
+
+set -euo pipefail
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <p4-fusion> <recording> [arguments of the recording...]" >&2
+    exit 1
+fi
+
+BINARY=$1
+RECORDING=$2
+shift 2
+
+THREADS=${THREADS:-"1 4 16 64"}
+BATCHES=${BATCHES:-"1 10 100"}
+LATENCY=${LATENCY:-0}
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+printf "%-8s %-8s %-10s %s\n" "threads" "batch" "latency" "seconds"
+for threads in $THREADS; do
+    for batch in $BATCHES; do
+        src="$WORKDIR/$threads-$batch.git"
+        start=$(date +%s.%N)
+        "$BINARY" \
+            --port replay \
+            --user replay \
+            --client replay \
+            --src "$src" \
+            --replay "$RECORDING" \
+            --replayLatency "$LATENCY" \
+            --networkThreads "$threads" \
+            --printBatch "$batch" \
+            --logLevel error \
+            "$@" >"$WORKDIR/$threads-$batch.log" 2>&1 || {
+            echo "Run with $threads threads and batch $batch failed, see its log:" >&2
+            tail -n 20 "$WORKDIR/$threads-$batch.log" >&2
+            exit 1
+        }
+        end=$(date +%s.%N)
+        printf "%-8s %-8s %-10s %s\n" "$threads" "$batch" "${LATENCY}ms" "$(awk "BEGIN { printf \"%.3f\", $end - $start }")"
+        rm -rf "$src"
+    done
+done
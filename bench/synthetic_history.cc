@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "synthetic_history.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+// splitmix64 turns any 64 bit value into a well mixed one, it seeds all
+// random streams of the generator.
+uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+double toUniform(const uint64_t x)
+{
+	// The upper 53 bits fill the mantissa, the result is in [0, 1).
+	return (double)(x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Words for text contents, so that they compress roughly like source code.
+const char* const Words[] = {
+	"int", "return", "if", "else", "for", "while", "const", "auto", "std::string", "std::vector",
+	"nullptr", "true", "false", "void", "class", "struct", "public:", "private:", "static", "namespace",
+	"{", "}", "(", ")", ";", "=", "==", "+=", "->", "::", "//", "value", "result", "index", "count",
+	"buffer", "length", "data", "error", "config", "handler", "request", "response", "client", "server",
+};
+constexpr int WordCount = sizeof(Words) / sizeof(Words[0]);
+}
+
+SyntheticHistory::SyntheticHistory(const Options& options)
+    : m_Options(options)
+    , m_Random(mix(options.seed))
+{
+	if (m_Options.files <= 0 || m_Options.branches <= 0 || m_Options.depth < 0 || m_Options.fanout <= 0
+	    || m_Options.filesPerDirectory <= 0 || m_Options.chunkSize <= 0 || m_Options.meanChangelistSize < 1
+	    || m_Options.changelistSizeShape <= 1)
+	{
+		throw std::invalid_argument("invalid synthetic history options");
+	}
+	m_Branches.resize(m_Options.branches, std::vector<FileState>(m_Options.files));
+}
+
+uint64_t SyntheticHistory::next()
+{
+	m_Random = mix(m_Random);
+	return m_Random;
+}
+
+double SyntheticHistory::uniform()
+{
+	return toUniform(next());
+}
+
+int SyntheticHistory::changelistSize()
+{
+	// A Pareto distribution with the given shape and mean has its minimum at
+	// mean * (shape - 1) / shape.
+	const double shape = m_Options.changelistSizeShape;
+	const double minimum = m_Options.meanChangelistSize * (shape - 1) / shape;
+	const double size = minimum / std::pow(1.0 - uniform(), 1.0 / shape);
+	return (int)std::clamp(size, 1.0, (double)m_Options.files);
+}
+
+std::string SyntheticHistory::branchName(const int branch) const
+{
+	return branch == 0 ? "main" : "release-" + std::to_string(branch);
+}
+
+std::string SyntheticHistory::relativePath(const int index) const
+{
+	// Neighbouring files share their directories.
+	std::string path;
+	int directory = index / m_Options.filesPerDirectory;
+	for (int level = 0; level < m_Options.depth; level++)
+	{
+		path += "dir" + std::to_string(directory % m_Options.fanout) + "/";
+		directory /= m_Options.fanout;
+	}
+	return path + "file" + std::to_string(index) + (isBinary(index) ? ".bin" : ".cc");
+}
+
+bool SyntheticHistory::isBinary(const int index) const
+{
+	return toUniform(mix(m_Options.seed ^ ((uint64_t)index << 1))) < m_Options.binaryRatio;
+}
+
+bool SyntheticHistory::isExecutable(const int index) const
+{
+	return toUniform(mix(m_Options.seed ^ ((uint64_t)index << 1) ^ 1)) < 0.01;
+}
+
+void SyntheticHistory::addFile(std::vector<FileData>& files, std::vector<uint64_t>& contents, const int branch, const int index, const std::string& action, const int fromBranch)
+{
+	FileState& state = m_Branches[branch][index];
+	state.revision++;
+	if (action == "delete")
+	{
+		state.exists = false;
+		state.contentSeed = 0;
+	}
+	else if (fromBranch >= 0)
+	{
+		state.exists = true;
+		state.contentSeed = m_Branches[fromBranch][index].contentSeed;
+	}
+	else
+	{
+		state.exists = true;
+		state.contentSeed = mix(m_Options.seed ^ ((uint64_t)branch << 56) ^ ((uint64_t)index << 24) ^ state.revision);
+	}
+
+	const std::string path = relativePath(index);
+	std::string depotFile = "//depot/" + branchName(branch) + "/" + path;
+	std::string revision = std::to_string(state.revision);
+	std::string fileAction = action;
+	std::string type = std::string(isBinary(index) ? "binary" : "text") + (isExecutable(index) ? "+x" : "");
+
+	FileData file(depotFile, revision, fileAction, type);
+	std::string relative = branchName(branch) + "/" + path;
+	file.SetRelativePath(relative);
+	if (fromBranch >= 0)
+	{
+		file.SetFromDepotFile("//depot/" + branchName(fromBranch) + "/" + path, std::to_string(m_Branches[fromBranch][index].revision));
+	}
+	files.push_back(file);
+	contents.push_back(state.contentSeed);
+}
+
+void SyntheticHistory::changeMain(std::vector<FileData>& files, std::vector<uint64_t>& contents, const int first, const int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const int index = (first + i) % m_Options.files;
+		if (!m_Branches[0][index].exists)
+		{
+			addFile(files, contents, 0, index, "add", -1);
+		}
+		else
+		{
+			addFile(files, contents, 0, index, uniform() < m_Options.deleteRatio ? "delete" : "edit", -1);
+		}
+	}
+}
+
+void SyntheticHistory::changeBranch(std::vector<FileData>& files, std::vector<uint64_t>& contents, const int branch, const int first, const int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const int index = (first + i) % m_Options.files;
+		if (m_Branches[branch][index].exists)
+		{
+			addFile(files, contents, branch, index, uniform() < m_Options.deleteRatio ? "delete" : "edit", -1);
+		}
+		else if (m_Branches[0][index].exists)
+		{
+			addFile(files, contents, branch, index, "branch", 0);
+		}
+	}
+}
+
+void SyntheticHistory::integrate(std::vector<FileData>& files, std::vector<uint64_t>& contents, const int source, const int target, const int first, const int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const int index = (first + i) % m_Options.files;
+		if (m_Branches[source][index].exists)
+		{
+			addFile(files, contents, target, index, m_Branches[target][index].exists ? "integrate" : "branch", source);
+		}
+	}
+}
+
+SyntheticHistory::Change SyntheticHistory::Next()
+{
+	std::vector<FileData> files;
+	std::vector<uint64_t> contents;
+
+	if (m_Generated == 0 && m_Options.importFiles > 0)
+	{
+		changeMain(files, contents, 0, std::min(m_Options.importFiles, m_Options.files));
+	}
+	else
+	{
+		const double kind = uniform();
+		const int first = (int)(next() % m_Options.files);
+		const int count = changelistSize();
+		if (m_Options.branches > 1 && kind < m_Options.integrationRatio)
+		{
+			const int source = (int)(next() % m_Options.branches);
+			const int target = (source + 1 + (int)(next() % (m_Options.branches - 1))) % m_Options.branches;
+			integrate(files, contents, source, target, first, count);
+		}
+		else if (m_Options.branches > 1 && kind < m_Options.integrationRatio + (1 - m_Options.integrationRatio) / 2)
+		{
+			changeBranch(files, contents, 1 + (int)(next() % (m_Options.branches - 1)), first, count);
+		}
+		// Changes on the main branch always touch all files in the range, so
+		// fall back to them if there was nothing to do on the other branches.
+		if (files.empty())
+		{
+			changeMain(files, contents, first, count);
+		}
+	}
+
+	const int number = m_NextChangelist++;
+	m_Generated++;
+
+	const int fileCount = (int)files.size();
+	std::vector<BranchedFileGroup> groups;
+	groups.push_back({ "", "", false, std::move(files) });
+
+	Change change { ChangeList(number, "Synthetic change " + std::to_string(number), "user" + std::to_string(next() % 50), 1500000000 + (int64_t)number * 600), std::move(contents) };
+	change.changeList.changedFileGroups = std::make_unique<ChangedFileGroups>(groups, fileCount);
+	return change;
+}
+
+void SyntheticHistory::StreamContents(const FileData& file, const uint64_t contentSeed, const std::function<void(const char*, int)>& onChunk) const
+{
+	uint64_t random = contentSeed;
+	// Sizes are exponentially distributed around the mean.
+	const int64_t size = (int64_t)(-std::log(1.0 - toUniform(mix(random))) * (double)m_Options.meanFileSize);
+
+	std::string chunk;
+	chunk.reserve(m_Options.chunkSize + 32);
+	int64_t written = 0;
+	while (written < size)
+	{
+		chunk.clear();
+		const int64_t chunkSize = std::min<int64_t>(m_Options.chunkSize, size - written);
+		if (file.IsBinary())
+		{
+			while ((int64_t)chunk.size() < chunkSize)
+			{
+				random = mix(random);
+				chunk.append(reinterpret_cast<const char*>(&random), std::min<size_t>(sizeof(random), chunkSize - chunk.size()));
+			}
+		}
+		else
+		{
+			int column = 0;
+			while ((int64_t)chunk.size() < chunkSize)
+			{
+				random = mix(random);
+				const char* word = Words[random % WordCount];
+				chunk.append(word, std::min<size_t>(std::strlen(word), chunkSize - chunk.size()));
+				column += (int)std::strlen(word);
+				if ((int64_t)chunk.size() < chunkSize)
+				{
+					chunk += column > 60 ? '\n' : ' ';
+					column = column > 60 ? 0 : column + 1;
+				}
+			}
+		}
+		onChunk(chunk.data(), (int)chunk.size());
+		written += (int64_t)chunk.size();
+	}
+}
+
+int64_t SyntheticHistory::MemoryUsage() const
+{
+	return (int64_t)m_Branches.size() * m_Options.files * (int64_t)sizeof(FileState);
+}
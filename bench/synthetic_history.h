@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "commands/change_list.h"
+
+/*
+ * SyntheticHistory generates a Perforce history to feed into the git write
+ * path without a server. The same options and seed always produce the same
+ * changelists and file contents.
+ *
+ * Files live in branch directories //depot/<branch>/, nested in a directory
+ * tree of the given depth and fan-out. Changelist sizes follow a Pareto
+ * distribution, so most changelists are small and a few are huge. Every
+ * changelist touches a run of neighbouring files, the way real changes
+ * cluster in a directory. On the main branch, files in the run that don't
+ * exist are added and the others edited or deleted, so the tree fills up
+ * over time and then stays close to its size. Other branches start out
+ * empty and are populated by integrations from other branches, or by
+ * branching the main branch file when they are edited.
+ *
+ * All branch directories are committed to a single git branch, the way
+ * p4-fusion converts a depot path without --branch.
+ */
+class SyntheticHistory
+{
+public:
+	struct Options
+	{
+		uint64_t seed = 1;
+		// Number of changelists to generate.
+		int changelists = 1000;
+		// Number of files the tree of each branch grows to at most.
+		int files = 100000;
+		// Number of files added by an initial import changelist, 0 for none.
+		int importFiles = 0;
+		// Mean number of files per changelist and the shape of the Pareto
+		// distribution of changelist sizes, smaller is more skewed.
+		double meanChangelistSize = 20;
+		double changelistSizeShape = 1.2;
+		// Depth and fan-out of the directory tree, and files per directory.
+		int depth = 6;
+		int fanout = 16;
+		int filesPerDirectory = 32;
+		// Fraction of files that are binary.
+		double binaryRatio = 0.05;
+		// Mean size of file contents in bytes, sizes are exponentially distributed.
+		int64_t meanFileSize = 8 * 1024;
+		// Size of the chunks contents are streamed in.
+		int chunkSize = 4096;
+		// Number of branch directories, and the fraction of changelists that
+		// integrate files from one branch to another.
+		int branches = 1;
+		double integrationRatio = 0.1;
+		// Fraction of changed files that are deleted instead of edited.
+		double deleteRatio = 0.05;
+	};
+
+	/*
+	 * Change is a generated changelist with a single file group. contents
+	 * holds the content seed of every file of the group, in the same order,
+	 * to stream the contents with StreamContents.
+	 */
+	struct Change
+	{
+		ChangeList changeList;
+		std::vector<uint64_t> contents;
+	};
+
+	explicit SyntheticHistory(const Options& options);
+
+	[[nodiscard]] bool HasNext() const { return m_Generated < m_Options.changelists; }
+	Change Next();
+
+	// StreamContents calls onChunk with the contents of a file in chunks,
+	// like p4 print does.
+	void StreamContents(const FileData& file, uint64_t contentSeed, const std::function<void(const char*, int)>& onChunk) const;
+
+	// MemoryUsage returns the bytes held by the generator itself, to tell them
+	// apart from the memory used by the git write path.
+	[[nodiscard]] int64_t MemoryUsage() const;
+
+private:
+	struct FileState
+	{
+		uint64_t contentSeed = 0;
+		uint32_t revision = 0;
+		bool exists = false;
+	};
+
+	Options m_Options;
+	uint64_t m_Random;
+	int m_Generated = 0;
+	int m_NextChangelist = 1;
+	// State of every file, indexed by branch and file index.
+	std::vector<std::vector<FileState>> m_Branches;
+
+	uint64_t next();
+	double uniform();
+	int changelistSize();
+
+	[[nodiscard]] std::string branchName(int branch) const;
+	[[nodiscard]] std::string relativePath(int index) const;
+	[[nodiscard]] bool isBinary(int index) const;
+	[[nodiscard]] bool isExecutable(int index) const;
+
+	void addFile(std::vector<FileData>& files, std::vector<uint64_t>& contents, int branch, int index, const std::string& action, int fromBranch);
+	void changeMain(std::vector<FileData>& files, std::vector<uint64_t>& contents, int first, int count);
+	void changeBranch(std::vector<FileData>& files, std::vector<uint64_t>& contents, int branch, int first, int count);
+	void integrate(std::vector<FileData>& files, std::vector<uint64_t>& contents, int source, int target, int first, int count);
+};
@@ -32,14 +32,14 @@ else
   )
 fi
 
-# Decide if profiling needs to be enabled
-if [[ "$2" == *"p"* ]]; then
+# Decide if bench/ should be built
+if [[ "$2" == *"b"* ]]; then
   cmakeArgs+=(
-    -DMTR_ENABLED=ON
+    -DBUILD_BENCHMARKS=ON
   )
 else
   cmakeArgs+=(
-    -DMTR_ENABLED=OFF
+    -DBUILD_BENCHMARKS=OFF
   )
 fi
 
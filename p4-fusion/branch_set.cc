@@ -5,7 +5,8 @@
  * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
  */
 #include "branch_set.h"
-#include "minitrace.h"
+#include "trace.h"
+#include "memory_accounting.h"
 #include <map>
 #include <memory>
 #include <utility>
@@ -19,6 +20,23 @@ ChangedFileGroups::ChangedFileGroups(std::vector<BranchedFileGroup>& groups, int
     : totalFileCount(totalFileCount)
 {
 	branchedFileGroups = std::move(groups);
+
+	m_AccountedBytes = sizeof(ChangedFileGroups) + (int64_t)(branchedFileGroups.capacity() * sizeof(BranchedFileGroup));
+	for (const auto& group : branchedFileGroups)
+	{
+		m_AccountedBytes += MemoryAccounting::StringBytes(group.sourceBranch) + MemoryAccounting::StringBytes(group.targetBranch);
+		m_AccountedBytes += (int64_t)((group.files.capacity() - group.files.size()) * sizeof(FileData));
+		for (const auto& file : group.files)
+		{
+			m_AccountedBytes += file.MemoryUsage();
+		}
+	}
+	MemoryAccounting::Add(MemoryAccounting::Stage::FileGroups, m_AccountedBytes);
+}
+
+ChangedFileGroups::~ChangedFileGroups()
+{
+	MemoryAccounting::Add(MemoryAccounting::Stage::FileGroups, -m_AccountedBytes);
 }
 
 Branch::Branch(std::string branch, std::string alias)
@@ -177,7 +195,7 @@ void branchIntegrationMap::addMerge(const std::string& sourceBranch, const std::
 // Post condition: all returned FileData (e.g. filtered for git commit) have the relativePath set.
 std::unique_ptr<ChangedFileGroups> BranchSet::ParseAffectedFiles(const std::vector<FileData>& cl) const
 {
-	MTR_SCOPE("BranchSet", __func__);
+	TRACE_SCOPE("BranchSet", __func__);
 
 	branchIntegrationMap branchMap;
 	for (auto& clFileData : cl)
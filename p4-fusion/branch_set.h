@@ -33,11 +33,17 @@ struct ChangedFileGroups
 private:
 	ChangedFileGroups();
 
+	// Bytes accounted to the file groups stage, released on destruction.
+	int64_t m_AccountedBytes = 0;
+
 public:
 	std::vector<BranchedFileGroup> branchedFileGroups;
 	int totalFileCount;
 
 	ChangedFileGroups(std::vector<BranchedFileGroup>& groups, int totalFileCount);
+	ChangedFileGroups(const ChangedFileGroups&) = delete;
+	ChangedFileGroups& operator=(const ChangedFileGroups&) = delete;
+	~ChangedFileGroups();
 
 	static std::unique_ptr<ChangedFileGroups> Empty() { return std::unique_ptr<ChangedFileGroups>(new ChangedFileGroups); };
 };
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "changelist_index.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "git2.h"
+#include "log.h"
+#include "trace.h"
+#include "labels_conversion.h"
+
+// The file starts with a magic that also versions the record layout.
+constexpr char indexMagic[] = "P4FCLIX1";
+constexpr size_t headerBytes = sizeof(indexMagic) - 1;
+
+namespace
+{
+void throwErrno(const std::string& what, const std::string& path)
+{
+	throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+void writeAll(const int fd, const char* data, size_t length, off_t offset, const std::string& path)
+{
+	while (length > 0)
+	{
+		const ssize_t written = pwrite(fd, data, length, offset);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written < 0)
+		{
+			throwErrno("failed to write changelist index", path);
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+}
+}
+
+ChangelistIndex::ChangelistIndex(std::string path)
+    : m_Path(std::move(path))
+{
+	open(false);
+}
+
+ChangelistIndex::~ChangelistIndex()
+{
+	close();
+}
+
+uint32_t ChangelistIndex::branchHash(const std::string& branch)
+{
+	// FNV-1a, branch names are only ever compared for equality.
+	uint32_t hash = 2166136261u;
+	for (const char c : branch)
+	{
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	}
+	return hash;
+}
+
+void ChangelistIndex::open(const bool truncate)
+{
+	close();
+
+	m_FD = ::open(m_Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+	if (m_FD < 0)
+	{
+		throwErrno("failed to open changelist index", m_Path);
+	}
+
+	struct stat st {};
+	if (fstat(m_FD, &st) != 0)
+	{
+		throwErrno("failed to stat changelist index", m_Path);
+	}
+
+	char magic[headerBytes] = {};
+	if ((size_t)st.st_size < headerBytes || pread(m_FD, magic, headerBytes, 0) != (ssize_t)headerBytes || std::memcmp(magic, indexMagic, headerBytes) != 0)
+	{
+		if (st.st_size > 0)
+		{
+			WARN("Changelist index " << m_Path << " has an unknown format, it will be rebuilt")
+		}
+		if (ftruncate(m_FD, 0) != 0)
+		{
+			throwErrno("failed to truncate changelist index", m_Path);
+		}
+		writeAll(m_FD, indexMagic, headerBytes, 0, m_Path);
+		m_Records = 0;
+		m_LastChangelist = 0;
+		return;
+	}
+
+	m_Records = ((size_t)st.st_size - headerBytes) / sizeof(Record);
+	if (((size_t)st.st_size - headerBytes) % sizeof(Record) != 0)
+	{
+		// A run was interrupted in the middle of an append, drop the partial
+		// record. Sync adds its commit back.
+		WARN("Dropping a partial record at the end of changelist index " << m_Path)
+		if (ftruncate(m_FD, (off_t)(headerBytes + m_Records * sizeof(Record))) != 0)
+		{
+			throwErrno("failed to truncate changelist index", m_Path);
+		}
+	}
+
+	m_LastChangelist = m_Records == 0 ? 0 : records()[m_Records - 1].changelist;
+}
+
+void ChangelistIndex::close()
+{
+	unmap();
+	if (m_FD >= 0)
+	{
+		::close(m_FD);
+		m_FD = -1;
+	}
+	m_Records = 0;
+}
+
+void ChangelistIndex::unmap()
+{
+	if (m_Map != nullptr)
+	{
+		munmap((void*)m_Map, headerBytes + m_MappedRecords * sizeof(Record));
+		m_Map = nullptr;
+		m_MappedRecords = 0;
+	}
+}
+
+const ChangelistIndex::Record* ChangelistIndex::records()
+{
+	if (m_Records == 0)
+	{
+		return nullptr;
+	}
+	if (m_MappedRecords != m_Records)
+	{
+		// The file grew since it was mapped, remap all of it.
+		unmap();
+		void* map = mmap(nullptr, headerBytes + m_Records * sizeof(Record), PROT_READ, MAP_SHARED, m_FD, 0);
+		if (map == MAP_FAILED)
+		{
+			throwErrno("failed to map changelist index", m_Path);
+		}
+		m_Map = (const Record*)((const char*)map + headerBytes);
+		m_MappedRecords = m_Records;
+	}
+	return m_Map;
+}
+
+void ChangelistIndex::Append(const int changelist, const std::string& branch, const git_oid& commit)
+{
+	Record record {};
+	record.changelist = (uint32_t)changelist;
+	record.branch = branchHash(branch);
+	std::memcpy(record.commit, commit.id, GIT_OID_RAWSZ);
+
+	if (m_Records > 0 && record.changelist < m_LastChangelist)
+	{
+		// Changelists are committed in order, so this only happens if the
+		// history was rewritten underneath the index. Keep it sorted by
+		// rewriting it, which is slow but rare.
+		WARN("Changelist " << changelist << " was committed after " << m_LastChangelist << ", rewriting changelist index " << m_Path)
+		const Record* begin = records();
+		std::vector<Record> all(begin, begin + m_Records);
+		all.push_back(record);
+		std::stable_sort(all.begin(), all.end(), [](const Record& a, const Record& b)
+		    { return a.changelist < b.changelist; });
+		rewrite(all);
+		return;
+	}
+
+	writeAll(m_FD, (const char*)&record, sizeof(record), (off_t)(headerBytes + m_Records * sizeof(Record)), m_Path);
+	m_Records++;
+	m_LastChangelist = record.changelist;
+}
+
+void ChangelistIndex::rewrite(const std::vector<Record>& all)
+{
+	// Write the new index next to the old one and swap it in, so that an
+	// interrupted rewrite leaves a valid index behind.
+	const std::string tmpPath = m_Path + ".tmp";
+	const int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		throwErrno("failed to create changelist index", tmpPath);
+	}
+	writeAll(fd, indexMagic, headerBytes, 0, tmpPath);
+	writeAll(fd, (const char*)all.data(), all.size() * sizeof(Record), headerBytes, tmpPath);
+	::close(fd);
+	if (std::rename(tmpPath.c_str(), m_Path.c_str()) != 0)
+	{
+		throwErrno("failed to replace changelist index", m_Path);
+	}
+	open(false);
+}
+
+bool ChangelistIndex::Lookup(const int changelist, const std::string& branch, git_oid& commit)
+{
+	const Record* begin = records();
+	const Record* end = begin + m_Records;
+	const uint32_t hash = branchHash(branch);
+	// A changelist with several branch groups has a commit for each of them
+	// on the same ref, the last one appended holds all of its changes.
+	bool found = false;
+	for (const Record* it = std::lower_bound(begin, end, (uint32_t)changelist, [](const Record& record, const uint32_t cl)
+	         { return record.changelist < cl; });
+	     it != end && it->changelist == (uint32_t)changelist; it++)
+	{
+		if (it->branch == hash)
+		{
+			git_oid_fromraw(&commit, it->commit);
+			found = true;
+		}
+	}
+	return found;
+}
+
+int ChangelistIndex::Latest()
+{
+	return m_Records == 0 ? -1 : (int)m_LastChangelist;
+}
+
+void ChangelistIndex::Sync(git_repository* repo)
+{
+	TRACE_SCOPE("Git", __func__);
+
+	git_oid head;
+	const int errorCode = git_reference_name_to_id(&head, repo, "HEAD");
+	if (errorCode == GIT_ENOTFOUND)
+	{
+		if (m_Records > 0)
+		{
+			WARN("Repository has no HEAD, emptying changelist index " << m_Path)
+			open(true);
+		}
+		return;
+	}
+	if (errorCode != 0)
+	{
+		throw std::runtime_error("failed to resolve HEAD to sync the changelist index");
+	}
+
+	if (m_Records > 0 && std::memcmp(records()[m_Records - 1].commit, head.id, GIT_OID_RAWSZ) == 0)
+	{
+		return;
+	}
+	if (m_Records > 0 && catchUp(repo, head))
+	{
+		return;
+	}
+
+	PRINT("Building changelist index " << m_Path << " from the history of HEAD")
+	open(true);
+	catchUp(repo, head);
+	SUCCESS("Indexed " << m_Records << " commits")
+}
+
+bool ChangelistIndex::catchUp(git_repository* repo, const git_oid& head)
+{
+	// Walk the first parents back from HEAD until the last indexed commit,
+	// which is where the committer appended the previous commits.
+	git_oid last {};
+	if (m_Records > 0)
+	{
+		git_oid_fromraw(&last, records()[m_Records - 1].commit);
+	}
+
+	std::vector<Record> missing;
+	git_commit* commit = nullptr;
+	if (git_commit_lookup(&commit, repo, &head) != 0)
+	{
+		throw std::runtime_error("failed to look up HEAD to sync the changelist index");
+	}
+	bool found = false;
+	while (commit != nullptr)
+	{
+		if (m_Records > 0 && git_oid_equal(git_commit_id(commit), &last))
+		{
+			found = true;
+			git_commit_free(commit);
+			break;
+		}
+
+		// The base commit has no changelist.
+		if (std::strstr(git_commit_message(commit), ": change = ") != nullptr)
+		{
+			Record record {};
+			record.changelist = (uint32_t)std::stoul(get_changelist_from_commit(commit));
+			record.branch = branchHash("");
+			std::memcpy(record.commit, git_commit_id(commit)->id, GIT_OID_RAWSZ);
+			missing.push_back(record);
+		}
+
+		git_commit* parent = nullptr;
+		if (git_commit_parentcount(commit) > 0 && git_commit_parent(&parent, commit, 0) != 0)
+		{
+			git_commit_free(commit);
+			throw std::runtime_error("failed to look up a parent commit to sync the changelist index");
+		}
+		git_commit_free(commit);
+		commit = parent;
+	}
+	if (m_Records > 0 && !found)
+	{
+		WARN("The last commit in changelist index " << m_Path << " is not in the history of HEAD")
+		return false;
+	}
+
+	std::reverse(missing.begin(), missing.end());
+	if (!missing.empty() && missing.front().changelist >= m_LastChangelist
+	    && std::is_sorted(missing.begin(), missing.end(), [](const Record& a, const Record& b)
+	        { return a.changelist < b.changelist; }))
+	{
+		writeAll(m_FD, (const char*)missing.data(), missing.size() * sizeof(Record), (off_t)(headerBytes + m_Records * sizeof(Record)), m_Path);
+		m_Records += missing.size();
+		m_LastChangelist = missing.back().changelist;
+	}
+	else if (!missing.empty())
+	{
+		const Record* begin = records();
+		std::vector<Record> all(begin, begin + m_Records);
+		all.insert(all.end(), missing.begin(), missing.end());
+		std::stable_sort(all.begin(), all.end(), [](const Record& a, const Record& b)
+		    { return a.changelist < b.changelist; });
+		rewrite(all);
+	}
+	return true;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "git2/oid.h"
+
+struct git_repository;
+
+/*
+ * ChangelistIndex maps changelist numbers to the commits they were converted
+ * to, so that they can be found with a binary search instead of walking the
+ * history and parsing commit messages.
+ *
+ * The index is a file of fixed size records sorted by changelist, kept next
+ * to the repository. The committer appends a record for every commit, which
+ * keeps the file sorted because changelists are committed in order. Lookups
+ * read the file through a memory map.
+ *
+ * A changelist converted to several branches has a record per branch. The
+ * branch is stored as a hash of its name, the empty name stands for HEAD.
+ *
+ * Sync makes the index match HEAD on startup: it appends commits that were
+ * created after the last record, e.g. if the previous run crashed between
+ * committing and appending, and rebuilds the index from the history if the
+ * file is missing or doesn't belong to the history of HEAD.
+ */
+class ChangelistIndex
+{
+public:
+	explicit ChangelistIndex(std::string path);
+	ChangelistIndex() = delete;
+	ChangelistIndex(const ChangelistIndex&) = delete;
+	ChangelistIndex& operator=(const ChangelistIndex&) = delete;
+	~ChangelistIndex();
+
+	// Sync brings the index up to date with the history of HEAD. If the
+	// repository has no HEAD, the index is emptied.
+	void Sync(git_repository* repo);
+	void Append(int changelist, const std::string& branch, const git_oid& commit);
+
+	// Lookup finds the latest commit of a changelist on a branch, it returns
+	// false if the changelist wasn't converted to that branch.
+	bool Lookup(int changelist, const std::string& branch, git_oid& commit);
+	// Latest returns the highest changelist in the index, or -1 if it is empty.
+	int Latest();
+	[[nodiscard]] size_t Size() const { return m_Records; }
+
+private:
+	struct Record
+	{
+		uint32_t changelist;
+		uint32_t branch;
+		unsigned char commit[GIT_OID_RAWSZ];
+	};
+	static_assert(sizeof(Record) == 28, "index records must be packed");
+
+	std::string m_Path;
+	int m_FD = -1;
+	size_t m_Records = 0;
+	// The memory map covers the first m_MappedRecords records, it is
+	// extended on lookup when records were appended since.
+	const Record* m_Map = nullptr;
+	size_t m_MappedRecords = 0;
+	uint32_t m_LastChangelist = 0;
+
+	static uint32_t branchHash(const std::string& branch);
+
+	void open(bool truncate);
+	void close();
+	void unmap();
+	const Record* records();
+	void rewrite(const std::vector<Record>& all);
+	// catchUp appends the commits between the last record and HEAD, it
+	// returns false if the last record isn't in the history of HEAD.
+	bool catchUp(git_repository* repo, const git_oid& head);
+};
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "command_archive.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#include "p4/strtable.h"
+
+namespace
+{
+const char RecordingMagic[8] = { 'P', '4', 'F', 'R', 'E', 'C', '0', '1' };
+
+enum class EventType : char
+{
+	Stat = 'S',
+	StatPartial = 'P',
+	Text = 'T',
+	Binary = 'B',
+	Info = 'I',
+	Message = 'M',
+	Error = 'E',
+};
+
+struct Event
+{
+	EventType type;
+	// The level of info output, or the severity of messages and errors.
+	int level = 0;
+	// The formatted text of info output, messages and errors, or the data of
+	// text and binary output.
+	std::string data;
+	// The variables of tagged output.
+	std::vector<std::pair<std::string, std::string>> vars;
+};
+
+std::string commandKey(const std::string& command, const std::vector<std::string>& args)
+{
+	std::string key = command;
+	for (const std::string& arg : args)
+	{
+		key += '\0';
+		key += arg;
+	}
+	return key;
+}
+
+std::string recordingPath(const std::string& directory, const std::string& key)
+{
+	// FNV-1a keeps the file names short, the key is stored in the file to
+	// detect collisions.
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char c : key)
+	{
+		hash ^= (unsigned char)c;
+		hash *= 1099511628211ULL;
+	}
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.rec", (unsigned long long)hash);
+	return (std::filesystem::path(directory) / name).string();
+}
+
+std::string describeKey(const std::string& key)
+{
+	std::string description = "p4 " + key;
+	std::replace(description.begin(), description.end(), '\0', ' ');
+	return description;
+}
+
+std::string formatError(const ::Error* err)
+{
+	StrBuf str;
+	err->Fmt(&str);
+	return { str.Text() };
+}
+
+void writeString(std::ofstream& out, const std::string& str)
+{
+	const uint32_t length = str.size();
+	out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+	out.write(str.data(), length);
+}
+
+bool readString(std::ifstream& in, std::string& str)
+{
+	uint32_t length = 0;
+	if (!in.read(reinterpret_cast<char*>(&length), sizeof(length)))
+	{
+		return false;
+	}
+	str.resize(length);
+	return (bool)in.read(str.data(), length);
+}
+
+void writeRecording(const std::string& directory, const std::string& key, std::vector<Event>::const_iterator begin, std::vector<Event>::const_iterator end)
+{
+	const std::string path = recordingPath(directory, key);
+	// Write to a file of our own first, so that concurrent recordings of the
+	// same command don't interleave and replays never see half a file.
+	const std::string tmpPath = path + "." + std::to_string(std::hash<std::thread::id> {}(std::this_thread::get_id())) + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		out.write(RecordingMagic, sizeof(RecordingMagic));
+		writeString(out, key);
+		const uint32_t count = end - begin;
+		out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		for (auto it = begin; it != end; it++)
+		{
+			out.put((char)it->type);
+			const int32_t level = it->level;
+			out.write(reinterpret_cast<const char*>(&level), sizeof(level));
+			writeString(out, it->data);
+			const uint32_t vars = it->vars.size();
+			out.write(reinterpret_cast<const char*>(&vars), sizeof(vars));
+			for (const auto& var : it->vars)
+			{
+				writeString(out, var.first);
+				writeString(out, var.second);
+			}
+		}
+		if (!out)
+		{
+			throw std::runtime_error("Failed to write the recording " + tmpPath);
+		}
+	}
+	std::filesystem::rename(tmpPath, path);
+}
+
+std::vector<Event> readRecording(const std::string& directory, const std::string& key)
+{
+	const std::string path = recordingPath(directory, key);
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		throw std::runtime_error("No recording of " + describeKey(key) + " in " + directory + ", replays must use the same arguments as the recording");
+	}
+
+	char magic[sizeof(RecordingMagic)];
+	std::string recordedKey;
+	uint32_t count = 0;
+	if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, RecordingMagic, sizeof(magic)) != 0
+	    || !readString(in, recordedKey) || !in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+	{
+		throw std::runtime_error("Invalid recording " + path);
+	}
+	if (recordedKey != key)
+	{
+		throw std::runtime_error("Recording " + path + " is of " + describeKey(recordedKey) + " instead of " + describeKey(key));
+	}
+
+	std::vector<Event> events(count);
+	for (Event& event : events)
+	{
+		int32_t level = 0;
+		uint32_t vars = 0;
+		char type = 0;
+		if (!in.get(type) || !in.read(reinterpret_cast<char*>(&level), sizeof(level))
+		    || !readString(in, event.data) || !in.read(reinterpret_cast<char*>(&vars), sizeof(vars)))
+		{
+			throw std::runtime_error("Truncated recording " + path);
+		}
+		event.type = (EventType)type;
+		event.level = level;
+		event.vars.resize(vars);
+		for (auto& var : event.vars)
+		{
+			if (!readString(in, var.first) || !readString(in, var.second))
+			{
+				throw std::runtime_error("Truncated recording " + path);
+			}
+		}
+	}
+	return events;
+}
+
+void replayEvents(const std::vector<Event>& events, Result& result)
+{
+	for (const Event& event : events)
+	{
+		switch (event.type)
+		{
+		case EventType::Stat:
+		case EventType::StatPartial:
+		{
+			StrBufDict dict;
+			for (const auto& var : event.vars)
+			{
+				dict.SetVar(var.first.c_str(), var.second.c_str());
+			}
+			if (event.type == EventType::Stat)
+			{
+				result.OutputStat(&dict);
+			}
+			else
+			{
+				result.OutputStatPartial(&dict);
+			}
+			break;
+		}
+		case EventType::Text:
+			result.OutputText(event.data.data(), (int)event.data.size());
+			break;
+		case EventType::Binary:
+			result.OutputBinary(event.data.data(), (int)event.data.size());
+			break;
+		case EventType::Info:
+			result.OutputInfo((char)event.level, event.data.c_str());
+			break;
+		case EventType::Message:
+		case EventType::Error:
+		{
+			// The text is used as a format, escape the variable markers.
+			std::string format;
+			for (const char c : event.data)
+			{
+				format += c;
+				if (c == '%')
+				{
+					format += '%';
+				}
+			}
+			::Error err;
+			err.Set((ErrorSeverity)event.level, format.c_str());
+			if (event.type == EventType::Message)
+			{
+				result.Message(&err);
+			}
+			else
+			{
+				result.HandleError(&err);
+			}
+			break;
+		}
+		default:
+			throw std::runtime_error("Invalid event in recording");
+		}
+	}
+}
+
+/*
+ * RecordingUser passes all output of a command on to the result and keeps a
+ * copy of it.
+ */
+class RecordingUser : public ClientUser
+{
+	Result& m_Result;
+
+	static std::vector<std::pair<std::string, std::string>> vars(StrDict* varList)
+	{
+		std::vector<std::pair<std::string, std::string>> vars;
+		StrRef var;
+		StrRef val;
+		for (int i = 0; varList->GetVar(i, var, val); i++)
+		{
+			vars.emplace_back(var.Text(), val.Text());
+		}
+		return vars;
+	}
+
+public:
+	std::vector<Event> events;
+
+	explicit RecordingUser(Result& result)
+	    : m_Result(result)
+	{
+	}
+
+	void OutputStat(StrDict* varList) override
+	{
+		events.push_back({ EventType::Stat, 0, "", vars(varList) });
+		m_Result.OutputStat(varList);
+	}
+	int OutputStatPartial(StrDict* varList) override
+	{
+		events.push_back({ EventType::StatPartial, 0, "", vars(varList) });
+		return m_Result.OutputStatPartial(varList);
+	}
+	void OutputText(const char* data, int length) override
+	{
+		events.push_back({ EventType::Text, 0, std::string(data, length), {} });
+		m_Result.OutputText(data, length);
+	}
+	void OutputBinary(const char* data, int length) override
+	{
+		events.push_back({ EventType::Binary, 0, std::string(data, length), {} });
+		m_Result.OutputBinary(data, length);
+	}
+	void OutputInfo(char level, const char* data) override
+	{
+		events.push_back({ EventType::Info, level, data, {} });
+		m_Result.OutputInfo(level, data);
+	}
+	void Message(::Error* err) override
+	{
+		events.push_back({ EventType::Message, err->GetSeverity(), formatError(err), {} });
+		m_Result.Message(err);
+	}
+	void HandleError(::Error* err) override
+	{
+		events.push_back({ EventType::Error, err->GetSeverity(), formatError(err), {} });
+		m_Result.HandleError(err);
+	}
+};
+
+std::vector<std::string> toStrings(const std::vector<char*>& args)
+{
+	return { args.begin(), args.end() };
+}
+
+std::string statVar(const Event& event, const std::string& name)
+{
+	for (const auto& var : event.vars)
+	{
+		if (var.first == name)
+		{
+			return var.second;
+		}
+	}
+	return "";
+}
+}
+
+CommandArchive::CommandArchive(const std::string& directory, const Mode mode, const int replayLatencyMs)
+    : m_Directory(directory)
+    , m_Mode(mode)
+    , m_ReplayLatencyMs(replayLatencyMs)
+{
+	if (m_Mode == Mode::Record)
+	{
+		std::filesystem::create_directories(m_Directory);
+	}
+	else if (!std::filesystem::is_directory(m_Directory))
+	{
+		throw std::invalid_argument("Recording directory " + m_Directory + " does not exist");
+	}
+}
+
+void CommandArchive::Record(const char* command, const std::vector<char*>& args, Result& result, const std::function<void(ClientUser*)>& run) const
+{
+	RecordingUser recorder(result);
+	run(&recorder);
+
+	if (std::strcmp(command, "print") != 0)
+	{
+		writeRecording(m_Directory, commandKey(command, toStrings(args)), recorder.events.begin(), recorder.events.end());
+		return;
+	}
+
+	// Store every printed file on its own, so that the files can be replayed
+	// in batches of any size. The output of a file starts with its stat.
+	auto fileBegin = recorder.events.end();
+	for (auto it = recorder.events.begin(); it != recorder.events.end(); it++)
+	{
+		if (it->type != EventType::Stat)
+		{
+			continue;
+		}
+		if (fileBegin != recorder.events.end())
+		{
+			writeRecording(m_Directory, commandKey(command, { statVar(*fileBegin, "depotFile") + "#" + statVar(*fileBegin, "rev") }), fileBegin, it);
+		}
+		fileBegin = it;
+	}
+	if (fileBegin != recorder.events.end())
+	{
+		writeRecording(m_Directory, commandKey(command, { statVar(*fileBegin, "depotFile") + "#" + statVar(*fileBegin, "rev") }), fileBegin, recorder.events.end());
+	}
+}
+
+void CommandArchive::Replay(const char* command, const std::vector<char*>& args, Result& result) const
+{
+	if (m_ReplayLatencyMs > 0)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(m_ReplayLatencyMs));
+	}
+
+	if (std::strcmp(command, "print") != 0)
+	{
+		replayEvents(readRecording(m_Directory, commandKey(command, toStrings(args))), result);
+		return;
+	}
+
+	for (const char* fileRevision : args)
+	{
+		replayEvents(readRecording(m_Directory, commandKey(command, { fileRevision })), result);
+	}
+}
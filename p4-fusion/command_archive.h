@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "commands/result.h"
+
+/*
+ * CommandArchive records the output of Perforce commands to a directory, and
+ * replays it later without a server. This allows to benchmark the whole
+ * conversion reproducibly, without load on a production server and without
+ * depending on the state of its caches.
+ *
+ * Every command is stored in its own file, named after a hash of the command
+ * and its arguments. The file holds the tagged dictionaries, text, binary
+ * data, messages and errors in the order the server sent them. Prints are
+ * split up and stored per file revision, so that a recording can be replayed
+ * with any --printBatch. Output of a print that doesn't belong to a file is
+ * not recorded.
+ *
+ * Replaying a command that wasn't recorded throws, the run has to use the
+ * same depot path, branches and max changes as the recording.
+ */
+class CommandArchive
+{
+public:
+	enum class Mode
+	{
+		Record,
+		Replay,
+	};
+
+	// CommandArchive creates the directory when recording. Replayed commands
+	// take replayLatencyMs milliseconds before their output is played back.
+	CommandArchive(const std::string& directory, Mode mode, int replayLatencyMs);
+
+	[[nodiscard]] bool IsReplaying() const { return m_Mode == Mode::Replay; }
+	[[nodiscard]] const std::string& GetDirectory() const { return m_Directory; }
+
+	// Record calls run with a client user that forwards all output to result
+	// and stores it in the archive once run returns.
+	void Record(const char* command, const std::vector<char*>& args, Result& result, const std::function<void(ClientUser*)>& run) const;
+	// Replay plays the recorded output of the command into result.
+	void Replay(const char* command, const std::vector<char*>& args, Result& result) const;
+
+private:
+	std::string m_Directory;
+	Mode m_Mode;
+	int m_ReplayLatencyMs;
+};
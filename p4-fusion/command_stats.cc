@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "command_stats.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "log.h"
+
+std::mutex CommandLatencies::s_Mutex;
+std::map<std::string, std::unique_ptr<CommandStats>> CommandLatencies::s_Commands;
+
+CommandStats& CommandLatencies::For(const std::string& command)
+{
+	std::lock_guard<std::mutex> lock(s_Mutex);
+
+	std::unique_ptr<CommandStats>& stats = s_Commands[command];
+	if (!stats)
+	{
+		stats = std::make_unique<CommandStats>();
+	}
+	return *stats;
+}
+
+namespace
+{
+std::string formatMillis(const std::chrono::microseconds duration)
+{
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(1) << (double)duration.count() / 1000.0 << "ms";
+	return oss.str();
+}
+}
+
+std::string CommandLatencies::Summary()
+{
+	std::ostringstream out;
+	out << std::left
+	    << std::setw(12) << "command"
+	    << std::setw(11) << "stage"
+	    << std::right
+	    << std::setw(10) << "count"
+	    << std::setw(12) << "p50"
+	    << std::setw(12) << "p90"
+	    << std::setw(12) << "p99"
+	    << std::setw(12) << "max"
+	    << std::setw(10) << "retries"
+	    << "\n";
+
+	std::lock_guard<std::mutex> lock(s_Mutex);
+	for (const auto& [command, stats] : s_Commands)
+	{
+		const std::pair<const char*, const LatencyHistogram*> stages[] = {
+			{ "connect", &stats->connect },
+			{ "firstByte", &stats->firstByte },
+			{ "total", &stats->total },
+		};
+		for (const auto& [stage, histogram] : stages)
+		{
+			if (histogram->GetCount() == 0)
+			{
+				continue;
+			}
+			out << std::left
+			    << std::setw(12) << command
+			    << std::setw(11) << stage
+			    << std::right
+			    << std::setw(10) << histogram->GetCount()
+			    << std::setw(12) << formatMillis(histogram->GetPercentile(0.5))
+			    << std::setw(12) << formatMillis(histogram->GetPercentile(0.9))
+			    << std::setw(12) << formatMillis(histogram->GetPercentile(0.99))
+			    << std::setw(12) << formatMillis(histogram->GetMax())
+			    << std::setw(10) << stats->retries.load()
+			    << "\n";
+		}
+	}
+	return out.str();
+}
+
+void CommandLatencies::PrintSummary()
+{
+	std::istringstream summary(Summary());
+	std::string line;
+	PRINT("Perforce command latencies:")
+	while (std::getline(summary, line))
+	{
+		PRINT("  " << line)
+	}
+}
+
+void CommandLatencies::WriteReport(const std::string& path)
+{
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::out | std::ios::trunc);
+		if (!file)
+		{
+			throw std::runtime_error("failed to open latency report " + tmpPath);
+		}
+		file << Summary();
+	}
+	if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		throw std::runtime_error("failed to rename latency report to " + path);
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "utils/latency_histogram.h"
+
+/*
+ * CommandStats holds the latency histograms of one Perforce command type:
+ *
+ * - connect: time spent (re)connecting to the server before retrying or
+ *   refreshing the connection, so this is mostly empty on a healthy run.
+ * - firstByte: time from sending an attempt of the command until the first
+ *   output, error or message arrived, i.e. server and network latency.
+ * - total: time of the whole command as seen by the caller, including all
+ *   retries and the processing of its output on our side.
+ */
+struct CommandStats
+{
+	LatencyHistogram connect;
+	LatencyHistogram firstByte;
+	LatencyHistogram total;
+	std::atomic<uint64_t> retries { 0 };
+};
+
+/*
+ * CommandLatencies is the process wide registry of CommandStats, keyed by
+ * command name. The returned references stay valid for the life time of the
+ * process.
+ */
+class CommandLatencies
+{
+public:
+	static CommandStats& For(const std::string& command);
+
+	// Summary formats p50/p90/p99/max of all recorded histograms as a table.
+	static std::string Summary();
+	static void PrintSummary();
+	// WriteReport atomically replaces the file at path with the summary.
+	static void WriteReport(const std::string& path);
+
+private:
+	static std::mutex s_Mutex;
+	static std::map<std::string, std::unique_ptr<CommandStats>> s_Commands;
+};
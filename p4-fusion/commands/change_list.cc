@@ -6,14 +6,18 @@
  */
 #include "change_list.h"
 
+#include <algorithm>
 #include <utility>
 
 #include "p4_api.h"
+#include "thread_pool.h"
 #include "describe_result.h"
 #include "filelog_result.h"
 #include "print_result.h"
 #include "utils/std_helpers.h"
-#include "minitrace.h"
+#include "watchdog.h"
+#include "memory_accounting.h"
+#include "trace.h"
 
 ChangeList::ChangeList(const int& clNumber, std::string&& clDescription, std::string&& userID, const int64_t& clTimestamp)
     : number(clNumber)
@@ -21,19 +25,67 @@ ChangeList::ChangeList(const int& clNumber, std::string&& clDescription, std::st
     , description(std::move(clDescription))
     , timestamp(clTimestamp)
     , changedFileGroups(ChangedFileGroups::Empty())
-    , waiting(false)
 {
 }
 
-void flush(P4API& p4, GitAPI& git, const std::vector<std::shared_ptr<FileData>>& printBatchFileData)
+ChangeListStats::ChangeListStats(ChangeListStats&& other) noexcept
+    : queuedAt(other.queuedAt)
+    , queued(other.queued)
+    , describe(other.describe)
+    , filelog(other.filelog)
+    , printNs(other.printNs.load())
+    , bytes(other.bytes.load())
+    , retries(other.retries.load())
 {
-	MTR_SCOPE("ChangeList", __func__);
+}
+
+ChangeListStats& ChangeListStats::operator=(ChangeListStats&& other) noexcept
+{
+	queuedAt = other.queuedAt;
+	queued = other.queued;
+	describe = other.describe;
+	filelog = other.filelog;
+	printNs = other.printNs.load();
+	bytes = other.bytes.load();
+	retries = other.retries.load();
+	return *this;
+}
+
+ChangeList::ChangeList(ChangeList&& other) noexcept
+    : number(other.number)
+    , user(std::move(other.user))
+    , description(std::move(other.description))
+    , timestamp(other.timestamp)
+    , changedFileGroups(std::move(other.changedFileGroups))
+    , stats(std::move(other.stats))
+    , pendingDownloadJobs(other.pendingDownloadJobs.load())
+{
+}
+
+ChangeList& ChangeList::operator=(ChangeList&& other) noexcept
+{
+	number = other.number;
+	user = std::move(other.user);
+	description = std::move(other.description);
+	timestamp = other.timestamp;
+	changedFileGroups = std::move(other.changedFileGroups);
+	stats = std::move(other.stats);
+	pendingDownloadJobs = other.pendingDownloadJobs.load();
+	return *this;
+}
+
+// flush downloads the files of print batch number batch out of batches for
+// the changelist.
+void flush(P4API& p4, GitAPI& git, const DownloadContext& ctx, const int changelist, const int batch, const int batches, ChangeListStats& stats, const std::vector<std::shared_ptr<FileData>>& printBatchFileData)
+{
+	TRACE_SCOPE("ChangeList", __func__);
 
 	// Only perform the batch processing when there are files to process.
 	if (printBatchFileData.empty())
 	{
 		return;
 	}
+	Watchdog::PhaseScope printPhase(changelist, Watchdog::Phase::Print, batch, batches);
 
 	std::vector<std::string> fileRevisions;
 	fileRevisions.reserve(printBatchFileData.size());
@@ -53,29 +105,41 @@ void flush(P4API& p4, GitAPI& git, const std::vector<std::shared_ptr<FileData>>&
 	// file begins here", and then for small chunks of data of that file.
 	long idx = -1;
 	BlobWriter writer = git.WriteBlob();
-	std::function<void()> onNextFile([&idx, &writer, &git, &printBatchFileData]
+	std::function<void(int64_t)> onNextFile([&idx, &writer, &git, &printBatchFileData, changelist, batch, batches](int64_t size)
 	    {
 			// For the first file, we don't need to run finalize on the previous
 			// file so we're done here.
 		    if (idx == -1)
 		    {
 			    idx++;
+			    writer.ExpectSize(size);
 			    return;
 		    }
 		    // First, finalize the previous file.
-		    printBatchFileData.at(idx)->SetBlobOID(writer.Close());
+		    {
+			    Watchdog::PhaseScope closePhase(changelist, Watchdog::Phase::BlobClose, batch, batches);
+			    printBatchFileData.at(idx)->SetBlobOID(writer.Close());
+		    }
 			// Now step one file further.
 		    idx++;
 			// And start a write for the next file.
-		    writer = git.WriteBlob(); });
+		    writer = git.WriteBlob();
+		    writer.ExpectSize(size); });
 
-	std::function<void(const char*, int)> onWrite([&writer](const char* contents, int length)
+	int64_t bytes = 0;
+	std::function<void(const char*, int)> onWrite([&writer, &bytes, &ctx](const char* contents, int length)
 	    {
 		    // Write a chunk of the data to the currently processed file.
-		    writer.Write(contents, length); });
+		    writer.Write(contents, length);
+		    bytes += length;
+		    ctx.inFlightBytes.fetch_add(length, std::memory_order_relaxed); });
 
+	const TimePoint printStart = Timer::Now();
 	PrintResult printResp
 	    = p4.PrintFiles(fileRevisions, onNextFile, onWrite);
+	stats.printNs += (Timer::Now() - printStart).count();
+	stats.bytes += bytes;
+	stats.retries += p4.GetLastRetries();
 	if (printResp.HasError())
 	{
 		throw std::runtime_error(printResp.PrintError());
@@ -84,15 +148,18 @@ void flush(P4API& p4, GitAPI& git, const std::vector<std::shared_ptr<FileData>>&
 	// to the ODB still, so let's do that.
 	if (idx > -1)
 	{
+		Watchdog::PhaseScope closePhase(changelist, Watchdog::Phase::BlobClose, batch, batches);
 		printBatchFileData.back()->SetBlobOID(writer.Close());
 	}
 }
 
-void ChangeList::StartDownload(P4API& p4, GitAPI& git, const BranchSet& branchSet, const int& printBatch)
+void ChangeList::StartDownload(P4API& p4, GitAPI& git, const DownloadContext& ctx, const int64_t priority)
 {
-	MTR_SCOPE("ChangeList", __func__);
+	TRACE_SCOPE("ChangeList", __func__);
+
+	stats.queued = Timer::Now() - stats.queuedAt;
 
-	if (branchSet.HasMergeableBranch())
+	if (ctx.branchSet.HasMergeableBranch())
 	{
 		// If we care about branches, we need to run filelog to get where the file came from.
 		// Note that the filelog won't include the source changelist, but
@@ -100,24 +167,46 @@ void ChangeList::StartDownload(P4API& p4, GitAPI& git, const BranchSet& branchSe
 		// copy will have the target files listing the from-file with
 		// different changelists than the point-in-time source branch's
 		// changelist.
+		Watchdog::PhaseScope phase(number, Watchdog::Phase::FileLog);
+		const TimePoint start = Timer::Now();
 		const FileLogResult& filelog = p4.FileLog(number);
+		stats.filelog = Timer::Now() - start;
+		stats.retries += p4.GetLastRetries();
 		if (filelog.HasError())
 		{
 			throw std::runtime_error(filelog.PrintError());
 		}
-		changedFileGroups = branchSet.ParseAffectedFiles(filelog.GetFileData());
+		changedFileGroups = ctx.branchSet.ParseAffectedFiles(filelog.GetFileData());
 	}
 	else
 	{
 		// If we don't care about branches, then p4->Describe is much faster.
+		Watchdog::PhaseScope phase(number, Watchdog::Phase::Describe);
+		const TimePoint start = Timer::Now();
 		const DescribeResult& describe = p4.Describe(number);
+		stats.describe = Timer::Now() - start;
+		stats.retries += p4.GetLastRetries();
 		if (describe.HasError())
 		{
 			ERR("Failed to describe changelist: " << describe.PrintError())
 			throw std::runtime_error(describe.PrintError());
 		}
-		changedFileGroups = branchSet.ParseAffectedFiles(describe.GetFileData());
+		changedFileGroups = ctx.branchSet.ParseAffectedFiles(describe.GetFileData());
+	}
+
+	// Count the batches up front, so that each one knows its place for the
+	// stall report.
+	int filesToDownload = 0;
+	for (const auto& branchedFileGroup : changedFileGroups->branchedFileGroups)
+	{
+		for (const auto& fileData : branchedFileGroup.files)
+		{
+			filesToDownload += fileData.IsDownloadNeeded() ? 1 : 0;
+		}
 	}
+	const int batchSize = std::max(1, ctx.printBatch);
+	const int batches = (filesToDownload + batchSize - 1) / batchSize;
+	int batch = 0;
 
 	std::vector<std::shared_ptr<FileData>> printBatchFileData;
 	// Only perform the group inspection if there are files.
@@ -133,39 +222,75 @@ void ChangeList::StartDownload(P4API& p4, GitAPI& git, const BranchSet& branchSe
 					fileData.SetPendingDownload();
 					printBatchFileData.push_back(std::make_shared<FileData>(fileData));
 
-					// Clear the batches if it fits
-					if (printBatchFileData.size() >= printBatch)
+					// Hand off the batch to the thread pool if it is full.
+					if (printBatchFileData.size() >= ctx.printBatch)
 					{
-						flush(p4, git, printBatchFileData);
+						scheduleBatch(ctx, priority, ++batch, batches, std::move(printBatchFileData));
 
 						// We let go of the refs held by us and create new ones to queue the next batch
 						printBatchFileData.clear();
-						// Now only the thread job has access to the older batch
+						// Now only the batch job has access to the older batch
 					}
 				}
 			}
 		}
 	}
 
-	// Flush any remaining files that were smaller in number than the total batch size.
-	// Additionally, signal the batch processing end.
-	flush(p4, git, printBatchFileData);
+	// Flush any remaining files that were smaller in number than the total batch size
+	// on this thread.
+	flush(p4, git, ctx, number, batch + 1, batches, stats, printBatchFileData);
+	finishDownloadJob(ctx);
+}
+
+void ChangeList::scheduleBatch(const DownloadContext& ctx, const int64_t priority, const int batch, const int batches, std::vector<std::shared_ptr<FileData>>&& printBatchFileData)
+{
+	// Count the job before it is queued, so the changelist can't be marked
+	// as downloaded while the batch is still waiting in the queue.
+	pendingDownloadJobs.fetch_add(1, std::memory_order_relaxed);
+
+	// The batch gets the priority of its changelist. Since that is the
+	// sequence number of the changelist, the batches of the changelist the
+	// committer is waiting on are always picked before any lookahead work.
+	ctx.pool.AddJob([this, &ctx, batch, batches, files = std::move(printBatchFileData)](P4API& p4, GitAPI& git)
+	    {
+		    flush(p4, git, ctx, number, batch, batches, stats, files);
+		    finishDownloadJob(ctx); },
+	    priority);
+}
+
+void ChangeList::finishDownloadJob(const DownloadContext& ctx)
+{
+	if (pendingDownloadJobs.fetch_sub(1, std::memory_order_acq_rel) > 1)
 	{
-		std::unique_lock<std::mutex> lock(*commitMutex);
-		*downloadJobsCompleted = true;
-		if (waiting)
-		{
-			commitCV->notify_all();
-		}
+		return;
 	}
+
+	// This was the last job. From here on the committer may move or destroy the
+	// changelist at any time, so only the shared context is touched: bumping
+	// the counter wakes up the committer if it is waiting on this changelist.
+	ctx.downloaded.fetch_add(1, std::memory_order_release);
+	ctx.downloaded.notify_all();
+}
+
+int64_t ChangeList::MemoryUsage() const
+{
+	return sizeof(ChangeList) + MemoryAccounting::StringBytes(user) + MemoryAccounting::StringBytes(description);
 }
 
-void ChangeList::WaitForDownload()
+void ChangeList::WaitForDownload(const DownloadContext& ctx) const
 {
-	MTR_SCOPE("ChangeList", __func__);
+	TRACE_SCOPE("ChangeList", __func__);
 
-	std::unique_lock<std::mutex> lock(*commitMutex);
-	waiting = true;
-	commitCV->wait(lock, [this]()
-	    { return downloadJobsCompleted->load(); });
+	while (true)
+	{
+		// Read the counter before checking our own jobs: if the last job
+		// finishes in between, the counter has moved on and wait returns
+		// right away.
+		const int downloaded = ctx.downloaded.load(std::memory_order_acquire);
+		if (pendingDownloadJobs.load(std::memory_order_acquire) == 0)
+		{
+			return;
+		}
+		ctx.downloaded.wait(downloaded, std::memory_order_acquire);
+	}
 }
@@ -7,15 +7,53 @@
 #pragma once
 
 #include <memory>
-#include <condition_variable>
 #include <atomic>
-#include <mutex>
+#include <chrono>
 
 #include "common.h"
 #include "../branch_set.h"
+#include "../utils/timer.h"
 
 class P4API;
 class GitAPI;
+class ThreadPool;
+
+// DownloadContext holds the state shared by the download jobs of all changelists.
+struct DownloadContext
+{
+	const BranchSet& branchSet;
+	const int printBatch;
+	ThreadPool& pool;
+	// Number of changelists that have been fully downloaded. The committer
+	// waits on changes of this counter.
+	std::atomic<int>& downloaded;
+	// Bytes of file contents downloaded for changelists that have not been
+	// committed yet. Workers add to it while printing, the committer
+	// subtracts the bytes of every changelist it commits.
+	std::atomic<int64_t>& inFlightBytes;
+};
+
+/*
+ * ChangeListStats collects where the time for downloading a changelist went,
+ * for the ledger. Print batches of one changelist run in parallel, so the
+ * fields they update are atomic.
+ */
+struct ChangeListStats
+{
+	// Set when the changelist is handed to the thread pool.
+	TimePoint queuedAt;
+	std::chrono::nanoseconds queued { 0 };
+	std::chrono::nanoseconds describe { 0 };
+	std::chrono::nanoseconds filelog { 0 };
+	// Summed over all print batches.
+	std::atomic<int64_t> printNs { 0 };
+	std::atomic<int64_t> bytes { 0 };
+	std::atomic<int> retries { 0 };
+
+	ChangeListStats() = default;
+	ChangeListStats(ChangeListStats&& other) noexcept;
+	ChangeListStats& operator=(ChangeListStats&& other) noexcept;
+};
 
 struct ChangeList
 {
@@ -23,21 +61,35 @@ struct ChangeList
 	std::string user;
 	std::string description;
 	int64_t timestamp = 0;
-	bool waiting;
 	std::unique_ptr<ChangedFileGroups> changedFileGroups = ChangedFileGroups::Empty();
+	ChangeListStats stats;
 
 	ChangeList(const int& clNumber, std::string&& clDescription, std::string&& userID, const int64_t& clTimestamp);
 	ChangeList() = delete;
 	ChangeList(const ChangeList& other) = delete;
 	ChangeList& operator=(const ChangeList&) = delete;
-	ChangeList(ChangeList&&) = default;
-	ChangeList& operator=(ChangeList&&) = default;
+	// A changelist must only be moved while none of its download jobs are
+	// queued or running.
+	ChangeList(ChangeList&& other) noexcept;
+	ChangeList& operator=(ChangeList&& other) noexcept;
 
-	void StartDownload(P4API& p4, GitAPI& git, const BranchSet& branchSet, const int& printBatch);
-	void WaitForDownload();
+	// StartDownload describes the changelist and downloads its files. Full print
+	// batches are handed to the thread pool as separate jobs with the same
+	// priority, so that a large changelist is downloaded by several workers.
+	void StartDownload(P4API& p4, GitAPI& git, const DownloadContext& ctx, int64_t priority);
+	// WaitForDownload blocks until all download jobs of the changelist have finished.
+	void WaitForDownload(const DownloadContext& ctx) const;
+
+	// MemoryUsage estimates the bytes held by the changelist metadata, not
+	// counting its file groups.
+	[[nodiscard]] int64_t MemoryUsage() const;
 
 private:
-	std::shared_ptr<std::mutex> commitMutex = std::make_shared<std::mutex>();
-	std::shared_ptr<std::atomic<bool>> downloadJobsCompleted = std::make_shared<std::atomic<bool>>(false);
-	std::shared_ptr<std::condition_variable> commitCV = std::make_shared<std::condition_variable>();
+	// Number of download jobs of this changelist that have not finished yet.
+	// Starts at one for the job running StartDownload. Once it drops to zero,
+	// the jobs no longer touch the changelist.
+	std::atomic<int> pendingDownloadJobs { 1 };
+
+	void scheduleBatch(const DownloadContext& ctx, int64_t priority, int batch, int batches, std::vector<std::shared_ptr<FileData>>&& printBatchFileData);
+	void finishDownloadJob(const DownloadContext& ctx);
 };
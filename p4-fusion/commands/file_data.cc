@@ -6,6 +6,8 @@
  */
 #include "file_data.h"
 
+#include "memory_accounting.h"
+
 FileAction extrapolateFileAction(std::string& action);
 
 FileDataStore::FileDataStore(std::string& _depotFile, std::string& _revision, std::string& action, std::string& type)
@@ -180,3 +182,17 @@ FileAction extrapolateFileAction(std::string& action)
 	WARN("Found an unsupported action " << action << "; assuming edit")
 	return FileAction::FileEdit;
 }
+
+int64_t FileData::MemoryUsage() const
+{
+	// make_shared allocates the store and its control block together.
+	constexpr int64_t fixedBytes = sizeof(FileData) + sizeof(FileDataStore) + 2 * sizeof(long)
+	    // The blob OID is 40 hex characters.
+	    + sizeof(std::string) + 41;
+	return fixedBytes
+	    + MemoryAccounting::StringBytes(m_data->depotFile)
+	    + MemoryAccounting::StringBytes(m_data->revision)
+	    + MemoryAccounting::StringBytes(m_data->fromDepotFile)
+	    + MemoryAccounting::StringBytes(m_data->fromRevision)
+	    + MemoryAccounting::StringBytes(m_data->relativePath);
+}
@@ -107,4 +107,8 @@ public:
 
 	[[nodiscard]] bool IsBinary() const { return m_data->isBinary; };
 	[[nodiscard]] bool IsExecutable() const { return m_data->isExecutable; };
+
+	// MemoryUsage estimates the bytes held by this file, including the blob
+	// OID it gets once downloaded.
+	[[nodiscard]] int64_t MemoryUsage() const;
 };
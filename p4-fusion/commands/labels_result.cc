@@ -18,5 +18,13 @@ void LabelsResult::OutputStat(StrDict* varList)
 		return;
 	}
 
-	m_Labels.emplace_back(LabelsResult::LabelData { .label = labelIDPtr->Text(), .update = updatePtr->Text() });
+	StrPtr* revisionPtr = varList->GetVar("Revision");
+	StrPtr* descriptionPtr = varList->GetVar("Description");
+
+	m_Labels.emplace_back(LabelsResult::LabelData {
+	    .label = labelIDPtr->Text(),
+	    .update = updatePtr->Text(),
+	    .revision = revisionPtr ? revisionPtr->Text() : "",
+	    .description = descriptionPtr ? descriptionPtr->Text() : "",
+	});
 }
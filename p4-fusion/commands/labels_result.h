@@ -16,6 +16,9 @@ public:
 	{
 		std::string label;
 		std::string update; // Last updated at timestamp in unix time
+		// Only set if the server includes them in the labels output.
+		std::string revision;
+		std::string description;
 	};
 
 private:
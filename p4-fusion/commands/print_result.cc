@@ -6,9 +6,32 @@
  */
 #include "print_result.h"
 
+#include <cstdlib>
+#include <cstring>
 #include <utility>
 
-PrintResult::PrintResult(std::function<void()> _onNextFile, std::function<void(const char*, int)> _onFileContentChunk)
+#include "p4_api.h"
+#include "metrics.h"
+
+namespace
+{
+// isVerbatim returns true if files of the given type are printed byte for
+// byte as stored, so that their size is known before the contents arrive.
+bool isVerbatim(const char* type)
+{
+	const char* modifiers = std::strchr(type, '+');
+	const std::string base = modifiers ? std::string(type, modifiers - type) : std::string(type);
+	// Text may have its line endings translated for the LineEnd of the client
+	// spec, unicode files may be translated to the client charset and the k
+	// types expand keywords, so only binary types are printed as stored.
+	if (base != "binary" && base != "xbinary" && base != "ubinary" && base != "uxbinary" && base != "tempobj" && base != "xtempobj" && base != "ctempobj")
+	{
+		return false;
+	}
+	return !modifiers || !std::strchr(modifiers, 'k');
+}}
+
+PrintResult::PrintResult(std::function<void(int64_t)> _onNextFile, std::function<void(const char*, int)> _onFileContentChunk)
     : onNextFile(std::move(_onNextFile))
     , onFileContentChunk(std::move(_onFileContentChunk))
 {
@@ -16,11 +39,20 @@ PrintResult::PrintResult(std::function<void()> _onNextFile, std::function<void(c
 
 void PrintResult::OutputStat(StrDict* varList)
 {
-	onNextFile();
+	const StrPtr* size = varList->GetVar("fileSize");
+	const StrPtr* type = varList->GetVar("type");
+	onNextFile(size && type && isVerbatim(type->Text()) ? std::atoll(size->Text()) : -1);
 }
 
 void PrintResult::OutputText(const char* data, int length)
 {
+	static Metric& printBytes = Metrics::Counter("p4_print_bytes_total", "Bytes of file contents received from p4 print.");
+	printBytes.Add(length);
+
+	if (P4API::RateLimits)
+	{
+		P4API::RateLimits->ThrottleBytes(length);
+	}
 	onFileContentChunk(data, length);
 }
 
@@ -14,7 +14,7 @@
 class PrintResult : public Result
 {
 private:
-	std::function<void()> onNextFile;
+	std::function<void(int64_t)> onNextFile;
 	std::function<void(const char*, int)> onFileContentChunk;
 
 public:
@@ -25,12 +25,14 @@ public:
 	 * The files are printed by the server in the order in they appear when talking to the
 	 * helix API.
 	 *
-	 * Before each file, the onNextFile callback will be called.
+	 * Before each file, the onNextFile callback will be called with the size of
+	 * the file, or -1 if the printed contents may differ in size from the file
+	 * on the server, e.g. because of keyword expansion.
 	 * Then, onFileContentChunk is called until the whole file is printed.
 	 * Once done, no more invocations are done.
 	 * Think of this like a tar archive reader: File Header, Content, File Header, Content, end.
 	 */
-	PrintResult(std::function<void()> onNextFile, std::function<void(const char*, int)> onFileContentChunk);
+	PrintResult(std::function<void(int64_t)> onNextFile, std::function<void(const char*, int)> onFileContentChunk);
 	void OutputStat(StrDict* varList) override;
 	void OutputText(const char* data, int length) override;
 	void OutputBinary(const char* data, int length) override;
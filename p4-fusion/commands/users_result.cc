@@ -6,6 +6,17 @@
  */
 #include "users_result.h"
 
+void UsersResult::HandleError(Error* e)
+{
+	// Asking for users the server doesn't know, like deleted ones, warns
+	// about each of them. They are simply missing from the result.
+	if (!e->IsError())
+	{
+		return;
+	}
+	Result::HandleError(e);
+}
+
 void UsersResult::OutputStat(StrDict* varList)
 {
 	StrPtr* userIDPtr = varList->GetVar("User");
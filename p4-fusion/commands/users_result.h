@@ -27,4 +27,5 @@ public:
 	[[nodiscard]] const std::unordered_map<UserID, UserData>& GetUserEmails() const { return m_Users; }
 
 	void OutputStat(StrDict* varList) override;
+	void HandleError(Error* e) override;
 };
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "concurrency_limiter.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+ConcurrencyLimiter::ConcurrencyLimiter(const int minLimit, const int maxLimit)
+    : m_MinLimit(std::max(1, minLimit))
+    , m_MaxLimit(std::max(std::max(1, minLimit), maxLimit))
+{
+	// Start in the middle of the allowed range, the AIMD loop quickly finds
+	// the right value from there in either direction.
+	m_Limit = (m_MinLimit + m_MaxLimit) / 2.0;
+}
+
+void ConcurrencyLimiter::Acquire()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_CV.wait(lock, [this]()
+	    { return m_InFlight < (int)m_Limit; });
+	m_InFlight++;
+}
+
+void ConcurrencyLimiter::Release(const std::string& command, const std::chrono::nanoseconds latency, const bool failed)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	if (m_InFlight <= 0)
+	{
+		throw std::logic_error("ConcurrencyLimiter::Release called without Acquire");
+	}
+	m_InFlight--;
+
+	// The latency of print grows with the size of the printed files, so a
+	// single large file would look like an overloaded server. Only its
+	// failures count.
+	if (command == "print")
+	{
+		if (failed)
+		{
+			decrease(MinDecreaseCooldown);
+		}
+		else
+		{
+			increase();
+		}
+		m_CV.notify_all();
+		return;
+	}
+
+	const double seconds = std::chrono::duration<double>(latency).count();
+
+	auto it = m_AverageLatency.find(command);
+	if (it == m_AverageLatency.end())
+	{
+		// The first sample becomes the baseline for this command.
+		it = m_AverageLatency.insert({ command, seconds }).first;
+	}
+	const double average = it->second;
+	it->second = average + (seconds - average) * LatencyAverageWeight;
+
+	if (failed || seconds > average * LatencyTolerance)
+	{
+		// Wait at least one average round trip of this command before reacting
+		// again, so that only commands started under the new limit count.
+		auto cooldown = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(average));
+		decrease(std::max<std::chrono::nanoseconds>(cooldown, MinDecreaseCooldown));
+	}
+	else
+	{
+		increase();
+	}
+
+	m_CV.notify_all();
+}
+
+void ConcurrencyLimiter::increase()
+{
+	m_Limit = std::min<double>(m_MaxLimit, m_Limit + 1.0 / m_Limit);
+}
+
+void ConcurrencyLimiter::decrease(const std::chrono::nanoseconds cooldown)
+{
+	const TimePoint now = Timer::Now();
+	if (now - m_LastDecrease < cooldown)
+	{
+		return;
+	}
+	m_LastDecrease = now;
+	m_Limit = std::max<double>(m_MinLimit, m_Limit * BackoffRatio);
+	m_DecreaseCount++;
+}
+
+int ConcurrencyLimiter::GetLimit() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return (int)m_Limit;
+}
+
+int ConcurrencyLimiter::GetInFlight() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_InFlight;
+}
+
+int ConcurrencyLimiter::GetDecreaseCount() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_DecreaseCount;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "utils/timer.h"
+
+/*
+ * ConcurrencyLimiter bounds the number of Perforce commands that are in flight
+ * across all network threads at the same time.
+ *
+ * The limit moves between minLimit and maxLimit using additive-increase,
+ * multiplicative-decrease (AIMD): every command that completes in time and
+ * without errors grows the limit by 1/limit, so a full window of healthy
+ * commands grows it by one. A command that failed, or took much longer than
+ * the running average for that command, shrinks the limit by BackoffRatio.
+ * The latency of print depends on the size of the files, so only its failures
+ * shrink the limit.
+ * Decreases are applied at most once per cooldown period so that a burst of
+ * slow commands which were all started under the old limit doesn't collapse
+ * the window to its minimum.
+ */
+class ConcurrencyLimiter
+{
+public:
+	// How much slower than the running average a command may be before it is
+	// treated as a sign of an overloaded server.
+	static constexpr double LatencyTolerance = 2.0;
+	// Factor the limit is multiplied with on every decrease.
+	static constexpr double BackoffRatio = 0.75;
+	// Weight of a new sample in the running average latency of a command.
+	static constexpr double LatencyAverageWeight = 0.05;
+	// Minimum time between two decreases of the limit.
+	static constexpr std::chrono::milliseconds MinDecreaseCooldown { 250 };
+
+	ConcurrencyLimiter(int minLimit, int maxLimit);
+	ConcurrencyLimiter() = delete;
+
+	// Acquire blocks until a command is allowed to be sent to the server.
+	void Acquire();
+	// Release must be called once for every Acquire, after the command finished.
+	void Release(const std::string& command, std::chrono::nanoseconds latency, bool failed);
+
+	[[nodiscard]] int GetLimit() const;
+	[[nodiscard]] int GetInFlight() const;
+	[[nodiscard]] int GetMinLimit() const { return m_MinLimit; }
+	[[nodiscard]] int GetMaxLimit() const { return m_MaxLimit; }
+	[[nodiscard]] int GetDecreaseCount() const;
+
+private:
+	mutable std::mutex m_Mutex;
+	std::condition_variable m_CV;
+
+	const int m_MinLimit;
+	const int m_MaxLimit;
+	double m_Limit;
+	int m_InFlight = 0;
+	int m_DecreaseCount = 0;
+	TimePoint m_LastDecrease;
+
+	// Running average latency per command name, in seconds.
+	std::unordered_map<std::string, double> m_AverageLatency;
+
+	void increase();
+	void decrease(std::chrono::nanoseconds cooldown);
+};
@@ -6,13 +6,42 @@
  */
 #include "git_api.h"
 
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <sstream>
 
 #include "git2.h"
-#include "minitrace.h"
+#include "openssl/evp.h"
+#include "trace.h"
+#include "metrics.h"
+#include "changelist_index.h"
+#include "packed_refs.h"
+#include "memory_accounting.h"
 #include "labels_conversion.h"
 #include "utils/std_helpers.h"
 
+// rootCommitRef points at the root commit of the converted history, so that
+// it doesn't have to be searched for on every run.
+constexpr const char* rootCommitRef = "refs/p4-fusion/root";
+
+// changelistIndexFile is kept in the repository, next to the other files
+// p4-fusion writes there.
+constexpr const char* changelistIndexFile = "changelists.idx";
+
+// appliedTagsFile records the tags created from labels by the previous run,
+// to only update the tags of labels that changed since.
+constexpr const char* appliedTagsFile = "tags.applied";
+constexpr const char* appliedTagsMagic = "p4-fusion tags v1";
+
+// libgit2 buffers every blob stream in memory before spilling it to a
+// temporary file, see git_blob_create_from_stream.
+constexpr int64_t blobStreamBufferBytes = 2 * 1024 * 1024;
+
+// Estimated bytes of an index entry besides its path: the entry itself, the
+// path length, and its slots in the entry list and path map.
+constexpr int64_t indexEntryBytes = sizeof(git_index_entry) + sizeof(size_t) + 3 * sizeof(void*);
+
 void checkGit2Error(int errcode)
 {
 	if (errcode < 0)
@@ -60,6 +89,7 @@ GitAPI::~GitAPI()
 		git_index_free(it->second);
 	}
 	lastBranchTree.clear();
+	MemoryAccounting::Add(MemoryAccounting::Stage::GitIndexes, -m_AccountedIndexBytes);
 
 	if (m_Repo)
 	{
@@ -98,6 +128,12 @@ void GitAPI::OpenRepository()
 	checkGit2Error(git_repository_open_bare(&m_Repo, repoPath.c_str()));
 }
 
+bool GitAPI::OpenExistingRepository()
+{
+	std::lock_guard<std::mutex> lock(repoMutex);
+	return git_repository_open_bare(&m_Repo, repoPath.c_str()) == 0;
+}
+
 void GitAPI::InitializeRepository(const bool noCreateBaseCommit)
 {
 	std::lock_guard<std::mutex> lock(repoMutex);
@@ -116,12 +152,23 @@ void GitAPI::InitializeRepository(const bool noCreateBaseCommit)
 		SUCCESS("Opened existing Git repository at " << repoPath)
 	}
 
+	m_ChangelistIndex = std::make_unique<ChangelistIndex>(repoPath + (repoPath.back() == '/' ? "" : "/") + changelistIndexFile);
+	m_ChangelistIndex->Sync(m_Repo);
+
 	// Now that we have a bare repo (potentially empty), we can go ahead and determine
 	// our common merge commit.
 	// If HEAD exists, we use the root commit of the branch HEAD is pointing to.
 	if (IsHEADExists())
 	{
-		PRINT("Finding root commit for HEAD")
+		if (loadRootCommit())
+		{
+			SUCCESS("Starting from commit " << git_oid_tostr_s(&m_FirstCommitOid) << " (from " << rootCommitRef << ")")
+			return;
+		}
+
+		// Repositories created by older versions don't have the ref yet, and
+		// it may have been deleted, so find the root the slow way once.
+		WARN(rootCommitRef << " is missing or invalid, walking the history of HEAD to find the root commit")
 
 		// Walk the graph to find the root commit of the HEAD branch.
 		git_revwalk* walk;
@@ -132,6 +179,7 @@ void GitAPI::InitializeRepository(const bool noCreateBaseCommit)
 		{
 		}
 		git_revwalk_free(walk);
+		persistRootCommit();
 
 		SUCCESS("Starting from commit " << git_oid_tostr_s(&m_FirstCommitOid))
 	}
@@ -145,6 +193,8 @@ void GitAPI::InitializeRepository(const bool noCreateBaseCommit)
 		// Write an empty tree, so we can create an empty commit.
 		git_oid commitTreeID;
 		checkGit2Error(git_index_write_tree_to(&commitTreeID, idx, m_Repo));
+		static Metric& treesWritten = Metrics::Counter("git_trees_written_total", "Root trees written for commits.");
+		treesWritten.Add();
 
 		git_tree* commitTree = nullptr;
 		checkGit2Error(git_tree_lookup(&commitTree, m_Repo, &commitTreeID));
@@ -157,6 +207,7 @@ void GitAPI::InitializeRepository(const bool noCreateBaseCommit)
 		git_signature_free(author);
 		git_tree_free(commitTree);
 		git_index_free(idx);
+		persistRootCommit();
 
 		WARN("No HEAD commit was found. Created fresh index " << git_oid_tostr_s(&m_FirstCommitOid) << ".")
 	}
@@ -169,9 +220,45 @@ void GitAPI::InitializeRepository(const bool noCreateBaseCommit)
 	}
 }
 
+bool GitAPI::loadRootCommit()
+{
+	TRACE_SCOPE("Git", __func__);
+
+	git_oid oid;
+	const int errorCode = git_reference_name_to_id(&oid, m_Repo, rootCommitRef);
+	if (errorCode == GIT_ENOTFOUND)
+	{
+		return false;
+	}
+	checkGit2Error(errorCode);
+
+	// Only trust the ref if it still points at a root commit.
+	git_commit* commit = nullptr;
+	if (git_commit_lookup(&commit, m_Repo, &oid) != 0)
+	{
+		return false;
+	}
+	const unsigned int parents = git_commit_parentcount(commit);
+	git_commit_free(commit);
+	if (parents != 0)
+	{
+		return false;
+	}
+
+	m_FirstCommitOid = oid;
+	return true;
+}
+
+void GitAPI::persistRootCommit()
+{
+	git_reference* ref = nullptr;
+	checkGit2Error(git_reference_create(&ref, m_Repo, rootCommitRef, &m_FirstCommitOid, 1, "p4-fusion: root commit"));
+	git_reference_free(ref);
+}
+
 bool GitAPI::IsHEADExists() const
 {
-	MTR_SCOPE("Git", __func__);
+	TRACE_SCOPE("Git", __func__);
 
 	git_oid oid;
 	int errorCode = git_reference_name_to_id(&oid, m_Repo, "HEAD");
@@ -184,7 +271,14 @@ bool GitAPI::IsHEADExists() const
 
 std::string GitAPI::DetectLatestCL() const
 {
-	MTR_SCOPE("Git", __func__);
+	TRACE_SCOPE("Git", __func__);
+
+	// The index is synced with HEAD, so its latest changelist is the one of
+	// the HEAD commit.
+	if (m_ChangelistIndex && m_ChangelistIndex->Latest() >= 0)
+	{
+		return std::to_string(m_ChangelistIndex->Latest());
+	}
 
 	// Resolve HEAD to a reference.
 	git_oid oid;
@@ -227,7 +321,7 @@ std::string GitAPI::WriteChangelistBranch(
     const std::string& authorEmail,
     const std::string& mergeFrom)
 {
-	MTR_SCOPE("Git", __func__);
+	TRACE_SCOPE("Git", __func__);
 
 	std::string targetBranchRef = "HEAD";
 	git_index* idx;
@@ -241,6 +335,11 @@ std::string GitAPI::WriteChangelistBranch(
 		// Branch not seen yet, we need to load the index into memory.
 		if (!targetBranch.empty())
 		{
+			// Without refs of their own, all branches would be committed to
+			// HEAD, where files with the same path in different branches
+			// overwrite each other. main rejects --branch for that reason.
+			throw std::runtime_error("cannot convert to branch " + targetBranch + ", branches are not supported until they get refs of their own");
+
 			// targetBranchRef = "refs/heads/" + targetBranch;
 			// // Look up the branch.
 			// git_reference* branch;
@@ -312,6 +411,11 @@ std::string GitAPI::WriteChangelistBranch(
 				checkGit2Error(git_commit_tree(&headTree, headCommit));
 				// Load the current tree into the index.
 				checkGit2Error(git_index_read_tree(idx, headTree));
+				const size_t entries = git_index_entrycount(idx);
+				for (size_t i = 0; i < entries; i++)
+				{
+					m_IndexPathBytes += (int64_t)std::strlen(git_index_get_byindex(idx, i)->path) + 1;
+				}
 				git_tree_free(headTree);
 				git_commit_free(headCommit);
 			}
@@ -323,9 +427,11 @@ std::string GitAPI::WriteChangelistBranch(
 	for (auto& file : files)
 	{
 		auto relativePath = file.GetRelativePath();
+		const bool isIndexed = git_index_get_bypath(idx, relativePath.c_str(), 0) != nullptr;
 		if (file.IsDeleted())
 		{
 			checkGit2Error(git_index_remove_bypath(idx, relativePath.c_str()));
+			m_IndexPathBytes -= isIndexed ? (int64_t)relativePath.size() + 1 : 0;
 		}
 		else
 		{
@@ -343,8 +449,10 @@ std::string GitAPI::WriteChangelistBranch(
 			}
 
 			checkGit2Error(git_index_add(idx, &entry));
+			m_IndexPathBytes += isIndexed ? 0 : (int64_t)relativePath.size() + 1;
 		}
 	}
+	accountIndexes();
 
 	// Commit the index and move the ref of target branch forward to point to our
 	// new commit.
@@ -399,6 +507,22 @@ std::string GitAPI::WriteChangelistBranch(
 		// Next, write the commit object and point targetBranchRef to it.
 		git_oid commitID;
 		checkGit2Error(git_commit_create(&commitID, m_Repo, targetBranchRef.c_str(), author, author, "UTF-8", commitMsg.c_str(), commitTree, parentCount, (const git_commit**)parents));
+		static Metric& commitsWritten = Metrics::Counter("git_commits_written_total", "Commits written.");
+		commitsWritten.Add();
+
+		if (m_ChangelistIndex)
+		{
+			// Commits are indexed under the ref they were written to, which is
+			// always HEAD until branches get refs of their own.
+			m_ChangelistIndex->Append(cl.number, targetBranchRef == "HEAD" ? "" : targetBranchRef, commitID);
+		}
+
+		// Without a base commit, the first commit of the conversion is the root.
+		if (parentCount == 0 && git_oid_is_zero(&m_FirstCommitOid))
+		{
+			m_FirstCommitOid = commitID;
+			persistRootCommit();
+		}
 
 		for (int i = 0; i < parentCount; i++)
 		{
@@ -416,71 +540,172 @@ std::string GitAPI::WriteChangelistBranch(
 
 void GitAPI::CreateTagsFromLabels(LabelMap revToLabel)
 {
-	git_reference_iterator* refIter;
-	checkGit2Error(git_reference_iterator_glob_new(&refIter, m_Repo, "refs/tags/*"));
-	git_reference* ref;
-	while (git_reference_next(&ref, refIter) >= 0)
+	TRACE_SCOPE("Git", __func__);
+
+	if (!m_ChangelistIndex)
+	{
+		throw std::runtime_error("created tags before initializing the repository");
+	}
+
+	// Resolve every label to the commit of its changelist. This only reads
+	// the changelist index, no commits.
+	TagTargets wanted;
+	std::unordered_map<std::string, std::string> tagLabels;
+	for (auto& [clID, labels] : revToLabel)
 	{
-		std::string labelName = trim_prefix(git_reference_name(ref), "refs/tags/");
+		// Labels can point at dates or other labels, only changelists that
+		// were converted get tags.
+		char* end = nullptr;
+		const long number = std::strtol(clID.c_str(), &end, 10);
+		git_oid commitOid;
+		if (!clID.empty() && *end == '\0' && m_ChangelistIndex->Lookup((int)number, "", commitOid))
+		{
+			for (auto& [tag, label] : *labels)
+			{
+				wanted.insert({ tag, commitOid });
+				tagLabels.insert({ tag, label.label });
+			}
+		}
+		delete labels;
+	}
 
-		git_commit* commit;
-		checkGit2Error(git_commit_lookup(&commit, m_Repo, git_reference_target(ref)));
-		if (std::string cl = get_changelist_from_commit(commit); revToLabel.contains(cl) && revToLabel.at(cl)->contains(labelName))
+	// Only tags that differ from the previous run are written, so the cost
+	// of a run is proportional to the labels that changed.
+	TagTargets applied = readAppliedTags();
+	PackedRefs refs(repoPath);
+
+	int created = 0;
+	int moved = 0;
+	int restored = 0;
+	int deleted = 0;
+	for (auto it = applied.begin(); it != applied.end();)
+	{
+		if (wanted.contains(it->first))
 		{
-			revToLabel.at(cl)->erase(labelName);
-			if (revToLabel.at(cl)->empty())
+			it++;
+			continue;
+		}
+		PRINT("Tag no longer exists, deleting: " << it->first)
+		refs.Remove("refs/tags/" + it->first);
+		it = applied.erase(it);
+		deleted++;
+	}
+	for (const auto& [tag, target] : wanted)
+	{
+		const auto it = applied.find(tag);
+		if (it != applied.end() && git_oid_equal(&it->second, &target))
+		{
+			// The record is only trusted as long as the tag still points
+			// there, a tag deleted or moved by someone else is written again.
+			// This reads a loose ref or the cached packed-refs, it doesn't
+			// list all tags.
+			git_oid current;
+			if (git_reference_name_to_id(&current, m_Repo, ("refs/tags/" + tag).c_str()) == 0 && git_oid_equal(&current, &target))
 			{
-				delete revToLabel.at(cl);
-				revToLabel.erase(cl);
+				continue;
 			}
+			PRINT("Tag was changed outside of p4-fusion, restoring: " << tag)
+			restored++;
 		}
 		else
 		{
-			PRINT("Tag has moved or no longer exists, deleting: " << labelName)
-			checkGit2Error(git_reference_delete(ref));
+			PRINT((it == applied.end() ? "Creating tag: " : "Tag has moved, updating: ") << tag)
+			(it == applied.end() ? created : moved)++;
 		}
-		git_commit_free(commit);
-		git_reference_free(ref);
+		// validate-migration.sh reads the label of every tag from this line.
+		PRINT("TAG:" << tag << ":" << tagLabels.at(tag))
+		refs.Set("refs/tags/" + tag, target);
+		applied[tag] = target;
 	}
-	git_reference_iterator_free(refIter);
 
-	PRINT("Creating new tags, if any...")
+	// All changes land in one rewrite of packed-refs, rather than a loose ref
+	// file per tag.
+	const std::vector<std::string> rejected = refs.Commit();
+	for (const std::string& refName : rejected)
+	{
+		applied.erase(trim_prefix(refName, "refs/tags/"));
+	}
+	writeAppliedTags(applied);
 
-	git_reference* head;
-	checkGit2Error(git_repository_head(&head, m_Repo));
+	SUCCESS("Created " << created << ", moved " << moved << ", restored " << restored << " and deleted " << deleted << " tags, " << rejected.size() << " of them failed because of conflicting names, " << applied.size() << " tags in total")
+}
 
-	git_commit* current_commit;
-	checkGit2Error(git_commit_lookup(&current_commit, m_Repo, git_reference_target(head)));
-	git_reference_free(head);
+std::string GitAPI::appliedTagsPath() const
+{
+	return repoPath + (repoPath.back() == '/' ? "" : "/") + appliedTagsFile;
+}
 
-	git_commit* parent_commit;
+GitAPI::TagTargets GitAPI::readAppliedTags() const
+{
+	TagTargets applied;
 
-	while (true)
+	std::ifstream file(appliedTagsPath());
+	std::string line;
+	if (file && std::getline(file, line) && line == appliedTagsMagic)
 	{
-		std::string clID = get_changelist_from_commit(current_commit);
-		if (revToLabel.contains(clID))
+		// Lines are "<commit> <tag>", tag names never contain whitespace.
+		while (std::getline(file, line))
 		{
-			for (auto& [_, v] : *revToLabel.at(clID))
+			git_oid oid;
+			if (line.size() <= GIT_OID_HEXSZ + 1 || line[GIT_OID_HEXSZ] != ' ' || git_oid_fromstrn(&oid, line.c_str(), GIT_OID_HEXSZ) != 0)
 			{
-
-				PRINT("TAG:" << convert_label_to_tag(v.label) << ":" << v.label)
-				git_reference* tmpref;
-				checkGit2Error(git_reference_create(&tmpref, m_Repo, ("refs/tags/" + convert_label_to_tag(v.label)).c_str(), git_commit_id(current_commit), false, v.description.c_str()));
-				git_reference_free(tmpref);
+				WARN("Ignoring malformed line in " << appliedTagsPath() << ": " << line)
+				continue;
 			}
-			delete revToLabel.at(clID);
+			applied[line.substr(GIT_OID_HEXSZ + 1)] = oid;
+		}
+		return applied;
+	}
+
+	// Without a record of the previous run, e.g. for repositories converted
+	// by older versions, start from the tags in the repository. This lists
+	// all tags once, later runs don't.
+	PRINT("No record of converted tags at " << appliedTagsPath() << ", reading the existing tags")
+	git_reference_iterator* refIter;
+	checkGit2Error(git_reference_iterator_glob_new(&refIter, m_Repo, "refs/tags/*"));
+	git_reference* ref;
+	while (git_reference_next(&ref, refIter) >= 0)
+	{
+		git_reference* resolved = nullptr;
+		if (git_reference_resolve(&resolved, ref) == 0)
+		{
+			applied[trim_prefix(git_reference_name(ref), "refs/tags/")] = *git_reference_target(resolved);
+			git_reference_free(resolved);
+		}
+		git_reference_free(ref);
+	}
+	git_reference_iterator_free(refIter);
+	return applied;
+}
+
+void GitAPI::writeAppliedTags(const TagTargets& applied) const
+{
+	// Replace the file in one step, so that an interrupted run leaves the
+	// previous record behind.
+	const std::string path = appliedTagsPath();
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::trunc);
+		file << appliedTagsMagic << '\n';
+		char hex[GIT_OID_HEXSZ + 1];
+		for (const auto& [tag, oid] : applied)
+		{
+			git_oid_tostr(hex, sizeof(hex), &oid);
+			file << hex << ' ' << tag << '\n';
 		}
-		if (git_commit_parentcount(current_commit) == 0)
+		if (!file.flush())
 		{
-			git_commit_free(current_commit);
-			break;
+			throw std::runtime_error("failed to write " + tmpPath);
 		}
-		checkGit2Error(git_commit_parent(&parent_commit, current_commit, 0));
-		git_commit_free(current_commit);
-		current_commit = parent_commit;
+	}
+	if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		throw std::runtime_error("failed to replace " + path);
 	}
 }
 
+BlobWriter::Sink BlobWriter::ContentSink = BlobWriter::Sink::ObjectDatabase;
+
 BlobWriter::BlobWriter(git_repository* gitRepo)
     : repo(gitRepo)
     , writer(nullptr)
@@ -488,9 +713,15 @@ BlobWriter::BlobWriter(git_repository* gitRepo)
 {
 }
 
+void BlobWriter::HashContextDeleter::operator()(evp_md_ctx_st* ctx) const
+{
+	EVP_MD_CTX_free(ctx);
+}
+
 BlobWriter GitAPI::WriteBlob() const
 {
-	if (m_Repo == nullptr)
+	// Only the object database sink writes to the repository.
+	if (m_Repo == nullptr && BlobWriter::ContentSink == BlobWriter::Sink::ObjectDatabase)
 	{
 		throw std::runtime_error("created blob writer before opening repository");
 	}
@@ -500,24 +731,61 @@ BlobWriter GitAPI::WriteBlob() const
 
 void BlobWriter::Write(const char* contents, int length)
 {
-	MTR_SCOPE("BlobWriter", __func__);
+	TRACE_SCOPE("BlobWriter", __func__);
 
 	if (state == State::Closed)
 	{
 		throw std::runtime_error("Called BlobWriter::Write after Close");
 	}
 
+	if (ContentSink == Sink::Discard)
+	{
+		state = State::ReadyToWrite;
+		return;
+	}
+	if (ContentSink == Sink::Hash)
+	{
+		if (state == State::Uninitialized && expectedSize >= 0)
+		{
+			// Git hashes the object header followed by the contents.
+			const std::string header = "blob " + std::to_string(expectedSize) + '\0';
+			hash.reset(EVP_MD_CTX_new());
+			if (!hash || EVP_DigestInit_ex(hash.get(), EVP_sha1(), nullptr) != 1 || EVP_DigestUpdate(hash.get(), header.data(), header.size()) != 1)
+			{
+				throw std::runtime_error("failed to start hashing blob");
+			}
+		}
+		state = State::ReadyToWrite;
+
+		if (hash)
+		{
+			if (EVP_DigestUpdate(hash.get(), contents, length) != 1)
+			{
+				throw std::runtime_error("failed to hash blob");
+			}
+			hashedBytes += length;
+			return;
+		}
+		buffer.append(contents, length);
+		MemoryAccounting::Add(MemoryAccounting::Stage::BlobStreams, length);
+		return;
+	}
+
 	if (state == State::Uninitialized)
 	{
 		checkGit2Error(git_blob_create_from_stream(&writer, repo, nullptr));
 		state = State::ReadyToWrite;
+		MemoryAccounting::Add(MemoryAccounting::Stage::BlobStreams, blobStreamBufferBytes);
 	}
 	checkGit2Error(writer->write(writer, contents, length));
+
+	static Metric& blobBytesWritten = Metrics::Counter("git_blob_bytes_written_total", "Bytes of blob contents written to the object database.");
+	blobBytesWritten.Add(length);
 }
 
 std::string BlobWriter::Close()
 {
-	MTR_SCOPE("BlobWriter", __func__);
+	TRACE_SCOPE("BlobWriter", __func__);
 
 	if (state == State::Uninitialized)
 	{
@@ -532,8 +800,58 @@ std::string BlobWriter::Close()
 	}
 
 	git_oid objId;
+	if (ContentSink == Sink::Discard)
+	{
+		state = State::Closed;
+		return std::string(GIT_OID_HEXSZ, '0');
+	}
+	if (ContentSink == Sink::Hash && hash)
+	{
+		state = State::Closed;
+		if (hashedBytes != expectedSize)
+		{
+			// The Hash sink only measures, so a blob that doesn't match its
+			// announced size gets an object ID git wouldn't compute, rather
+			// than failing the run.
+			WARN("Blob has " << hashedBytes << " bytes, expected " << expectedSize << ", its object ID won't match git's")
+		}
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		if (EVP_DigestFinal_ex(hash.get(), digest, nullptr) != 1)
+		{
+			throw std::runtime_error("failed to hash blob");
+		}
+		hash.reset();
+		checkGit2Error(git_oid_fromraw(&objId, digest));
+		return git_oid_tostr_s(&objId);
+	}
+	if (ContentSink == Sink::Hash)
+	{
+		state = State::Closed;
+		MemoryAccounting::Add(MemoryAccounting::Stage::BlobStreams, -(int64_t)buffer.size());
+		checkGit2Error(git_odb_hash(&objId, buffer.data(), buffer.size(), GIT_OBJECT_BLOB));
+		std::string().swap(buffer);
+		return git_oid_tostr_s(&objId);
+	}
+
+	// The stream is freed even if committing it fails.
+	state = State::Closed;
+	MemoryAccounting::Add(MemoryAccounting::Stage::BlobStreams, -blobStreamBufferBytes);
 	checkGit2Error(git_blob_create_from_stream_commit(&objId, writer));
+	static Metric& blobsWritten = Metrics::Counter("git_blobs_written_total", "Blobs written to the object database.");
+	blobsWritten.Add();
 	auto oid = git_oid_tostr_s(&objId);
 	std::string strOID(oid);
 	return strOID;
 }
+
+void GitAPI::accountIndexes()
+{
+	int64_t entries = 0;
+	for (const auto& [branch, idx] : lastBranchTree)
+	{
+		entries += (int64_t)git_index_entrycount(idx);
+	}
+	const int64_t bytes = entries * indexEntryBytes + m_IndexPathBytes;
+	MemoryAccounting::Add(MemoryAccounting::Stage::GitIndexes, bytes - m_AccountedIndexBytes);
+	m_AccountedIndexBytes = bytes;
+}
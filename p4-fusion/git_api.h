@@ -6,6 +6,7 @@
  */
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <utility>
@@ -17,7 +18,11 @@
 #include "commands/label_result.h"
 #include "git2/oid.h"
 
+// OpenSSL's digest context, see HashContextDeleter.
+struct evp_md_ctx_st;
+
 struct git_repository;
+class ChangelistIndex;
 
 // LabelMap is a map of Perforce revisions to label names to label details
 // and is accessed with labelMap[revision][labelName], since each
@@ -26,9 +31,35 @@ using LabelMap = std::unordered_map<std::string, std::unordered_map<std::string,
 
 class BlobWriter
 {
+public:
+	// Sink selects what happens to the contents of blobs.
+	enum class Sink
+	{
+		// Write the blobs to the object database.
+		ObjectDatabase,
+		// Only compute the object IDs of the blobs, without writing them.
+		Hash,
+		// Drop the contents, every blob gets the zero object ID.
+		Discard,
+	};
+	// ContentSink applies to all blob writers, it is set once at startup.
+	static Sink ContentSink;
+
 private:
+	struct HashContextDeleter
+	{
+		void operator()(evp_md_ctx_st* ctx) const;
+	};
+
 	git_repository* repo;
 	git_writestream* writer;
+	// In Sink::Hash mode, blobs of a known size are hashed as they arrive.
+	// Since the object ID covers the size of the blob before its contents,
+	// blobs of unknown size are buffered until Close.
+	std::unique_ptr<evp_md_ctx_st, HashContextDeleter> hash;
+	int64_t expectedSize = -1;
+	int64_t hashedBytes = 0;
+	std::string buffer;
 	enum class State
 	{
 		Uninitialized,
@@ -40,6 +71,9 @@ public:
 	BlobWriter() = delete;
 	explicit BlobWriter(git_repository* repo);
 
+	// ExpectSize announces the size of the blob before the first Write, or -1
+	// if it isn't known.
+	void ExpectSize(int64_t size) { expectedSize = size; }
 	// Write creates a new ODB entry on the first call and continuous calls keep
 	// writing more data to it.
 	void Write(const char* contents, int length);
@@ -67,19 +101,43 @@ class GitAPI
 	std::string repoPath;
 	int timezoneMinutes;
 	std::unordered_map<std::string, git_index*> lastBranchTree;
+	// Bytes of the paths in all indexes of lastBranchTree, and the estimate
+	// of their memory last reported to MemoryAccounting.
+	int64_t m_IndexPathBytes = 0;
+	int64_t m_AccountedIndexBytes = 0;
+	// Commits of the converted changelists, only set up by InitializeRepository.
+	std::unique_ptr<ChangelistIndex> m_ChangelistIndex;
 	static std::mutex repoMutex;
 
+	void accountIndexes();
+	// loadRootCommit reads m_FirstCommitOid from the root commit ref, it
+	// returns false if the ref is missing or doesn't point at a root commit.
+	bool loadRootCommit();
+	void persistRootCommit();
+
+	// TagTargets maps tag names to the commits they point at.
+	using TagTargets = std::unordered_map<std::string, git_oid>;
+	[[nodiscard]] std::string appliedTagsPath() const;
+	[[nodiscard]] TagTargets readAppliedTags() const;
+	void writeAppliedTags(const TagTargets& applied) const;
+
 public:
 	GitAPI(std::string repoPath, int timezoneMinutes);
 	GitAPI() = delete;
 	~GitAPI();
 
+	// SetTimezoneMinutes changes the timezone of the commits written from now on.
+	void SetTimezoneMinutes(int minutes) { timezoneMinutes = minutes; }
+
 	// WriteBlob returns a new BlobWriter instance that allows to write a single
 	// blob to the repository's ODB.
 	[[nodiscard]] BlobWriter WriteBlob() const;
 
 	void InitializeRepository(bool noCreateBaseCommit);
 	void OpenRepository();
+	// OpenExistingRepository opens the repository without creating or
+	// changing anything, and returns false if there is none yet.
+	bool OpenExistingRepository();
 	[[nodiscard]] bool IsHEADExists() const;
 	[[nodiscard]] bool IsRepositoryClonedFrom(const std::string& depotPath) const;
 	/* Checks if a previous commit was made and extracts the corresponding changelist number. */
@@ -95,5 +153,6 @@ public:
 	    const std::string& authorEmail,
 	    const std::string& mergeFrom);
 
+	/* Creates, moves and deletes tags to match the labels, the map is freed. */
 	void CreateTagsFromLabels(LabelMap revToLabel);
 };
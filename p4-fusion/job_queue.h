@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+/*
+ * JobQueue is a concurrent priority queue for the thread pool, built to stay
+ * cheap with hundreds of workers and fine-grained jobs.
+ *
+ * Instead of one lock around one heap, the queue is split into shards, each
+ * a small heap with its own lock (a "MultiQueue"). Producers push into the
+ * shard of the calling worker, or round-robin when called from outside the
+ * pool. A worker pops from the best of three candidate shards: its own, a
+ * random one, and the shard holding the lowest priority in the queue. The
+ * candidates are compared by peeking at the published top priority of each
+ * shard, which doesn't need the shard lock. Only when all three are empty
+ * does a worker scan every shard, stealing from whichever holds the lowest
+ * priority job.
+ *
+ * Ordering across shards is therefore relaxed: a worker picks the lowest job
+ * it sees, not necessarily the lowest in the whole queue. The minimum hint
+ * keeps the job that everything waits on, which has the lowest priority of
+ * all, at most one pop away. The hint is only updated when a push undercuts
+ * it or its job is popped, so its lock stays off the common path.
+ *
+ * Idle workers park on a condition variable. Pushes only touch it when some
+ * worker is actually parked, and wake exactly one.
+ */
+template <class T>
+class JobQueue
+{
+private:
+	static constexpr int64_t EmptyPriority = std::numeric_limits<int64_t>::max();
+
+	struct Entry
+	{
+		int64_t priority;
+		uint64_t sequence;
+		T item;
+
+		// Orders the heap so that its front is the entry to pop next.
+		bool operator<(const Entry& other) const
+		{
+			if (priority != other.priority)
+			{
+				return priority > other.priority;
+			}
+			return sequence > other.sequence;
+		}
+	};
+
+	// Padded to a cache line, so workers polling the top of one shard
+	// don't invalidate the neighbouring shards.
+	struct alignas(64) Shard
+	{
+		std::mutex mutex;
+		std::vector<Entry> heap;
+		std::atomic<int64_t> top { EmptyPriority };
+	};
+
+	std::vector<std::unique_ptr<Shard>> m_Shards;
+	std::atomic<uint64_t> m_Sequence { 0 };
+	std::atomic<uint64_t> m_NextShard { 0 };
+	std::atomic<int64_t> m_Size { 0 };
+
+	// The minimum hint. Both values are written under m_MinMutex so that they
+	// always describe the same job, and read without it.
+	std::mutex m_MinMutex;
+	std::atomic<int64_t> m_MinPriority { EmptyPriority };
+	std::atomic<size_t> m_MinShard { 0 };
+
+	std::mutex m_ParkMutex;
+	std::condition_variable m_ParkCV;
+	std::atomic<int> m_Sleepers { 0 };
+	std::atomic<bool> m_Closed { false };
+
+	// Pops the front of the shard, returns false if it turned out to be empty.
+	bool popFrom(Shard& shard, T& out, int64_t& priority)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (shard.heap.empty())
+		{
+			return false;
+		}
+
+		std::pop_heap(shard.heap.begin(), shard.heap.end());
+		Entry& entry = shard.heap.back();
+		priority = entry.priority;
+		out = std::move(entry.item);
+		shard.heap.pop_back();
+		shard.top = shard.heap.empty() ? EmptyPriority : shard.heap.front().priority;
+
+		m_Size--;
+		return true;
+	}
+
+	// Points the minimum hint at the shard that now holds the lowest priority.
+	// Called after popping the job the hint pointed at.
+	void refreshMinimum()
+	{
+		std::lock_guard<std::mutex> lock(m_MinMutex);
+		size_t minShard = 0;
+		int64_t minPriority = EmptyPriority;
+		for (size_t i = 0; i < m_Shards.size(); i++)
+		{
+			const int64_t top = m_Shards[i]->top.load();
+			if (top < minPriority)
+			{
+				minShard = i;
+				minPriority = top;
+			}
+		}
+		m_MinShard = minShard;
+		m_MinPriority = minPriority;
+	}
+
+	bool tryPop(T& out, const size_t worker, std::minstd_rand& rng)
+	{
+		const size_t shardCount = m_Shards.size();
+		const size_t candidates[3] = {
+			worker % shardCount,
+			rng() % shardCount,
+			m_MinShard.load(std::memory_order_relaxed) % shardCount,
+		};
+
+		size_t best = shardCount;
+		int64_t bestPriority = EmptyPriority;
+		for (const size_t candidate : candidates)
+		{
+			const int64_t top = m_Shards[candidate]->top.load(std::memory_order_relaxed);
+			if (top < bestPriority)
+			{
+				best = candidate;
+				bestPriority = top;
+			}
+		}
+
+		if (best == shardCount)
+		{
+			// All candidates were empty, steal from the lowest shard anywhere.
+			for (size_t i = 0; i < shardCount; i++)
+			{
+				const int64_t top = m_Shards[i]->top.load(std::memory_order_relaxed);
+				if (top < bestPriority)
+				{
+					best = i;
+					bestPriority = top;
+				}
+			}
+		}
+
+		int64_t priority = EmptyPriority;
+		if (best == shardCount || !popFrom(*m_Shards[best], out, priority))
+		{
+			return false;
+		}
+		if (priority <= m_MinPriority.load())
+		{
+			refreshMinimum();
+		}
+		return true;
+	}
+
+public:
+	explicit JobQueue(size_t shards)
+	{
+		shards = std::max<size_t>(1, shards);
+		m_Shards.reserve(shards);
+		for (size_t i = 0; i < shards; i++)
+		{
+			m_Shards.push_back(std::make_unique<Shard>());
+		}
+	}
+	JobQueue() = delete;
+	JobQueue(const JobQueue&) = delete;
+	JobQueue& operator=(const JobQueue&) = delete;
+
+	// Push adds an item to the queue. Pass the index of the calling worker as
+	// worker to keep the item local to it, or -1 to spread items over all shards.
+	// Items pushed after Close are dropped.
+	void Push(T&& item, const int64_t priority, const int worker = -1)
+	{
+		if (m_Closed)
+		{
+			return;
+		}
+
+		const size_t shardIndex = (worker >= 0 ? (size_t)worker : m_NextShard++) % m_Shards.size();
+		Shard& shard = *m_Shards[shardIndex];
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.heap.push_back(Entry { .priority = priority, .sequence = m_Sequence++, .item = std::move(item) });
+			std::push_heap(shard.heap.begin(), shard.heap.end());
+			shard.top = shard.heap.front().priority;
+		}
+
+		// Advertise the shard if this is the lowest priority in the queue.
+		if (priority < m_MinPriority.load())
+		{
+			std::lock_guard<std::mutex> lock(m_MinMutex);
+			if (priority < m_MinPriority.load())
+			{
+				m_MinShard = shardIndex;
+				m_MinPriority = priority;
+			}
+		}
+
+		m_Size++;
+		if (m_Sleepers > 0)
+		{
+			std::lock_guard<std::mutex> lock(m_ParkMutex);
+			m_ParkCV.notify_one();
+		}
+	}
+
+	// Pop blocks until an item could be taken off the queue, and returns false
+	// once the queue is closed. worker is the index of the calling worker.
+	bool Pop(T& out, const size_t worker)
+	{
+		thread_local std::minstd_rand rng(std::random_device {}());
+
+		while (true)
+		{
+			if (m_Closed)
+			{
+				return false;
+			}
+			if (tryPop(out, worker, rng))
+			{
+				return true;
+			}
+
+			std::unique_lock<std::mutex> lock(m_ParkMutex);
+			m_Sleepers++;
+			// Check again after announcing ourselves: a concurrent Push either
+			// sees us sleeping and wakes us, or we see its item here.
+			if (m_Size > 0 || m_Closed)
+			{
+				m_Sleepers--;
+				continue;
+			}
+			m_ParkCV.wait(lock);
+			m_Sleepers--;
+		}
+	}
+
+	// Close wakes up all parked workers and makes Pop return false.
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_ParkMutex);
+		m_Closed = true;
+		m_ParkCV.notify_all();
+	}
+
+	// Clear drops all queued items.
+	void Clear()
+	{
+		for (auto& shard : m_Shards)
+		{
+			std::lock_guard<std::mutex> lock(shard->mutex);
+			m_Size -= (int64_t)shard->heap.size();
+			shard->heap.clear();
+			shard->top = EmptyPriority;
+		}
+		refreshMinimum();
+	}
+
+	// Size returns the number of queued items. It is exact only while no
+	// other thread pushes or pops.
+	[[nodiscard]] int64_t Size() const { return m_Size.load(); }
+	[[nodiscard]] size_t GetShardCount() const { return m_Shards.size(); }
+};
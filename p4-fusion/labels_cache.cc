@@ -1,161 +1,647 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
 #include "labels_cache.h"
 
-const int LABEL_CACHE_VERSION = 1;
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void write_int(std::ofstream& outFile, const int number)
+namespace
 {
-	outFile.write(reinterpret_cast<const char*>(&number), sizeof(number));
+// The magic also versions the format. Caches of version 1 have no magic,
+// they start with the number of labels.
+constexpr char cacheMagic[8] = { 'P', '4', 'F', 'L', 'B', 'C', '0', '2' };
+const int LEGACY_LABEL_CACHE_VERSION = 1;
+
+struct Header
+{
+	char magic[8];
+	uint64_t indexOffset;
+	uint64_t indexCount;
+	uint64_t journalOffset;
+	uint32_t indexCRC;
+	// CRC of all fields above.
+	uint32_t headerCRC;
+};
+
+// Records are the payload length, the CRC of the payload and the payload,
+// which starts with the kind of record.
+constexpr size_t recordHeaderBytes = 2 * sizeof(uint32_t);
+constexpr uint8_t putRecord = 1;
+constexpr uint8_t removeRecord = 2;
+
+// Compact once the journal holds this many labels, or a quarter of the
+// snapshot if that is more.
+constexpr size_t minCompactJournal = 1024;
+
+constexpr std::array<uint32_t, 256> crcTable = []()
+{
+	std::array<uint32_t, 256> table {};
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+		{
+			c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		table[i] = c;
+	}
+	return table;
+}();
+
+uint32_t crc32(const char* data, const size_t length)
+{
+	uint32_t crc = 0xffffffffu;
+	for (size_t i = 0; i < length; i++)
+	{
+		crc = crcTable[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffffu;
+}
+
+uint64_t nameHash(const std::string& name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char c : name)
+	{
+		hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+void putU32(std::string& out, const uint32_t value)
+{
+	out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void putString(std::string& out, const std::string& str)
+{
+	putU32(out, (uint32_t)str.size());
+	out += str;
 }
 
-void write_string(std::ofstream& outFile, const std::string& str)
+void appendRecord(std::string& out, const std::string& payload)
 {
-	size_t length = str.size();
-	outFile.write(reinterpret_cast<const char*>(&length), sizeof(length));
-	outFile.write(str.data(), length);
+	putU32(out, (uint32_t)payload.size());
+	putU32(out, crc32(payload.data(), payload.size()));
+	out += payload;
 }
 
-void write_vector_of_strings(std::ofstream& outFile, const std::vector<std::string>& vec)
+std::string encodePut(const LabelResult& label)
 {
-	size_t vecSize = vec.size();
-	outFile.write(reinterpret_cast<const char*>(&vecSize), sizeof(vecSize));
-	for (const auto& str : vec)
+	std::string payload(1, (char)putRecord);
+	putString(payload, label.label);
+	putString(payload, label.revision);
+	putString(payload, label.description);
+	putString(payload, label.update);
+	putU32(payload, (uint32_t)label.views.size());
+	for (const auto& view : label.views)
 	{
-		write_string(outFile, str);
+		putString(payload, view);
 	}
+	return payload;
 }
 
-void write_struct_to_disk(std::ofstream& outFile, const LabelResult& labels)
+std::string encodeRemove(const std::string& label)
 {
-	write_int(outFile, LABEL_CACHE_VERSION); // Write a version number first
-	write_string(outFile, labels.label);
-	write_string(outFile, labels.revision);
-	write_string(outFile, labels.description);
-	write_string(outFile, labels.update);
-	write_vector_of_strings(outFile, labels.views);
+	std::string payload(1, (char)removeRecord);
+	putString(payload, label);
+	return payload;
 }
 
-void write_label_map_to_disk(const std::string& filename, const LabelNameToDetails& labelMap, const std::string& cacheFile)
+// Reader decodes a payload, it fails instead of reading past the end.
+class Reader
 {
-	std::ofstream outFile(filename, std::ios::binary);
-	if (!outFile)
+	const char* m_Pos;
+	const char* m_End;
+	bool m_OK = true;
+
+public:
+	Reader(const char* data, const size_t length)
+	    : m_Pos(data)
+	    , m_End(data + length)
 	{
-		ERR("Error opening " << cacheFile << " file for writing, could not cache labels!");
-		return;
 	}
 
-	// Write the size of the map
-	size_t size = labelMap.size();
-	outFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
+	[[nodiscard]] bool OK() const { return m_OK; }
+	[[nodiscard]] bool AtEnd() const { return m_Pos == m_End; }
+
+	uint32_t U32()
+	{
+		uint32_t value = 0;
+		if (!m_OK || m_End - m_Pos < (ptrdiff_t)sizeof(value))
+		{
+			m_OK = false;
+			return 0;
+		}
+		std::memcpy(&value, m_Pos, sizeof(value));
+		m_Pos += sizeof(value);
+		return value;
+	}
+
+	uint8_t U8()
+	{
+		if (!m_OK || m_Pos == m_End)
+		{
+			m_OK = false;
+			return 0;
+		}
+		return (uint8_t)*m_Pos++;
+	}
+
+	std::string String()
+	{
+		const uint32_t length = U32();
+		if (!m_OK || (size_t)(m_End - m_Pos) < length)
+		{
+			m_OK = false;
+			return "";
+		}
+		std::string str(m_Pos, length);
+		m_Pos += length;
+		return str;
+	}
+};
+
+bool decodePayload(const char* data, const size_t length, LabelResult& label, bool& removed)
+{
+	Reader reader(data, length);
+	const uint8_t kind = reader.U8();
+	label.label = reader.String();
+	removed = kind == removeRecord;
+	if (kind == putRecord)
+	{
+		label.revision = reader.String();
+		label.description = reader.String();
+		label.update = reader.String();
+		const uint32_t views = reader.U32();
+		label.views.clear();
+		for (uint32_t i = 0; i < views && reader.OK(); i++)
+		{
+			label.views.emplace_back(reader.String());
+		}
+	}
+	return reader.OK() && reader.AtEnd() && (kind == putRecord || kind == removeRecord);
+}
+
+// decodeRecord decodes the record at offset, as long as it ends before end.
+// It sets next to the offset of the following record.
+bool decodeRecord(const char* map, const uint64_t offset, const uint64_t end, LabelResult& label, bool& removed, uint64_t& next)
+{
+	if (offset + recordHeaderBytes > end)
+	{
+		return false;
+	}
+	uint32_t length = 0;
+	uint32_t crc = 0;
+	std::memcpy(&length, map + offset, sizeof(length));
+	std::memcpy(&crc, map + offset + sizeof(length), sizeof(crc));
+	const char* payload = map + offset + recordHeaderBytes;
+	if (offset + recordHeaderBytes + length > end || crc32(payload, length) != crc)
+	{
+		return false;
+	}
+	next = offset + recordHeaderBytes + length;
+	return decodePayload(payload, length, label, removed);
+}
+
+void throwErrno(const std::string& what, const std::string& path)
+{
+	throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+void writeAll(const int fd, const char* data, size_t length, off_t offset, const std::string& path)
+{
+	while (length > 0)
+	{
+		const ssize_t written = pwrite(fd, data, length, offset);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written < 0)
+		{
+			throwErrno("failed to write label cache", path);
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+}
+}
+
+LabelCache::LabelCache(std::string path)
+    : m_Path(std::move(path))
+{
+	open();
+}
+
+LabelCache::~LabelCache()
+{
+	close();
+}
+
+void LabelCache::open()
+{
+	m_FD = ::open(m_Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (m_FD < 0)
+	{
+		throwErrno("failed to open label cache", m_Path);
+	}
+	if (!load())
+	{
+		// Start over, Commit writes a fresh snapshot.
+		if (m_Map != nullptr)
+		{
+			munmap((void*)m_Map, m_MapSize);
+		}
+		m_Map = nullptr;
+		m_MapSize = 0;
+		m_Index = nullptr;
+		m_IndexSize = 0;
+		m_End = 0;
+		migrateLegacy();
+	}
+}
+
+void LabelCache::close()
+{
+	if (m_Map != nullptr)
+	{
+		munmap((void*)m_Map, m_MapSize);
+		m_Map = nullptr;
+		m_MapSize = 0;
+	}
+	m_Index = nullptr;
+	m_IndexSize = 0;
+	m_End = 0;
+	m_Journal.clear();
+	if (m_FD >= 0)
+	{
+		::close(m_FD);
+		m_FD = -1;
+	}
+}
+
+bool LabelCache::load()
+{
+	struct stat st {};
+	if (fstat(m_FD, &st) != 0)
+	{
+		throwErrno("failed to stat label cache", m_Path);
+	}
+	if (st.st_size == 0)
+	{
+		return false;
+	}
+
+	m_MapSize = (size_t)st.st_size;
+	void* map = mmap(nullptr, m_MapSize, PROT_READ, MAP_SHARED, m_FD, 0);
+	if (map == MAP_FAILED)
+	{
+		throwErrno("failed to map label cache", m_Path);
+	}
+	m_Map = (const char*)map;
 
-	// Write each key-value pair
-	for (const auto& pair : labelMap)
+	Header header {};
+	if (m_MapSize < sizeof(Header))
+	{
+		return false;
+	}
+	std::memcpy(&header, m_Map, sizeof(Header));
+	if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0)
+	{
+		return false;
+	}
+	if (header.headerCRC != crc32(m_Map, offsetof(Header, headerCRC))
+	    || header.indexOffset % alignof(IndexEntry) != 0
+	    || header.indexOffset + header.indexCount * sizeof(IndexEntry) != header.journalOffset
+	    || header.journalOffset > m_MapSize
+	    || header.indexCRC != crc32(m_Map + header.indexOffset, header.indexCount * sizeof(IndexEntry)))
 	{
-		write_struct_to_disk(outFile, pair.second);
+		return false;
 	}
+	m_Index = (const IndexEntry*)(m_Map + header.indexOffset);
+	m_IndexSize = header.indexCount;
 
-	outFile.close();
+	// Replay the journal. A record that is cut short or fails its check is
+	// where a previous run was interrupted, it and anything after is dropped.
+	uint64_t offset = header.journalOffset;
+	while (offset < m_MapSize)
+	{
+		LabelResult label;
+		bool removed = false;
+		uint64_t next = 0;
+		if (!decodeRecord(m_Map, offset, m_MapSize, label, removed, next))
+		{
+			WARN("Dropping " << m_MapSize - offset << " bytes of a torn write at the end of label cache " << m_Path)
+			if (ftruncate(m_FD, (off_t)offset) != 0)
+			{
+				throwErrno("failed to truncate label cache", m_Path);
+			}
+			break;
+		}
+		std::string name = label.label;
+		m_Journal[name] = removed ? std::nullopt : std::optional<LabelResult>(std::move(label));
+		offset = next;
+	}
+	m_End = offset;
+	return true;
 }
 
-int read_int(std::ifstream& inFile)
+bool LabelCache::migrateLegacy()
 {
-	int number;
-	inFile.read(reinterpret_cast<char*>(&number), sizeof(number));
-	return number;
+	// Version 1 caches are the number of labels followed by the labels, with
+	// size_t lengths. Read them once, Commit rewrites them as a snapshot.
+	std::string contents;
+	{
+		struct stat st {};
+		if (fstat(m_FD, &st) != 0 || st.st_size == 0)
+		{
+			return false;
+		}
+		contents.resize((size_t)st.st_size);
+		if (pread(m_FD, contents.data(), contents.size(), 0) != (ssize_t)contents.size())
+		{
+			return false;
+		}
+	}
+
+	size_t pos = 0;
+	auto readSize = [&contents, &pos](size_t& value)
+	{
+		if (contents.size() - pos < sizeof(value))
+		{
+			return false;
+		}
+		std::memcpy(&value, contents.data() + pos, sizeof(value));
+		pos += sizeof(value);
+		return true;
+	};
+	auto readString = [&contents, &pos, &readSize](std::string& str)
+	{
+		size_t length = 0;
+		if (!readSize(length) || contents.size() - pos < length)
+		{
+			return false;
+		}
+		str.assign(contents.data() + pos, length);
+		pos += length;
+		return true;
+	};
+
+	size_t count = 0;
+	bool ok = readSize(count);
+	std::unordered_map<std::string, std::optional<LabelResult>> labels;
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		int version = 0;
+		ok = contents.size() - pos >= sizeof(version);
+		if (!ok)
+		{
+			break;
+		}
+		std::memcpy(&version, contents.data() + pos, sizeof(version));
+		pos += sizeof(version);
+
+		LabelResult label;
+		size_t views = 0;
+		ok = version == LEGACY_LABEL_CACHE_VERSION && readString(label.label) && readString(label.revision)
+		    && readString(label.description) && readString(label.update) && readSize(views);
+		for (size_t v = 0; ok && v < views; v++)
+		{
+			std::string view;
+			ok = readString(view);
+			label.views.emplace_back(std::move(view));
+		}
+		if (ok)
+		{
+			std::string name = label.label;
+			labels[name] = std::move(label);
+		}
+	}
+	if (!ok || pos != contents.size())
+	{
+		WARN("Label cache " << m_Path << " is damaged, all labels will be fetched again")
+		return false;
+	}
+
+	PRINT("Converting " << labels.size() << " labels in " << m_Path << " to the current label cache format")
+	m_Journal = std::move(labels);
+	return true;
 }
 
-std::string read_string(std::ifstream& inFile)
+bool LabelCache::readSnapshot(const uint64_t offset, LabelResult& label, bool& removed) const
 {
-	size_t length;
-	inFile.read(reinterpret_cast<char*>(&length), sizeof(length));
-	std::string str(length, '\0');
-	inFile.read(&str[0], length);
-	return str;
+	uint64_t next = 0;
+	const uint64_t end = (uint64_t)((const char*)m_Index - m_Map);
+	if (!decodeRecord(m_Map, offset, end, label, removed, next))
+	{
+		WARN("Skipping a damaged record in label cache " << m_Path)
+		return false;
+	}
+	return true;
 }
 
-std::vector<std::string> read_vector_of_strings(std::ifstream& inFile)
+std::optional<LabelResult> LabelCache::Get(const std::string& label) const
 {
-	size_t vecSize;
-	inFile.read(reinterpret_cast<char*>(&vecSize), sizeof(vecSize));
-	std::vector<std::string> vec(vecSize);
-	for (size_t i = 0; i < vecSize; ++i)
+	if (const auto it = m_Journal.find(label); it != m_Journal.end())
 	{
-		vec[i] = read_string(inFile);
+		return it->second;
 	}
-	return vec;
+
+	const uint64_t hash = nameHash(label);
+	const IndexEntry* end = m_Index + m_IndexSize;
+	for (const IndexEntry* it = std::lower_bound(m_Index, end, hash, [](const IndexEntry& entry, const uint64_t h)
+	         { return entry.hash < h; });
+	     it != end && it->hash == hash; it++)
+	{
+		LabelResult cached;
+		bool removed = false;
+		if (readSnapshot(it->offset, cached, removed) && !removed && cached.label == label)
+		{
+			return cached;
+		}
+	}
+	return std::nullopt;
 }
 
-LabelResult read_struct_from_disk(std::ifstream& inFile)
+void LabelCache::ForEachName(const std::function<void(const std::string&)>& fn) const
 {
-	LabelResult label;
-	int version = read_int(inFile);
-	if (version != LABEL_CACHE_VERSION)
+	for (size_t i = 0; i < m_IndexSize; i++)
 	{
-		ERR("Incorrect label version!")
-		return label;
+		LabelResult cached;
+		bool removed = false;
+		if (readSnapshot(m_Index[i].offset, cached, removed) && !removed && !m_Journal.contains(cached.label))
+		{
+			fn(cached.label);
+		}
+	}
+	for (const auto& [name, label] : m_Journal)
+	{
+		if (label.has_value())
+		{
+			fn(name);
+		}
+	}
+}
+
+size_t LabelCache::Size() const
+{
+	size_t size = 0;
+	ForEachName([&size](const std::string&)
+	    { size++; });
+	return size;
+}
+
+void LabelCache::Put(const LabelResult& label)
+{
+	appendRecord(m_Pending, encodePut(label));
+	m_Journal[label.label] = label;
+}
+
+void LabelCache::Remove(const std::string& label)
+{
+	appendRecord(m_Pending, encodeRemove(label));
+	m_Journal[label] = std::nullopt;
+}
+
+void LabelCache::Commit()
+{
+	if (m_End == 0 || m_Journal.size() > std::max(minCompactJournal, m_IndexSize / 4))
+	{
+		compact();
+		return;
+	}
+	if (m_Pending.empty())
+	{
+		return;
+	}
+
+	writeAll(m_FD, m_Pending.data(), m_Pending.size(), (off_t)m_End, m_Path);
+	if (fsync(m_FD) != 0)
+	{
+		throwErrno("failed to sync label cache", m_Path);
 	}
-	label.label = read_string(inFile);
-	label.revision = read_string(inFile);
-	label.description = read_string(inFile);
-	label.update = read_string(inFile);
-	label.views = read_vector_of_strings(inFile);
-	return label;
+	m_End += m_Pending.size();
+	m_Pending.clear();
 }
 
-LabelNameToDetails read_label_map_from_disk(const std::string& filename)
+void LabelCache::compact()
 {
-	LabelNameToDetails labelMap;
-	std::ifstream inFile(filename, std::ios::binary);
-	if (!inFile)
+	// Collect the current labels, sorted by name so that the snapshot is
+	// written the same way every time.
+	std::vector<LabelResult> labels;
+	for (size_t i = 0; i < m_IndexSize; i++)
+	{
+		LabelResult cached;
+		bool removed = false;
+		if (readSnapshot(m_Index[i].offset, cached, removed) && !removed && !m_Journal.contains(cached.label))
+		{
+			labels.emplace_back(std::move(cached));
+		}
+	}
+	for (const auto& [name, label] : m_Journal)
+	{
+		if (label.has_value())
+		{
+			labels.push_back(*label);
+		}
+	}
+	std::sort(labels.begin(), labels.end(), [](const LabelResult& a, const LabelResult& b)
+	    { return a.label < b.label; });
+
+	std::string contents(sizeof(Header), '\0');
+	std::vector<IndexEntry> index;
+	index.reserve(labels.size());
+	for (const auto& label : labels)
 	{
-		ERR("No label cache found at " << filename)
-		return labelMap;
+		index.push_back({ nameHash(label.label), contents.size() });
+		appendRecord(contents, encodePut(label));
 	}
+	contents.resize((contents.size() + alignof(IndexEntry) - 1) / alignof(IndexEntry) * alignof(IndexEntry), '\0');
+	std::stable_sort(index.begin(), index.end(), [](const IndexEntry& a, const IndexEntry& b)
+	    { return a.hash < b.hash; });
 
-	// Read the size of the map
-	size_t size;
-	inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
+	Header header {};
+	std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.indexOffset = contents.size();
+	header.indexCount = index.size();
+	header.journalOffset = header.indexOffset + index.size() * sizeof(IndexEntry);
+	header.indexCRC = crc32((const char*)index.data(), index.size() * sizeof(IndexEntry));
+	contents.append((const char*)index.data(), index.size() * sizeof(IndexEntry));
+	std::memcpy(contents.data(), &header, sizeof(Header));
+	header.headerCRC = crc32(contents.data(), offsetof(Header, headerCRC));
+	std::memcpy(contents.data(), &header, sizeof(Header));
 
-	// Read each key-value pair and insert into the map
-	for (size_t i = 0; i < size; ++i)
+	// Write the snapshot next to the cache and swap it in, so that the cache
+	// is never half written.
+	const std::string tmpPath = m_Path + ".tmp";
+	const int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
 	{
-		LabelResult value = read_struct_from_disk(inFile);
-		labelMap.insert({ value.label, value });
+		throwErrno("failed to create label cache", tmpPath);
+	}
+	writeAll(fd, contents.data(), contents.size(), 0, tmpPath);
+	if (fsync(fd) != 0)
+	{
+		::close(fd);
+		throwErrno("failed to sync label cache", tmpPath);
+	}
+	::close(fd);
+	if (std::rename(tmpPath.c_str(), m_Path.c_str()) != 0)
+	{
+		throwErrno("failed to replace label cache", m_Path);
 	}
 
-	inFile.close();
-	return labelMap;
+	close();
+	m_Pending.clear();
+	open();
 }
 
 // Compares the last updated date in the labels list to the updated dates
 // in the cache, and returns all labels of which the last updated date is
 // different.
-CompareResponse compare_labels_to_cache(const std::list<LabelsResult::LabelData>& labels, LabelNameToDetails& cachedLabelMap)
+CompareResponse compare_labels_to_cache(const std::list<LabelsResult::LabelData>& labels, const LabelCache* cache)
 {
-	LabelNameToDetails newLabelMap;
-	std::list<LabelsResult::LabelData> labelsToFetch;
+	CompareResponse response;
+	std::unordered_set<std::string> listed;
 	for (const auto& label : labels)
 	{
-		if (cachedLabelMap.contains(label.label))
+		listed.insert(label.label);
+		if (cache != nullptr)
 		{
-			LabelResult cachedLabel
-			    = cachedLabelMap.at(label.label);
-			if (cachedLabel.update != label.update)
-			{
-				labelsToFetch.push_back(label);
-			}
-			else
+			if (std::optional<LabelResult> cachedLabel = cache->Get(label.label); cachedLabel.has_value() && cachedLabel->update == label.update)
 			{
-				newLabelMap.insert({ label.label, cachedLabel });
+				response.resultingLabels.insert({ label.label, std::move(*cachedLabel) });
+				continue;
 			}
 		}
-		else
-		{
-			labelsToFetch.push_back(label);
-		}
+		response.labelsToFetch.push_back(label);
 	}
 
-	return CompareResponse {
-		.labelsToFetch = labelsToFetch,
-		.resultingLabels = newLabelMap
-	};
+	if (cache != nullptr)
+	{
+		cache->ForEachName([&listed, &response](const std::string& name)
+		    {
+			    if (!listed.contains(name))
+			    {
+				    response.labelsToRemove.push_back(name);
+			    } });
+	}
+
+	return response;
 }
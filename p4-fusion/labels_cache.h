@@ -1,15 +1,86 @@
-#include <fstream>
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "labels_conversion.h"
 
+/*
+ * LabelCache keeps the details of labels between runs, so only labels that
+ * changed since have to be fetched again.
+ *
+ * The file is a snapshot of all labels, followed by an index of the snapshot
+ * sorted by the hash of the label names, followed by a journal of the labels
+ * that changed since the snapshot was written. The snapshot is read through a
+ * memory map, a lookup is a binary search in the index and decodes a single
+ * record. Commit appends the changes of a run to the journal, and rewrites
+ * the file into a new snapshot once the journal grows too large.
+ *
+ * Every record carries a CRC32 of its contents, the header and the index have
+ * their own. A torn write at the end of the journal is dropped when the cache
+ * is opened, and a cache that doesn't pass its checks is started over, which
+ * only means that its labels are fetched again.
+ */
+class LabelCache
+{
+public:
+	explicit LabelCache(std::string path);
+	LabelCache() = delete;
+	LabelCache(const LabelCache&) = delete;
+	LabelCache& operator=(const LabelCache&) = delete;
+	~LabelCache();
+
+	[[nodiscard]] std::optional<LabelResult> Get(const std::string& label) const;
+	// ForEachName calls fn with the name of every cached label.
+	void ForEachName(const std::function<void(const std::string&)>& fn) const;
+	[[nodiscard]] size_t Size() const;
+	[[nodiscard]] size_t JournalSize() const { return m_Journal.size(); }
+
+	// Put and Remove are only visible to other runs after Commit.
+	void Put(const LabelResult& label);
+	void Remove(const std::string& label);
+	void Commit();
+
+private:
+	struct IndexEntry
+	{
+		uint64_t hash;
+		uint64_t offset;
+	};
+
+	std::string m_Path;
+	int m_FD = -1;
+	const char* m_Map = nullptr;
+	size_t m_MapSize = 0;
+	const IndexEntry* m_Index = nullptr;
+	size_t m_IndexSize = 0;
+	// End of the valid part of the file, where the journal is appended.
+	uint64_t m_End = 0;
+	// Labels changed since the snapshot, nullopt for removed ones.
+	std::unordered_map<std::string, std::optional<LabelResult>> m_Journal;
+	// Changes not yet committed, encoded as journal records.
+	std::string m_Pending;
+
+	void open();
+	void close();
+	bool load();
+	void compact();
+	// readSnapshot decodes the snapshot record at offset, it returns false if
+	// the record is damaged.
+	bool readSnapshot(uint64_t offset, LabelResult& label, bool& removed) const;
+	bool migrateLegacy();
+};
+
 struct CompareResponse
 {
 	std::list<LabelsResult::LabelData> labelsToFetch;
 	LabelNameToDetails resultingLabels; // labelMap with the labels that no longer exist removed
+	std::vector<std::string> labelsToRemove; // cached labels that no longer exist
 };
 
-void write_label_map_to_disk(const std::string& filename, const LabelNameToDetails& labelMap, const std::string& cacheFile);
-LabelNameToDetails read_label_map_from_disk(const std::string& filename);
-CompareResponse compare_labels_to_cache(const std::list<LabelsResult::LabelData>& labels, LabelNameToDetails& labelMap);
+// cache may be null, then all labels are fetched.
+CompareResponse compare_labels_to_cache(const std::list<LabelsResult::LabelData>& labels, const LabelCache* cache);
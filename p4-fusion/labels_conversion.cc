@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
 #include <string>
-#include <regex>
+#include <thread>
+#include <vector>
 
 #include "git_api.h"
 #include "p4_api.h"
@@ -7,75 +12,14 @@
 #include "git2/types.h"
 
 #include "labels_conversion.h"
+#include "memory_accounting.h"
+#include "utils/ref_helpers.h"
 
-// sanitizeLabelName removes characters from a label name that
-// aren't valid in git tags as specified by
-// https://git-scm.com/docs/git-check-ref-format
-//
-// All invalid characters are replaced with underscores.
-//
-// This function was LLM generated and the regex checked with
-// https://regex101.com/ . Seems to make sense, and tested
-// with a few label names.
-std::string convert_label_to_tag(std::string input)
+// convert_label_to_tag turns a label name into a valid git tag name, see
+// RefHelpers::SanitizeTagName.
+std::string convert_label_to_tag(const std::string& label)
 {
-	std::string result = input;
-
-	// Rule: Replace invalid characters with underscores
-	std::regex invalidChars(R"([[:cntrl:]\x7f ~^:?\*\[\]\\])");
-	result = std::regex_replace(result, invalidChars, "_");
-
-	// Rule: Remove sequences "@{"
-	std::regex atBrace(R"(@\{)");
-	result = std::regex_replace(result, atBrace, "_");
-
-	// Rule: No consecutive dots
-	std::regex consecutiveDots(R"(\.\.)");
-	while (std::regex_search(result, consecutiveDots))
-	{
-		result = std::regex_replace(result, consecutiveDots, "_");
-	}
-
-	// Rule: No slash-separated component can begin with a dot
-	std::regex dotComponent(R"(/\.|^\.|(\.\.))");
-	if (std::regex_search(result, dotComponent))
-	{
-		result = std::regex_replace(result, dotComponent, "_");
-	}
-
-	// Rule: No component can end with ".lock"
-	std::regex dotLock(R"(\.lock(?=/|$))");
-	result = std::regex_replace(result, dotLock, "_lock");
-
-	// Rule: Cannot end with a dot
-	if (result.back() == '.')
-	{
-		result.back() = '_';
-	}
-
-	// Rule: Cannot end with a slash
-	if (result.back() == '/')
-	{
-		result.back() = '_';
-	}
-
-	// Rule: Cannot begin with a slash
-	if (result.front() == '/')
-	{
-		result.front() = '_';
-	}
-
-	// Rule: Cannot have multiple consecutive slashes
-	std::regex consecutiveSlashes(R"(//+)");
-	result = std::regex_replace(result, consecutiveSlashes, "/");
-
-	// Rule: Cannot be the single character '@'
-	if (result == "@")
-	{
-		result = "_";
-	}
-
-	return result;
+	return RefHelpers::SanitizeTagName(label);
 }
 
 // Trim the specified suffix from the string
@@ -122,25 +66,90 @@ std::string get_changelist_from_commit(const git_commit* commit)
 	return cl;
 }
 
-// Fetch the details of a list of labels. This will make requests
-// to the Perforce server equal to the number of labels in the list
-LabelNameToDetails get_labels_details(P4API* p4, std::list<LabelsResult::LabelData> labels)
+// Fetch the details of a list of labels. Labels are fetched with one request
+// each, spread over up to the given number of connections. With
+// detailsFromList, labels whose revision is already in the labels list are
+// taken from there without a request.
+LabelNameToDetails get_labels_details(P4API* p4, const std::list<LabelsResult::LabelData>& labels, const int threads, const bool detailsFromList)
 {
 	LabelNameToDetails labelMap;
 
-	for (auto& label : labels)
+	std::vector<const LabelsResult::LabelData*> toFetch;
+	for (const auto& label : labels)
 	{
-		LabelResult labelRes = p4->Label(label.label);
-		if (labelRes.HasError())
+		if (detailsFromList && !label.revision.empty())
 		{
-			ERR("Failed to retrieve label details: " << labelRes.PrintError());
+			LabelResult labelRes;
+			labelRes.label = label.label;
+			labelRes.revision = label.revision;
+			labelRes.description = label.description;
+			labelRes.update = label.update;
+			labelMap.insert({ labelRes.label, labelRes });
 			continue;
 		}
-		// We use the update field from the `labels` command because it's in
-		// Unix time and will be what we compare against in the future
-		labelRes.update = label.update;
+		toFetch.push_back(&label);
+	}
+	if (detailsFromList)
+	{
+		SUCCESS("Took " << labelMap.size() << " labels from the labels list, fetching " << toFetch.size())
+	}
+
+	std::mutex labelMapMutex;
+	std::atomic<size_t> next = 0;
+	// Every connection takes the next label from the shared list until all
+	// labels are fetched.
+	auto fetch = [&toFetch, &next, &labelMap, &labelMapMutex](P4API& client)
+	{
+		for (size_t i = next++; i < toFetch.size(); i = next++)
+		{
+			const LabelsResult::LabelData& label = *toFetch[i];
+			LabelResult labelRes = client.Label(label.label);
+			if (labelRes.HasError())
+			{
+				ERR("Failed to retrieve label details: " << labelRes.PrintError());
+				continue;
+			}
+			// We use the update field from the `labels` command because it's in
+			// Unix time and will be what we compare against in the future
+			labelRes.update = label.update;
+
+			std::lock_guard<std::mutex> lock(labelMapMutex);
+			labelMap.insert({ labelRes.label, labelRes });
+		}
+	};
 
-		labelMap.insert({ labelRes.label, labelRes });
+	const int connections = (int)std::min<size_t>(std::max(threads, 1), toFetch.size());
+	if (connections <= 1)
+	{
+		fetch(*p4);
+		return labelMap;
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	for (int i = 0; i < connections; i++)
+	{
+		workers.emplace_back([&fetch, &errorMutex, &error]()
+		    {
+			    try
+			    {
+				    P4API client;
+				    fetch(client);
+			    }
+			    catch (...)
+			    {
+				    std::lock_guard<std::mutex> lock(errorMutex);
+				    error = std::current_exception();
+			    } });
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	if (error)
+	{
+		std::rethrow_exception(error);
 	}
 
 	return labelMap;
@@ -188,3 +197,43 @@ LabelMap label_details_to_map(std::string depotPath, LabelNameToDetails labels)
 
 	return revToLabel;
 }
+
+// Bytes of a hash map node besides its key and value: the next pointer and
+// the bucket slot.
+constexpr int64_t mapNodeBytes = 2 * sizeof(void*);
+
+int64_t label_result_memory_usage(const LabelResult& label)
+{
+	int64_t bytes = sizeof(LabelResult)
+	    + MemoryAccounting::StringBytes(label.label)
+	    + MemoryAccounting::StringBytes(label.revision)
+	    + MemoryAccounting::StringBytes(label.description)
+	    + MemoryAccounting::StringBytes(label.update)
+	    + (int64_t)(label.views.capacity() * sizeof(std::string));
+	for (const auto& view : label.views)
+	{
+		bytes += MemoryAccounting::StringBytes(view);
+	}
+	return bytes;
+}
+
+int64_t label_details_memory_usage(const LabelNameToDetails& labels)
+{
+	int64_t bytes = (int64_t)(labels.bucket_count() * sizeof(void*));
+	for (const auto& [name, label] : labels)
+	{
+		bytes += mapNodeBytes + sizeof(std::string) + MemoryAccounting::StringBytes(name) + label_result_memory_usage(label);
+	}
+	return bytes;
+}
+
+int64_t label_map_memory_usage(const LabelMap& revToLabel)
+{
+	int64_t bytes = (int64_t)(revToLabel.bucket_count() * sizeof(void*));
+	for (const auto& [revision, labels] : revToLabel)
+	{
+		bytes += mapNodeBytes + sizeof(std::string) + sizeof(void*) + MemoryAccounting::StringBytes(revision);
+		bytes += sizeof(*labels) + label_details_memory_usage(*labels);
+	}
+	return bytes;
+}
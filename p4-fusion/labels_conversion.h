@@ -6,10 +6,14 @@
 // A map from a label name to the details of the label
 using LabelNameToDetails = std::unordered_map<std::string, LabelResult>;
 
-std::string convert_label_to_tag(std::string label);
+std::string convert_label_to_tag(const std::string& label);
 std::string trim_prefix(const std::string& str, const std::string& prefix);
 std::string get_changelist_from_commit(const git_commit* commit);
 LabelMap label_details_to_map(std::string depotPath, LabelNameToDetails labels);
-LabelNameToDetails get_labels_details(P4API* p4, std::list<LabelsResult::LabelData> labels);
+LabelNameToDetails get_labels_details(P4API* p4, const std::list<LabelsResult::LabelData>& labels, int threads, bool detailsFromList);
+// Estimate the bytes held by the label details and by the map of revisions
+// to labels built from them.
+int64_t label_details_memory_usage(const LabelNameToDetails& labels);
+int64_t label_map_memory_usage(const LabelMap& revToLabel);
 
 #endif // LABELS_CONVERSION_H
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "ledger.h"
+
+#include <stdexcept>
+
+namespace
+{
+double toMillis(const std::chrono::nanoseconds duration)
+{
+	return (double)duration.count() / 1e6;
+}
+}
+
+Ledger::Ledger(const std::string& path)
+    : m_File(path, std::ios::out | std::ios::app)
+    , m_LastFlush(Timer::Now())
+{
+	if (!m_File)
+	{
+		throw std::runtime_error("failed to open ledger " + path);
+	}
+
+	// Runs that resume append to the same ledger, only new files get a header.
+	m_File.seekp(0, std::ios::end);
+	if (m_File.tellp() == 0)
+	{
+		m_File << "cl,files,bytes,queued_ms,describe_ms,filelog_ms,print_ms,retries,commit_ms,commits\n";
+	}
+}
+
+Ledger::~Ledger()
+{
+	m_File.flush();
+}
+
+void Ledger::Write(const ChangeList& cl, const std::chrono::nanoseconds commitDuration, const std::vector<std::string>& commitSHAs)
+{
+	m_File << cl.number
+	       << "," << cl.changedFileGroups->totalFileCount
+	       << "," << cl.stats.bytes.load()
+	       << "," << toMillis(cl.stats.queued)
+	       << "," << toMillis(cl.stats.describe)
+	       << "," << toMillis(cl.stats.filelog)
+	       << "," << toMillis(std::chrono::nanoseconds(cl.stats.printNs.load()))
+	       << "," << cl.stats.retries.load()
+	       << "," << toMillis(commitDuration)
+	       << ",";
+	for (size_t i = 0; i < commitSHAs.size(); i++)
+	{
+		m_File << (i > 0 ? " " : "") << commitSHAs[i];
+	}
+	m_File << "\n";
+
+	// Flush about once a second, so that the ledger of an interrupted run is
+	// mostly complete without paying for a write per changelist.
+	const TimePoint now = Timer::Now();
+	if (now - m_LastFlush > std::chrono::seconds(1))
+	{
+		m_File.flush();
+		m_LastFlush = now;
+	}
+}
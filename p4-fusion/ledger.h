@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "commands/change_list.h"
+#include "utils/timer.h"
+
+/*
+ * Ledger writes one CSV row per committed changelist, with where the time
+ * for it went. The download columns are collected by the workers in
+ * ChangeList::stats, the commit columns by the committer, which is the only
+ * thread writing rows.
+ *
+ * Durations are in milliseconds. The commits column lists the SHAs of all
+ * commits created for the changelist, separated by spaces, since a changelist
+ * touching several branches results in several commits.
+ */
+class Ledger
+{
+public:
+	explicit Ledger(const std::string& path);
+	Ledger() = delete;
+	~Ledger();
+
+	void Write(const ChangeList& cl, std::chrono::nanoseconds commitDuration, const std::vector<std::string>& commitSHAs);
+
+private:
+	std::ofstream m_File;
+	TimePoint m_LastFlush;
+};
@@ -6,6 +6,18 @@
  */
 #include "log.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
 #define COLOR_RED "\033[91m"
 #define COLOR_YELLOW "\033[93m"
 #define COLOR_GREEN "\033[32m"
@@ -16,6 +28,379 @@ const char* Log::ColorYellow = COLOR_YELLOW;
 const char* Log::ColorGreen = COLOR_GREEN;
 const char* Log::ColorNormal = COLOR_NORMAL;
 std::mutex Log::mutex;
+std::atomic<int> Log::s_Level((int)Log::Level::Info);
+Log::Format Log::s_Format = Log::Format::Text;
+
+namespace
+{
+struct LogRecord
+{
+	uint64_t sequence = 0;
+	Log::Level level = Log::Level::Info;
+	const char* func = nullptr;
+	int line = 0;
+	std::chrono::system_clock::time_point time;
+	std::string message;
+};
+
+/*
+ * LogRing is a single producer, single consumer ring buffer. The producer is
+ * the thread owning it, the consumer is the drain thread.
+ */
+class LogRing
+{
+public:
+	static constexpr size_t Capacity = 1024;
+
+	// TryPush returns false if the ring is full.
+	bool TryPush(LogRecord&& record)
+	{
+		const size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head - m_Tail.load(std::memory_order_acquire) == Capacity)
+		{
+			return false;
+		}
+		m_Records[head % Capacity] = std::move(record);
+		m_Head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	void DrainInto(std::vector<LogRecord>& out)
+	{
+		const size_t head = m_Head.load(std::memory_order_acquire);
+		size_t tail = m_Tail.load(std::memory_order_relaxed);
+		for (; tail != head; tail++)
+		{
+			out.push_back(std::move(m_Records[tail % Capacity]));
+		}
+		m_Tail.store(tail, std::memory_order_release);
+	}
+
+	[[nodiscard]] size_t Size() const { return m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire); }
+
+	// Set once the owning thread exited, so the ring can be dropped once empty.
+	std::atomic<bool> orphaned { false };
+
+private:
+	std::array<LogRecord, Capacity> m_Records;
+	alignas(64) std::atomic<size_t> m_Head { 0 };
+	alignas(64) std::atomic<size_t> m_Tail { 0 };
+};
+
+const char* levelName(const Log::Level level)
+{
+	switch (level)
+	{
+	case Log::Level::Error:
+		return "ERROR";
+	case Log::Level::Warning:
+		return "WARNING";
+	case Log::Level::Success:
+		return "SUCCESS";
+	case Log::Level::Info:
+	default:
+		return "PRINT";
+	}
+}
+
+// jsonLevelName returns the name ParseLevel accepts for the level.
+const char* jsonLevelName(const Log::Level level)
+{
+	switch (level)
+	{
+	case Log::Level::Error:
+		return "error";
+	case Log::Level::Warning:
+		return "warning";
+	case Log::Level::Success:
+		return "success";
+	case Log::Level::Info:
+	default:
+		return "info";
+	}
+}
+
+const char* levelColor(const Log::Level level)
+{
+	switch (level)
+	{
+	case Log::Level::Error:
+		return Log::ColorRed;
+	case Log::Level::Warning:
+		return Log::ColorYellow;
+	case Log::Level::Success:
+		return Log::ColorGreen;
+	case Log::Level::Info:
+	default:
+		return "";
+	}
+}
+
+void appendJSONString(std::string& out, const std::string& value)
+{
+	out += '"';
+	for (const char c : value)
+	{
+		switch (c)
+		{
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		default:
+			if ((unsigned char)c < 0x20)
+			{
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+				out += escaped;
+			}
+			else
+			{
+				out += c;
+			}
+		}
+	}
+	out += '"';
+}
+
+// formatRecord appends the record, terminated by a newline, in the given format.
+void formatRecord(std::string& out, const LogRecord& record, const Log::Format format)
+{
+	if (format == Log::Format::Text)
+	{
+		// PRINT messages are not colored, the others reset the color after the message.
+		const bool colored = record.level != Log::Level::Info;
+		out += levelColor(record.level);
+		out += "[ ";
+		out += levelName(record.level);
+		out += " @ ";
+		out += record.func;
+		out += ":";
+		out += std::to_string(record.line);
+		out += " ] ";
+		out += record.message;
+		if (colored)
+		{
+			out += Log::ColorNormal;
+		}
+		out += '\n';
+		return;
+	}
+
+	const auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count();
+	const std::time_t seconds = millis / 1000;
+	std::tm utc {};
+	gmtime_r(&seconds, &utc);
+	char timestamp[32];
+	std::snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+	    utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, (int)(millis % 1000));
+
+	out += "{\"time\":\"";
+	out += timestamp;
+	out += "\",\"level\":\"";
+	out += jsonLevelName(record.level);
+	out += "\",\"func\":";
+	appendJSONString(out, record.func);
+	out += ",\"line\":";
+	out += std::to_string(record.line);
+	out += ",\"msg\":";
+	appendJSONString(out, record.message);
+	out += "}\n";
+}
+
+// PRINT goes to stdout, everything else to stderr.
+std::ostream& streamFor(const Log::Level level)
+{
+	return level == Log::Level::Info ? std::cout : std::cerr;
+}
+
+class AsyncLogger
+{
+public:
+	static constexpr std::chrono::milliseconds DrainInterval { 50 };
+
+	std::atomic<bool> running { false };
+	std::atomic<uint64_t> sequence { 0 };
+	// Threads between checking running and finishing their push. Stop waits
+	// for them before the final drain.
+	std::atomic<int> writers { 0 };
+
+	void Start()
+	{
+		std::lock_guard<std::mutex> lock(m_ControlMutex);
+		if (running)
+		{
+			return;
+		}
+		m_ShouldStop = false;
+		m_Drainer = std::thread([this]()
+		    { drainLoop(); });
+		running = true;
+	}
+
+	void Stop()
+	{
+		std::lock_guard<std::mutex> lock(m_ControlMutex);
+		if (!running)
+		{
+			return;
+		}
+		// Send new messages down the synchronous path and let the writers that
+		// already saw running finish their push, then write what is left.
+		running = false;
+		while (writers.load() > 0)
+		{
+			std::this_thread::yield();
+		}
+		{
+			std::lock_guard<std::mutex> wakeLock(m_WakeMutex);
+			m_ShouldStop = true;
+		}
+		m_WakeCV.notify_one();
+		m_Drainer.join();
+	}
+
+	void Wake()
+	{
+		m_WakeRequested.store(true, std::memory_order_relaxed);
+		m_WakeCV.notify_one();
+	}
+
+	// Flush writes everything queued so far on the calling thread.
+	void Flush()
+	{
+		std::vector<LogRecord> records;
+		std::string buffer;
+		drainOnce(records, buffer);
+	}
+
+	std::shared_ptr<LogRing> Register()
+	{
+		auto ring = std::make_shared<LogRing>();
+		std::lock_guard<std::mutex> lock(m_RingsMutex);
+		m_Rings.push_back(ring);
+		return ring;
+	}
+
+private:
+	std::mutex m_ControlMutex;
+	std::thread m_Drainer;
+
+	std::mutex m_WakeMutex;
+	std::condition_variable m_WakeCV;
+	bool m_ShouldStop = false;
+	// Wakes are not taken under m_WakeMutex, a missed one only delays the
+	// drain until the next interval.
+	std::atomic<bool> m_WakeRequested { false };
+
+	std::mutex m_RingsMutex;
+	std::vector<std::shared_ptr<LogRing>> m_Rings;
+
+	// Held for a whole drain, so that batches taken by the drain thread and
+	// by Flush are written in the order they were taken.
+	std::mutex m_DrainMutex;
+
+	void drainLoop()
+	{
+		std::vector<LogRecord> records;
+		std::string buffer;
+		while (true)
+		{
+			bool stop;
+			{
+				std::unique_lock<std::mutex> lock(m_WakeMutex);
+				m_WakeCV.wait_for(lock, DrainInterval, [this]()
+				    { return m_ShouldStop || m_WakeRequested.exchange(false, std::memory_order_relaxed); });
+				stop = m_ShouldStop;
+			}
+
+			drainOnce(records, buffer);
+			if (stop)
+			{
+				return;
+			}
+		}
+	}
+
+	void drainOnce(std::vector<LogRecord>& records, std::string& buffer)
+	{
+		std::lock_guard<std::mutex> drainLock(m_DrainMutex);
+		{
+			std::lock_guard<std::mutex> lock(m_RingsMutex);
+			for (const auto& ring : m_Rings)
+			{
+				ring->DrainInto(records);
+			}
+			// Drop the rings of exited threads. The orphaned flag is set after
+			// the last push, so an empty orphaned ring stays empty.
+			m_Rings.erase(std::remove_if(m_Rings.begin(), m_Rings.end(), [](const std::shared_ptr<LogRing>& ring)
+			                  { return ring->orphaned && ring->Size() == 0; }),
+			    m_Rings.end());
+		}
+		if (records.empty())
+		{
+			return;
+		}
+
+		// Messages from different threads are ordered by when they were
+		// logged. A message still being pushed by a thread when the drain
+		// runs ends up in the next batch.
+		std::sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b)
+		    { return a.sequence < b.sequence; });
+
+		std::lock_guard<std::mutex> lock(Log::mutex);
+		std::ostream* current = &streamFor(records.front().level);
+		for (const LogRecord& record : records)
+		{
+			std::ostream* stream = &streamFor(record.level);
+			if (stream != current)
+			{
+				current->write(buffer.data(), (std::streamsize)buffer.size());
+				current->flush();
+				buffer.clear();
+				current = stream;
+			}
+			formatRecord(buffer, record, Log::GetFormat());
+		}
+		current->write(buffer.data(), (std::streamsize)buffer.size());
+		current->flush();
+		buffer.clear();
+		records.clear();
+	}
+};
+
+AsyncLogger& asyncLogger()
+{
+	// Never destroyed, threads may still log while the process exits.
+	static AsyncLogger* logger = new AsyncLogger();
+	return *logger;
+}
+
+// RingHandle registers a ring for the thread on first use and hands it over
+// to the drain thread when the thread exits.
+struct RingHandle
+{
+	std::shared_ptr<LogRing> ring;
+
+	~RingHandle()
+	{
+		if (ring)
+		{
+			ring->orphaned = true;
+		}
+	}
+};
+
+thread_local RingHandle t_Ring;
+}
 
 void Log::DisableColoredOutput()
 {
@@ -24,3 +409,101 @@ void Log::DisableColoredOutput()
 	ColorGreen = "";
 	ColorNormal = "";
 }
+
+Log::Level Log::ParseLevel(const std::string& level)
+{
+	if (level == "error")
+	{
+		return Level::Error;
+	}
+	if (level == "warning")
+	{
+		return Level::Warning;
+	}
+	if (level == "success")
+	{
+		return Level::Success;
+	}
+	if (level == "info")
+	{
+		return Level::Info;
+	}
+	throw std::invalid_argument("invalid log level \"" + level + "\", expected one of error, warning, success or info");
+}
+
+Log::Format Log::ParseFormat(const std::string& format)
+{
+	if (format == "text")
+	{
+		return Format::Text;
+	}
+	if (format == "json")
+	{
+		return Format::JSON;
+	}
+	throw std::invalid_argument("invalid log format \"" + format + "\", expected text or json");
+}
+
+void Log::StartAsync()
+{
+	static std::once_flag registerAtExit;
+	std::call_once(registerAtExit, []()
+	    { std::atexit(Log::StopAsync); });
+	asyncLogger().Start();
+}
+
+void Log::StopAsync()
+{
+	asyncLogger().Stop();
+}
+
+void Log::Write(const Level level, const char* func, const int line, std::string&& message)
+{
+	AsyncLogger& logger = asyncLogger();
+	LogRecord record {
+		.sequence = logger.sequence.fetch_add(1, std::memory_order_relaxed),
+		.level = level,
+		.func = func,
+		.line = line,
+		.time = std::chrono::system_clock::now(),
+		.message = std::move(message),
+	};
+
+	// Announce the write before checking running, so that a concurrent Stop
+	// either waits for this push or this thread sees it stopped.
+	logger.writers.fetch_add(1);
+	if (!logger.running.load())
+	{
+		logger.writers.fetch_sub(1);
+		std::string out;
+		formatRecord(out, record, s_Format);
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ostream& stream = streamFor(level);
+		stream.write(out.data(), (std::streamsize)out.size());
+		stream.flush();
+		return;
+	}
+
+	if (!t_Ring.ring)
+	{
+		t_Ring.ring = logger.Register();
+	}
+	while (!t_Ring.ring->TryPush(std::move(record)))
+	{
+		// The drain thread fell behind, let it catch up.
+		logger.Wake();
+		std::this_thread::yield();
+	}
+	logger.writers.fetch_sub(1);
+
+	if (level == Level::Error)
+	{
+		// Errors often come right before the process aborts, write them out
+		// together with everything logged before them.
+		logger.Flush();
+	}
+	else if (t_Ring.ring->Size() > LogRing::Capacity / 2)
+	{
+		logger.Wake();
+	}
+}
@@ -6,12 +6,41 @@
  */
 #pragma once
 
+#include <atomic>
 #include <mutex>
 #include <iostream>
+#include <sstream>
+#include <string>
 
+/*
+ * Log formats messages on the calling thread and writes them either directly
+ * (the default) or, once StartAsync was called, through a background thread.
+ *
+ * In asynchronous mode every thread appends its messages to its own lock-free
+ * ring buffer. A drain thread collects the buffers a few times per second,
+ * orders the messages by a process wide sequence number and writes them out
+ * in batches, so logging threads never wait for the terminal or each other.
+ * Errors are written out before Write returns, together with everything
+ * logged before them, so they aren't lost if the process aborts.
+ */
 class Log
 {
 public:
+	// Levels in order of importance, a level enables all levels before it.
+	enum class Level
+	{
+		Error = 0,
+		Warning = 1,
+		Success = 2,
+		Info = 3,
+	};
+
+	enum class Format
+	{
+		Text,
+		JSON,
+	};
+
 	static const char* ColorRed;
 	static const char* ColorYellow;
 	static const char* ColorGreen;
@@ -19,34 +48,44 @@ public:
 	static std::mutex mutex;
 
 	static void DisableColoredOutput();
+
+	// ParseLevel accepts error, warning, success and info.
+	static Level ParseLevel(const std::string& level);
+	static void SetLevel(Level level) { s_Level.store((int)level, std::memory_order_relaxed); }
+	static bool IsEnabled(Level level) { return (int)level <= s_Level.load(std::memory_order_relaxed); }
+
+	// ParseFormat accepts text and json.
+	static Format ParseFormat(const std::string& format);
+	static void SetFormat(Format format) { s_Format = format; }
+	static Format GetFormat() { return s_Format; }
+
+	// StartAsync starts the drain thread. Pending messages are written when
+	// StopAsync is called, which also happens when the process exits.
+	static void StartAsync();
+	static void StopAsync();
+
+	// Write logs a formatted message. Use the macros below instead.
+	static void Write(Level level, const char* func, int line, std::string&& message);
+
+private:
+	static std::atomic<int> s_Level;
+	static Format s_Format;
 };
 
-#define PRINT(x)                                                                             \
-	{                                                                                        \
-		std::lock_guard<std::mutex> lk(Log::mutex);                                          \
-		std::cout << "[ PRINT @ " << __func__ << ":" << __LINE__ << " ] " << x << std::endl; \
+#define LOG_AT(level, x)                                                     \
+	{                                                                        \
+		if (Log::IsEnabled(level))                                           \
+		{                                                                    \
+			std::ostringstream logStream;                                    \
+			logStream << x;                                                  \
+			Log::Write(level, __func__, __LINE__, std::move(logStream).str()); \
+		}                                                                    \
 	}
 
-#define ERR(x)                                                            \
-	{                                                                     \
-		std::lock_guard<std::mutex> lk(Log::mutex);                       \
-		std::cerr << Log::ColorRed                                        \
-		          << "[ ERROR @ " << __func__ << ":" << __LINE__ << " ] " \
-		          << x << Log::ColorNormal << std::endl;                  \
-	}
+#define PRINT(x) LOG_AT(Log::Level::Info, x)
 
-#define WARN(x)                                                             \
-	{                                                                       \
-		std::lock_guard<std::mutex> lk(Log::mutex);                         \
-		std::cerr << Log::ColorYellow                                       \
-		          << "[ WARNING @ " << __func__ << ":" << __LINE__ << " ] " \
-		          << x << Log::ColorNormal << std::endl;                    \
-	}
+#define ERR(x) LOG_AT(Log::Level::Error, x)
+
+#define WARN(x) LOG_AT(Log::Level::Warning, x)
 
-#define SUCCESS(x)                                                          \
-	{                                                                       \
-		std::lock_guard<std::mutex> lk(Log::mutex);                         \
-		std::cerr << Log::ColorGreen                                        \
-		          << "[ SUCCESS @ " << __func__ << ":" << __LINE__ << " ] " \
-		          << x << Log::ColorNormal << std::endl;                    \
-	}
\ No newline at end of file
+#define SUCCESS(x) LOG_AT(Log::Level::Success, x)
@@ -4,8 +4,13 @@
  * SPDX-License-Identifier: BSD-3-Clause
  * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
  */
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #include "utils/timer.h"
@@ -16,12 +21,17 @@
 #include "git_api.h"
 #include "branch_set.h"
 #include "tracer.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "ledger.h"
+#include "memory_accounting.h"
 #include "labels_conversion.h"
 #include "labels_cache.h"
+#include "user_cache.h"
 
 #define P4_FUSION_VERSION "v1.14.3-sg"
 
-int fetchAndUpdateLabels(P4API& p4, GitAPI& git, const std::string& depotPath, const std::string& cachePath)
+int fetchAndUpdateLabels(P4API& p4, GitAPI& git, const std::string& depotPath, const std::string& cachePath, const int threads, const bool detailsFromList)
 {
 	// Load labels
 	PRINT("Requesting labels from the Perforce server")
@@ -34,39 +44,118 @@ int fetchAndUpdateLabels(P4API& p4, GitAPI& git, const std::string& depotPath, c
 	const std::list<LabelsResult::LabelData>& labels = labelsRes.GetLabels();
 	SUCCESS("Received " << labels.size() << " labels from the Perforce server")
 
-	LabelNameToDetails cachedLabels;
+	std::unique_ptr<LabelCache> cache;
 	if (cachePath.size() > 0)
 	{
-		PRINT("Reading labels from cache")
-		cachedLabels = read_label_map_from_disk(cachePath);
-		SUCCESS("Successfully read " << cachedLabels.size() << " cached labels")
+		PRINT("Opening label cache " << cachePath)
+		cache = std::make_unique<LabelCache>(cachePath);
+		SUCCESS("Label cache holds " << cache->Size() << " labels, " << cache->JournalSize() << " of them changed since it was last compacted")
 	}
 
 	PRINT("Comparing cached labels with labels from the Perforce server")
-	CompareResponse compResp = compare_labels_to_cache(labels, cachedLabels);
+	CompareResponse compResp = compare_labels_to_cache(labels, cache.get());
 
-	PRINT("Fetching " << compResp.labelsToFetch.size() << " new label details")
-	LabelNameToDetails fetchedLabelMap = get_labels_details(&p4, compResp.labelsToFetch);
+	PRINT("Fetching " << compResp.labelsToFetch.size() << " new label details over up to " << threads << " connections")
+	Timer fetchTimer;
+	LabelNameToDetails fetchedLabelMap = get_labels_details(&p4, compResp.labelsToFetch, threads, detailsFromList);
+	SUCCESS("Fetched " << fetchedLabelMap.size() << " label details in " << fetchTimer.GetTimeS() << "s")
 
 	// Join the new map with the old map
 	for (const auto& pair : fetchedLabelMap)
 	{
 		compResp.resultingLabels.insert({ pair.first, pair.second });
 	}
+	MemoryAccounting::Reservation labelsMemory(MemoryAccounting::Stage::Labels);
+	const int64_t labelDetailsBytes = label_details_memory_usage(compResp.resultingLabels);
+	labelsMemory.Set(labelDetailsBytes);
 
-	if (cachePath.size() > 0)
+	if (cache)
 	{
-		PRINT("Caching updated labels to " << cachePath)
-		write_label_map_to_disk(cachePath, compResp.resultingLabels, cachePath);
+		// Only the labels that changed are written to the cache.
+		PRINT("Caching " << fetchedLabelMap.size() << " updated and " << compResp.labelsToRemove.size() << " removed labels to " << cachePath)
+		for (const auto& pair : fetchedLabelMap)
+		{
+			cache->Put(pair.second);
+		}
+		for (const auto& label : compResp.labelsToRemove)
+		{
+			cache->Remove(label);
+		}
+		cache->Commit();
 	}
 
 	LabelMap revToLabel = label_details_to_map(depotPath, compResp.resultingLabels);
+	labelsMemory.Set(labelDetailsBytes + label_map_memory_usage(revToLabel));
+	PRINT("Labels hold an estimated " << MemoryAccounting::FormatBytes(MemoryAccounting::Get(MemoryAccounting::Stage::Labels)))
 
 	PRINT("Updating tags.")
 	git.CreateTagsFromLabels(revToLabel);
 	return 0;
 }
 
+constexpr int maxPollBackoffMs = 5 * 60 * 1000;
+
+// waitForChanges polls the server every intervalMs milliseconds with a
+// single changes -m1, until changelists after the last converted one are
+// submitted under depotPath, and returns them. Errors are logged and the
+// polling backs off, up to maxPollBackoffMs between polls.
+std::deque<ChangeList> waitForChanges(P4API& p4, const GitAPI& git, const std::string& depotPath, const int maxChanges, const int intervalMs)
+{
+	const std::string resumeFromCL = git.IsHEADExists() ? git.DetectLatestCL() : "";
+	const int latestConverted = resumeFromCL.empty() ? 0 : std::stoi(resumeFromCL);
+	PRINT("Waiting for changelists after CL " << latestConverted << ", polling every " << intervalMs << "ms")
+
+	int delayMs = intervalMs;
+	// Errors double the delay, starting from at least a second.
+	auto backOff = [&delayMs, intervalMs]()
+	{
+		delayMs = std::min(std::max(delayMs, 1000) * 2, std::max(intervalMs, maxPollBackoffMs));
+	};
+	// The latest changelist the last full listing was made for. The listing
+	// is only repeated once the latest changelist moves past it.
+	int listedLatest = latestConverted;
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+
+		ChangesResult latestRes = p4.LatestChange(depotPath);
+		if (latestRes.HasError())
+		{
+			backOff();
+			ERR("Failed to poll for changes, retrying in " << delayMs << "ms: " << latestRes.PrintError())
+			continue;
+		}
+		delayMs = intervalMs;
+		if (latestRes.GetChanges().empty() || latestRes.GetChanges().front().number <= listedLatest)
+		{
+			continue;
+		}
+		const int latest = latestRes.GetChanges().front().number;
+
+		ChangesResult changesRes = p4.Changes(depotPath, resumeFromCL, maxChanges);
+		if (changesRes.HasError())
+		{
+			backOff();
+			ERR("Failed to list changes, retrying in " << delayMs << "ms: " << changesRes.PrintError())
+			continue;
+		}
+		std::deque<ChangeList>& changes = changesRes.GetChanges();
+		if (changes.empty())
+		{
+			// The latest changelist doesn't touch the files of the client
+			// view, or was submitted out of order. Keep waiting for a newer
+			// one instead of listing again on every poll.
+			listedLatest = latest;
+			continue;
+		}
+		for (const auto& cl : changes)
+		{
+			MemoryAccounting::Add(MemoryAccounting::Stage::Changes, cl.MemoryUsage());
+		}
+		return std::move(changes);
+	}
+}
+
 int Main(int argc, char** argv)
 {
 	// Initialize a program timer to track total execution time.
@@ -84,11 +173,34 @@ int Main(int argc, char** argv)
 	{
 		Log::DisableColoredOutput();
 	}
+	Log::SetLevel(Log::ParseLevel(arguments.GetLogLevel()));
+	Log::SetFormat(Log::ParseFormat(arguments.GetLogFormat()));
+	// From here on, log lines are written by a background thread.
+	Log::StartAsync();
 
 	arguments.Print();
 
-	// Initialize a minitrace based tracer.
-	Tracer tracer(arguments.GetSourcePath(), arguments.GetFlushRate());
+	// All commits go to HEAD until branches get refs of their own, so the
+	// files of different branches would overwrite each other there.
+	if (!arguments.GetBranches().empty())
+	{
+		ERR("--branch is not supported yet, branches have no refs of their own and would overwrite each other's files in HEAD")
+		return 1;
+	}
+
+	for (const auto& memoryLimit : arguments.GetMemoryLimits())
+	{
+		MemoryAccounting::ParseLimit(memoryLimit);
+	}
+
+	// Initialize the tracer, which also keeps the latency report up to date.
+	std::string latencyReport = arguments.GetLatencyReport();
+	if (!latencyReport.empty() && !arguments.GetTrace() && arguments.GetMetricsFile().empty())
+	{
+		WARN("Not writing the latency report, it requires --trace or --metricsFile")
+		latencyReport.clear();
+	}
+	Tracer tracer(arguments.GetSourcePath(), latencyReport, arguments.GetFlushRate(), arguments.GetTrace(), arguments.GetTraceSample(), arguments.GetTraceMinDuration());
 
 	// Initialize the P4Libraries API.
 	// It will be uninitialized once this function returns.
@@ -105,73 +217,172 @@ int Main(int argc, char** argv)
 	P4API::CommandRefreshThreshold = arguments.GetRefresh();
 	P4API::P4CLIENT = arguments.GetClient();
 
-	// Create the p4 API for the main thread.
-	P4API p4;
-
 	{
-		TestResult serviceConnectionResult = p4.TestConnection(5);
-		if (serviceConnectionResult.HasError())
+		auto rateLimits = std::make_shared<RateLimiter>();
+		if (arguments.GetMaxCommandRate() > 0)
 		{
-			ERR("Error occurred while connecting to " << P4API::P4PORT << ": " << serviceConnectionResult.PrintError())
-			return 1;
+			rateLimits->SetCommandRate(arguments.GetMaxCommandRate());
 		}
-
-		SUCCESS("Perforce server is available")
-	}
-
-	{
-		ClientResult clientRes = p4.Client();
-		if (clientRes.HasError())
+		for (const auto& commandRate : arguments.GetCommandRates())
 		{
-			ERR("Error occurred while fetching client spec: " + clientRes.PrintError())
-			return 1;
+			rateLimits->ParseCommandRate(commandRate);
 		}
-		P4API::ClientSpec = clientRes.GetClientSpec();
-
-		if (P4API::ClientSpec.mapping.empty())
+		if (arguments.GetMaxBytesPerSecond() > 0)
 		{
-			ERR("Received a client spec with no mappings. Did you use the correct corresponding P4PORT for the " + P4API::ClientSpec.client + " client spec?")
-			return 1;
+			rateLimits->SetByteRate(arguments.GetMaxBytesPerSecond());
+		}
+		if (!rateLimits->IsEmpty())
+		{
+			P4API::RateLimits = rateLimits;
 		}
+	}
 
-		PRINT("Updated client workspace view " << P4API::ClientSpec.client << " with " << P4API::ClientSpec.mapping.size() << " mappings")
+	if (!arguments.GetRecord().empty() && !arguments.GetReplay().empty())
+	{
+		ERR("--record and --replay can't be used together")
+		return 1;
+	}
+	if (!arguments.GetRecord().empty())
+	{
+		P4API::Archive = std::make_shared<CommandArchive>(arguments.GetRecord(), CommandArchive::Mode::Record, 0);
+		PRINT("Recording Perforce commands to " << P4API::Archive->GetDirectory())
+	}
+	else if (!arguments.GetReplay().empty())
+	{
+		P4API::Archive = std::make_shared<CommandArchive>(arguments.GetReplay(), CommandArchive::Mode::Replay, arguments.GetReplayLatency());
+		PRINT("Replaying Perforce commands from " << P4API::Archive->GetDirectory() << " instead of connecting to " << P4API::P4PORT)
 	}
 
 	auto depotPath = arguments.GetDepotPath();
 	auto srcPath = arguments.GetSourcePath();
 	auto printBatch = arguments.GetPrintBatch();
 
+	const int daemonInterval = arguments.GetDaemonInterval();
+	if (daemonInterval > 0 && arguments.GetDownloadOnly())
+	{
+		ERR("--daemonInterval can't be used with --downloadOnly, which doesn't commit the changes it waits for")
+		return 1;
+	}
+
 	if (!P4API::IsDepotPathValid(depotPath))
 	{
 		ERR("Depot path should begin with \"//\" and end with \"/...\". Please pass in the proper depot path and try again.")
 		return 1;
 	}
 
-	if (!p4.IsDepotPathUnderClientSpec(depotPath))
+	// The startup commands only depend on each other along these chains,
+	// which run concurrently, each on its own connection:
+	//
+	//   test connection -> client spec -> repository -> changes
+	//                                                -> thread pool warm-up
+	//   server info
+	//
+	// The repository is only created once the client spec and the depot path
+	// have been checked. The workers connect while the changes and the server
+	// info are still being fetched, and the authors of the changes are looked
+	// up while they do. Each task throws on error.
+	Timer startupTimer;
+	float testConnectionS = 0;
+	float clientS = 0;
+	float infoS = 0;
+	float repositoryS = 0;
+	float changesS = 0;
+
+	// The pool is created before the changes are known, so its size can only
+	// be capped by --maxChanges. A daemon keeps its pool for later syncs,
+	// which may be larger than the first one.
+	int networkThreads = arguments.GetNetworkThreads();
+	if (daemonInterval == 0 && arguments.GetMaxChanges() > 0 && networkThreads > arguments.GetMaxChanges())
 	{
-		ERR("The depot path specified is not under the " << P4API::ClientSpec.client << " client spec. Consider changing the client spec so that it does. Exiting.")
+		networkThreads = arguments.GetMaxChanges();
+	}
+	if (arguments.GetAdaptiveConcurrency())
+	{
+		P4API::CommandLimiter = std::make_shared<ConcurrencyLimiter>(std::min(arguments.GetMinNetworkThreads(), networkThreads), networkThreads);
+		PRINT("Limiting Perforce commands in flight adaptively between " << P4API::CommandLimiter->GetMinLimit() << " and " << P4API::CommandLimiter->GetMaxLimit())
+	}
+
+	// Create the p4 API for the main thread, and the one for the server info.
+	// Connections read the client spec when they are created, so they are
+	// created here, before it is set.
+	P4API p4;
+	P4API p4info;
+
+	std::future<ClientResult::ClientSpecData> clientFuture = std::async(std::launch::async, [&p4, &testConnectionS, &clientS]()
+	    {
+		    Timer testTimer;
+		    TestResult serviceConnectionResult = p4.TestConnection(5);
+		    if (serviceConnectionResult.HasError())
+		    {
+			    throw std::runtime_error("Error occurred while connecting to " + P4API::P4PORT + ": " + serviceConnectionResult.PrintError());
+		    }
+		    testConnectionS = testTimer.GetTimeS();
+		    SUCCESS("Perforce server is available")
+
+		    Timer clientTimer;
+		    ClientResult clientRes = p4.Client();
+		    if (clientRes.HasError())
+		    {
+			    throw std::runtime_error("Error occurred while fetching client spec: " + clientRes.PrintError());
+		    }
+		    clientS = clientTimer.GetTimeS();
+		    return clientRes.GetClientSpec(); });
+
+	std::future<int> infoFuture = std::async(std::launch::async, [&p4info, &infoS]()
+	    {
+		    Timer infoTimer;
+		    InfoResult p4infoRes = p4info.Info();
+		    if (p4infoRes.HasError())
+		    {
+			    throw std::runtime_error("Failed to fetch Perforce server timezone: " + p4infoRes.PrintError());
+		    }
+		    infoS = infoTimer.GetTimeS();
+		    return p4infoRes.GetServerTimezoneMinutes(); });
+
+	const bool downloadOnly = arguments.GetDownloadOnly();
+	if (downloadOnly)
+	{
+		BlobWriter::ContentSink = arguments.GetHashContents() ? BlobWriter::Sink::Hash : BlobWriter::Sink::Discard;
+		WARN("Download only: file contents are " << (arguments.GetHashContents() ? "hashed" : "discarded") << " and no commits or tags are written")
+	}
+
+	const ClientResult::ClientSpecData clientSpec = clientFuture.get();
+	if (clientSpec.mapping.empty())
+	{
+		ERR("Received a client spec with no mappings. Did you use the correct corresponding P4PORT for the " + clientSpec.client + " client spec?")
 		return 1;
 	}
+	// No task is creating a connection anymore, those created from here on
+	// map files through the client spec.
+	P4API::ClientSpec = clientSpec;
+	PRINT("Updated client workspace view " << P4API::ClientSpec.client << " with " << P4API::ClientSpec.mapping.size() << " mappings")
 
-	int timezoneMinutes;
+	if (!p4.IsDepotPathUnderClientSpec(depotPath))
 	{
-		InfoResult p4infoRes = p4.Info();
-		if (p4infoRes.HasError())
-		{
-			ERR("Failed to fetch Perforce server timezone: " << p4infoRes.PrintError())
-			return 1;
-		}
-		timezoneMinutes = p4infoRes.GetServerTimezoneMinutes();
-		SUCCESS("Perforce server timezone is " << timezoneMinutes << " minutes")
+		ERR("The depot path specified is not under the " << P4API::ClientSpec.client << " client spec. Consider changing the client spec so that it does. Exiting.")
+		return 1;
 	}
 
-	GitAPI git(srcPath, timezoneMinutes);
+	// The timezone is only needed to write commits, it is set once the
+	// server info arrives.
+	Timer repositoryTimer;
+	GitAPI git(srcPath, 0);
 
-	// This throws on error. It should be called before the ThreadPool is created.
-	git.InitializeRepository(arguments.GetNoBaseCommit());
+	bool hasRepository = true;
+	if (downloadOnly)
+	{
+		// Nothing is written to the repository in download only mode. An
+		// existing one is only read to resume after its latest CL.
+		hasRepository = git.OpenExistingRepository();
+	}
+	else
+	{
+		// This throws on error. It should be called before the ThreadPool is created.
+		git.InitializeRepository(arguments.GetNoBaseCommit());
+	}
 
 	std::string resumeFromCL;
-	if (git.IsHEADExists())
+	if (hasRepository && git.IsHEADExists())
 	{
 		if (!git.IsRepositoryClonedFrom(depotPath))
 		{
@@ -182,31 +393,59 @@ int Main(int argc, char** argv)
 		resumeFromCL = git.DetectLatestCL();
 		SUCCESS("Detected last CL committed as CL " << resumeFromCL)
 	}
+	repositoryS = repositoryTimer.GetTimeS();
 
 	// Request changelists.
 	PRINT("Requesting changelists to convert from the Perforce server")
-	std::deque<ChangeList> changes;
+	std::future<std::deque<ChangeList>> changesFuture = std::async(std::launch::async, [&depotPath, &resumeFromCL, &arguments, &changesS]()
+	    {
+		    Timer changesTimer;
+		    P4API p4changes;
+		    ChangesResult changesRes = p4changes.Changes(depotPath, resumeFromCL, arguments.GetMaxChanges());
+		    if (changesRes.HasError())
+		    {
+			    throw std::runtime_error("Failed to list changes: " + changesRes.PrintError());
+		    }
+		    changesS = changesTimer.GetTimeS();
+		    return std::move(changesRes.GetChanges()); });
+
+	// Create the thread pool, its workers connect in the background while the
+	// changes and the server info are fetched.
+	PRINT("Creating " << networkThreads << " network threads")
+	ThreadPool pool(networkThreads, srcPath);
+	SUCCESS("Created " << pool.GetThreadCount() << " threads in thread pool, connecting them in the background")
+
+	const int timezoneMinutes = infoFuture.get();
+	git.SetTimezoneMinutes(timezoneMinutes);
+	SUCCESS("Perforce server timezone is " << timezoneMinutes << " minutes")
+	std::deque<ChangeList> changes = changesFuture.get();
+
+	SUCCESS("Startup queries took " << startupTimer.GetTimeS() << "s: test connection " << testConnectionS << "s, client spec " << clientS << "s, server info " << infoS << "s, repository " << repositoryS << "s, changes " << changesS << "s")
+
+	for (const auto& cl : changes)
 	{
-		ChangesResult changesRes = p4.Changes(depotPath, resumeFromCL, arguments.GetMaxChanges());
-		if (changesRes.HasError())
-		{
-			ERR("Failed to list changes: " << changesRes.PrintError())
-			return 1;
-		}
-		changes = std::move(changesRes.GetChanges());
+		MemoryAccounting::Add(MemoryAccounting::Stage::Changes, cl.MemoryUsage());
 	}
 
-	// Return early if we have no work to do
+	// Return early if we have no work to do, a daemon waits for some.
 	if (changes.empty())
 	{
 		SUCCESS("Repository is up to date.")
 
-		if (!arguments.GetNoConvertLabels())
+		if (!arguments.GetNoConvertLabels() && !downloadOnly)
+		{
+			const int exitCode = fetchAndUpdateLabels(p4, git, depotPath, arguments.GetLabelCache(), arguments.GetLabelThreads(), arguments.GetLabelDetailsFromList());
+			if (exitCode != 0 || daemonInterval == 0)
+			{
+				return exitCode;
+			}
+		}
+		else if (daemonInterval == 0)
 		{
-			return fetchAndUpdateLabels(p4, git, depotPath, arguments.GetLabelCache());
+			return 0;
 		}
 
-		return 0;
+		changes = waitForChanges(p4, git, depotPath, arguments.GetMaxChanges(), daemonInterval);
 	}
 	SUCCESS("Found " << changes.size() << " uncloned CLs starting from CL " << changes.front().number << " to CL " << changes.back().number)
 
@@ -216,149 +455,296 @@ int Main(int argc, char** argv)
 		PRINT("Inspecting " << branchSet.Count() << " branches")
 	}
 
-	// Load mapping data from usernames to emails.
-	PRINT("Requesting userbase details from the Perforce server")
-	UsersResult usersRes = p4.Users();
-	if (usersRes.HasError())
-	{
-		ERR("Failed to retrieve user details for mapping: " << usersRes.PrintError())
-		return 1;
-	}
-	const std::unordered_map<UsersResult::UserID, UsersResult::UserData>& users = usersRes.GetUserEmails();
-	SUCCESS("Received " << users.size() << " userbase details from the Perforce server")
-
-	// Create the thread pool
-	int networkThreads = arguments.GetNetworkThreads();
-	if (networkThreads > changes.size())
+	// Collect the authors before the workers start changing the changelists.
+	std::vector<std::string> authors;
+	authors.reserve(changes.size());
+	for (const auto& cl : changes)
 	{
-		networkThreads = int(changes.size());
+		authors.push_back(cl.user);
 	}
-	PRINT("Creating " << networkThreads << " network threads")
-	ThreadPool pool(networkThreads, srcPath, timezoneMinutes);
-	SUCCESS("Created " << pool.GetThreadCount() << " threads in thread pool")
 
-	// Go in the chronological order.
-	std::atomic<int> nextToEnqueue;
 	std::atomic<int> downloaded;
 	downloaded.store(0);
-	size_t startupDownloadsCount = arguments.GetLookAhead();
-	if (startupDownloadsCount > changes.size())
+	std::atomic<int64_t> inFlightBytes(0);
+	DownloadContext downloadContext {
+		.branchSet = branchSet,
+		.printBatch = printBatch,
+		.pool = pool,
+		.downloaded = downloaded,
+		.inFlightBytes = inFlightBytes,
+	};
+
+	Metric& changelistsToConvert = Metrics::Gauge("p4_fusion_changelists", "Changelists to convert in this run.");
+	Metric& changelistsCommitted = Metrics::Counter("p4_fusion_changelists_committed_total", "Changelists committed to the git repository.");
+	Metric& committerWait = Metrics::Counter("p4_fusion_committer_wait_seconds_total", "Time the committer spent waiting for the next changelist to download.");
+	std::unique_ptr<MetricsExporter> metricsExporter;
+	if (!arguments.GetMetricsFile().empty())
 	{
-		startupDownloadsCount = changes.size();
+		// These are sampled right before every write instead of being
+		// updated on every change.
+		metricsExporter = std::make_unique<MetricsExporter>(arguments.GetMetricsFile(), arguments.GetMetricsInterval(), [&pool, &downloaded]()
+		    {
+			    Metrics::Gauge("thread_pool_queue_depth", "Jobs waiting for a network thread.").Set((double)pool.GetQueueDepth());
+			    Metrics::Gauge("thread_pool_busy_workers", "Network threads running a job.").Set(pool.GetBusyWorkers());
+			    Metrics::Counter("p4_fusion_changelists_downloaded_total", "Changelists fully downloaded.").Set(downloaded.load());
+			    Watchdog::UpdateMetrics();
+			    MemoryAccounting::UpdateMetrics(); });
 	}
-	// First, we enqueue the initial set of changelists for download, at most
-	// lookAhead jobs.
-	for (size_t currentCL = 0; currentCL < startupDownloadsCount; currentCL++)
+	std::unique_ptr<CounterSampler> traceCounters;
+	if (Trace::IsEnabled())
 	{
-		ChangeList& cl = changes.at(currentCL);
-
-		nextToEnqueue++;
-
-		pool.AddJob([&downloaded, &cl, &branchSet, printBatch](P4API& p4, GitAPI& git)
+		traceCounters = std::make_unique<CounterSampler>(100, [&pool, &downloaded, &inFlightBytes]()
 		    {
-			cl.StartDownload(p4, git, branchSet, printBatch);
-			// Mark download as done.
-			downloaded++; });
+			    Trace::Counter("queue depth", (double)pool.GetQueueDepth());
+			    Trace::Counter("busy workers", pool.GetBusyWorkers());
+			    Trace::Counter("in-flight bytes", (double)inFlightBytes.load(std::memory_order_relaxed));
+			    Trace::Counter("changelists downloaded", downloaded.load(std::memory_order_relaxed)); });
 	}
+	Watchdog watchdog(arguments.GetStallThreshold());
+	std::unique_ptr<Ledger> ledger;
+	if (!arguments.GetLedger().empty())
+	{
+		ledger = std::make_unique<Ledger>(arguments.GetLedger());
+		SUCCESS("Writing per-CL ledger to " << arguments.GetLedger())
+	}
+	// Load the names and emails of the authors of the changelists, while the
+	// workers connect and start downloading. Resolve throws on error. In
+	// download only mode the cache isn't kept, it would be written into a
+	// repository that may not even exist.
+	UserCache users(srcPath + (srcPath.back() == '/' ? "" : "/") + "users.cache", downloadOnly ? 0 : arguments.GetUserCacheTTL());
+	auto noMerge = arguments.GetNoMerge();
+	std::vector<BranchedFileGroup> emptyGroups;
+	Metric& downloadPauses = Metrics::Counter("p4_fusion_download_pauses_total", "Times queueing downloads was paused because a stage was over its memory limit.");
+
+	// A single run converts the changes once, a daemon keeps the connections,
+	// authors, branch indexes and changelist index of the repository for the
+	// next changes.
+	bool firstSync = true;
+	Timer syncTimer = programTimer;
+	while (true)
+	{
+		changelistsToConvert.Set((double)changes.size());
+
+		// Go in the chronological order.
+		std::atomic<int> nextToEnqueue(0);
+		size_t startupDownloadsCount = arguments.GetLookAhead();
+		if (startupDownloadsCount > changes.size())
+		{
+			startupDownloadsCount = changes.size();
+		}
 
-	SUCCESS("Queued first " << startupDownloadsCount << " CLs up until CL " << changes.at(startupDownloadsCount - 1).number << " for downloading")
+		// First, we enqueue the initial set of changelists for download, at most
+		// lookAhead jobs.
+		// The sequence number of a CL in this run is used as the priority of its
+		// download jobs, so that workers always pick the oldest outstanding CL.
+		for (size_t currentCL = 0; currentCL < startupDownloadsCount; currentCL++)
+		{
+			ChangeList& cl = changes.at(currentCL);
 
-	// Commit procedure start
-	Timer commitTimer;
+			nextToEnqueue++;
+
+			cl.stats.queuedAt = Timer::Now();
+			pool.AddJob([&downloadContext, &cl, currentCL](P4API& p4, GitAPI& git)
+			    { cl.StartDownload(p4, git, downloadContext, (int64_t)currentCL); },
+			    (int64_t)currentCL);
+		}
+
+		SUCCESS("Queued first " << startupDownloadsCount << " CLs up until CL " << changes.at(startupDownloadsCount - 1).number << " for downloading")
 
-	auto totalChanges = changes.size();
-	auto noMerge = arguments.GetNoMerge();
-	int i(0);
-	while (!changes.empty())
-	{
-		// Ensure the files are downloaded before committing them to the repository
-		// First, wait until downloaded so the changelist is no longer referenced
-		// in worker threads.
-		changes.front().WaitForDownload();
-
-		// Now move the changelist and pop it off the queue.
-		// Once this iteration is over, it will be destructed
-		// and memory is freed.
-		ChangeList cl = std::move(changes.front());
-		changes.pop_front();
-
-		std::string fullName(cl.user);
-		std::string email("deleted@user");
-		if (users.find(cl.user) != users.end())
 		{
-			fullName = users.at(cl.user).fullName;
-			email = users.at(cl.user).email;
+			Timer usersTimer;
+			users.Resolve(p4, authors);
+			if (firstSync)
+			{
+				SUCCESS("Startup took " << startupTimer.GetTimeS() << "s, looking up authors " << usersTimer.GetTimeS() << "s")
+			}
 		}
 
-		for (auto& branchGroup : cl.changedFileGroups->branchedFileGroups)
+		// Commit procedure start
+		Timer commitTimer;
+
+		auto totalChanges = changes.size();
+		int i(0);
+		// Total time the committer spent waiting for the head-of-line CL to download.
+		float committerWaitS(0);
+		bool downloadsPaused(false);
+		int64_t downloadedFiles(0);
+		int64_t downloadedBytes(0);
+		while (!changes.empty())
 		{
-			std::string mergeFrom;
-			if (branchGroup.hasSource && !noMerge)
+			// Ensure the files are downloaded before committing them to the repository
+			// First, wait until downloaded so the changelist is no longer referenced
+			// in worker threads.
+			Timer waitTimer;
+			Watchdog::CommitterWaiting(changes.front().number);
+			changes.front().WaitForDownload(downloadContext);
+			Watchdog::CommitterDone();
+			const float waitS = waitTimer.GetTimeS();
+			committerWaitS += waitS;
+			committerWait.Add(waitS);
+
+			// Now move the changelist and pop it off the queue.
+			// Once this iteration is over, it will be destructed
+			// and memory is freed.
+			ChangeList cl = std::move(changes.front());
+			changes.pop_front();
+
+			std::string fullName(cl.user);
+			std::string email("deleted@user");
+			if (const UsersResult::UserData* user = users.Lookup(cl.user))
 			{
-				// Only perform merging if the branch group explicitly declares that the change
-				// has a source, and if the user wants merging.
-				mergeFrom = branchGroup.sourceBranch;
+				fullName = user->fullName;
+				email = user->email;
 			}
 
-			const std::string& commitSHA = git.WriteChangelistBranch(
-			    depotPath,
-			    cl,
-			    branchGroup.files,
-			    branchGroup.targetBranch,
-			    fullName,
-			    email,
-			    mergeFrom);
+			const TimePoint commitStart = Timer::Now();
+			std::vector<std::string> commitSHAs;
+			// In download only mode, there is nothing to commit the files to.
+			for (auto& branchGroup : downloadOnly ? emptyGroups : cl.changedFileGroups->branchedFileGroups)
+			{
+				std::string mergeFrom;
+				if (branchGroup.hasSource && !noMerge)
+				{
+					// Only perform merging if the branch group explicitly declares that the change
+					// has a source, and if the user wants merging.
+					mergeFrom = branchGroup.sourceBranch;
+				}
+
+				const std::string& commitSHA = git.WriteChangelistBranch(
+				    depotPath,
+				    cl,
+				    branchGroup.files,
+				    branchGroup.targetBranch,
+				    fullName,
+				    email,
+				    mergeFrom);
+				commitSHAs.push_back(commitSHA);
 
 #ifdef PRINT_TEST_OUTPUT
-			// For scripting/testing purposes...
-			PRINT("COMMIT:" << commitSHA << ":" << cl.number << ":" << branchGroup.targetBranch << ":")
+				// For scripting/testing purposes...
+				PRINT("COMMIT:" << commitSHA << ":" << cl.number << ":" << branchGroup.targetBranch << ":")
 #endif
-			if (branchSet.Count() > 0)
+				if (branchSet.Count() > 0)
+				{
+					SUCCESS(
+					    "CL " << cl.number << " --> Commit " << commitSHA
+					          << " with " << branchGroup.files.size() << " files"
+					          << (branchGroup.targetBranch.empty()
+					                     ? ""
+					                     : (" to branch " + branchGroup.targetBranch))
+					          << (branchGroup.sourceBranch.empty()
+					                     ? ""
+					                     : (" from branch " + branchGroup.sourceBranch))
+					          << ".")
+				}
+			}
+			if (ledger)
 			{
-				SUCCESS(
-				    "CL " << cl.number << " --> Commit " << commitSHA
-				          << " with " << branchGroup.files.size() << " files"
-				          << (branchGroup.targetBranch.empty()
-				                     ? ""
-				                     : (" to branch " + branchGroup.targetBranch))
-				          << (branchGroup.sourceBranch.empty()
-				                     ? ""
-				                     : (" from branch " + branchGroup.sourceBranch))
-				          << ".")
+				ledger->Write(cl, Timer::Now() - commitStart, commitSHAs);
+			}
+			downloadedFiles += cl.changedFileGroups->totalFileCount;
+			downloadedBytes += cl.stats.bytes.load();
+			inFlightBytes.fetch_sub(cl.stats.bytes.load(), std::memory_order_relaxed);
+			MemoryAccounting::Add(MemoryAccounting::Stage::Changes, -cl.MemoryUsage());
+			SUCCESS(
+			    "CL " << cl.number << " with "
+			          << cl.changedFileGroups->totalFileCount << " files (" << i + 1 << "/" << totalChanges
+			          << "|" << downloaded
+			          << "). Elapsed " << commitTimer.GetTimeS() / 60.0f << " mins. "
+			          << ((commitTimer.GetTimeS() / 60.0f) / (float)(i + 1)) * (totalChanges - i - 1) << " mins left."
+			          << " Waited " << waitS << "s for download."
+			          << " Memory " << MemoryAccounting::FormatBytes(MemoryAccounting::GetTotal()) << ".")
+
+			i++;
+			changelistsCommitted.Add();
+
+			// Once a cl has been committed, we top up the background downloads to
+			// lookAhead CLs. While a stage is over its memory limit, only the next
+			// CL to commit is queued, so memory drains as CLs are committed.
+			while (changes.size() > (nextToEnqueue - i) && (size_t)(nextToEnqueue - i) < startupDownloadsCount)
+			{
+				if (nextToEnqueue > i)
+				{
+					const std::string overLimit = MemoryAccounting::OverLimit();
+					if (!overLimit.empty())
+					{
+						if (!downloadsPaused)
+						{
+							WARN("Pausing downloads ahead of CL " << changes.front().number << ", memory is over the limit: " << overLimit)
+							downloadsPaused = true;
+							downloadPauses.Add();
+						}
+						break;
+					}
+					if (downloadsPaused)
+					{
+						PRINT("Resuming downloads, memory is within the limits: " << MemoryAccounting::Summary())
+						downloadsPaused = false;
+					}
+				}
+
+				ChangeList& downloadCL = changes.at(nextToEnqueue - i);
+				const int64_t priority = nextToEnqueue++;
+				downloadCL.stats.queuedAt = Timer::Now();
+				pool.AddJob([&downloadContext, &downloadCL, priority](P4API& p4, GitAPI& git)
+				    { downloadCL.StartDownload(p4, git, downloadContext, priority); },
+				    priority);
 			}
 		}
-		SUCCESS(
-		    "CL " << cl.number << " with "
-		          << cl.changedFileGroups->totalFileCount << " files (" << i + 1 << "/" << totalChanges
-		          << "|" << downloaded
-		          << "). Elapsed " << commitTimer.GetTimeS() / 60.0f << " mins. "
-		          << ((commitTimer.GetTimeS() / 60.0f) / (float)(i + 1)) * (totalChanges - i - 1) << " mins left.")
-
-		i++;
-
-		// Once a cl has been downloaded, we check if we can enqueue a new job
-		// for background downloading.
-		if (changes.size() > (nextToEnqueue - i))
+
+		if (P4API::CommandLimiter)
 		{
-			ChangeList& downloadCL = changes.at(nextToEnqueue - i);
-			nextToEnqueue++;
-			pool.AddJob([&downloaded, &downloadCL, &branchSet, printBatch](P4API& p4, GitAPI& git)
-			    {
-				downloadCL.StartDownload(p4, git, branchSet, printBatch);
-				// Mark download as done.
-				downloaded++; });
+			SUCCESS("Adaptive concurrency settled at " << P4API::CommandLimiter->GetLimit() << " commands in flight after backing off " << P4API::CommandLimiter->GetDecreaseCount() << " times")
 		}
-	}
 
-	SUCCESS("Completed conversion of " << totalChanges << " CLs in " << programTimer.GetTimeS() / 60.0f << " minutes, taking " << commitTimer.GetTimeS() / 60.0f << " to commit CLs")
+		if (P4API::RateLimits)
+		{
+			P4API::RateLimits->PrintSummary();
+		}
 
-	if (!arguments.GetNoConvertLabels())
-	{
-		P4API p4labelsClient;
-		return fetchAndUpdateLabels(p4labelsClient, git, depotPath, arguments.GetLabelCache());
-	}
+		CommandLatencies::PrintSummary();
 
-	return 0;
+		const float downloadS = std::max(commitTimer.GetTimeS(), 0.001f);
+		SUCCESS("Downloaded " << downloadedFiles << " files with " << MemoryAccounting::FormatBytes(downloadedBytes) << " of contents: "
+		                      << (int64_t)((float)downloadedFiles / downloadS) << " files/s, " << MemoryAccounting::FormatBytes((int64_t)((float)downloadedBytes / downloadS)) << "/s")
+
+		SUCCESS("Peak estimated memory by stage: " << MemoryAccounting::PeakSummary())
+
+		SUCCESS("Completed conversion of " << totalChanges << " CLs in " << syncTimer.GetTimeS() / 60.0f << " minutes, taking " << commitTimer.GetTimeS() / 60.0f << " to commit CLs, of which " << committerWaitS / 60.0f << " minutes were spent waiting for downloads")
+
+		if (!arguments.GetNoConvertLabels() && !downloadOnly)
+		{
+			int exitCode;
+			if (daemonInterval > 0)
+			{
+				exitCode = fetchAndUpdateLabels(p4, git, depotPath, arguments.GetLabelCache(), arguments.GetLabelThreads(), arguments.GetLabelDetailsFromList());
+			}
+			else
+			{
+				P4API p4labelsClient;
+				exitCode = fetchAndUpdateLabels(p4labelsClient, git, depotPath, arguments.GetLabelCache(), arguments.GetLabelThreads(), arguments.GetLabelDetailsFromList());
+			}
+			if (exitCode != 0 || daemonInterval == 0)
+			{
+				return exitCode;
+			}
+		}
+		else if (daemonInterval == 0)
+		{
+			return 0;
+		}
+
+		changes = waitForChanges(p4, git, depotPath, arguments.GetMaxChanges(), daemonInterval);
+		syncTimer = Timer();
+		firstSync = false;
+		SUCCESS("Found " << changes.size() << " new CLs starting from CL " << changes.front().number << " to CL " << changes.back().number)
+
+		authors.clear();
+		for (const auto& cl : changes)
+		{
+			authors.push_back(cl.user);
+		}
+	}
 }
 
 int main(int argc, char** argv)
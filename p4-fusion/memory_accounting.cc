@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "memory_accounting.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "metrics.h"
+
+std::atomic<int64_t> MemoryAccounting::s_Bytes[MemoryAccounting::StageCount] {};
+std::atomic<int64_t> MemoryAccounting::s_Peaks[MemoryAccounting::StageCount] {};
+std::atomic<int64_t> MemoryAccounting::s_Limits[MemoryAccounting::StageCount] {};
+
+const char* MemoryAccounting::StageName(const Stage stage)
+{
+	switch (stage)
+	{
+	case Stage::Changes:
+		return "changes";
+	case Stage::FileGroups:
+		return "fileGroups";
+	case Stage::BlobStreams:
+		return "blobStreams";
+	case Stage::GitIndexes:
+		return "gitIndexes";
+	case Stage::Labels:
+		return "labels";
+	default:
+		return "unknown";
+	}
+}
+
+void MemoryAccounting::Add(const Stage stage, const int64_t bytes)
+{
+	const int64_t held = s_Bytes[(int)stage].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	std::atomic<int64_t>& peak = s_Peaks[(int)stage];
+	int64_t previousPeak = peak.load(std::memory_order_relaxed);
+	while (held > previousPeak && !peak.compare_exchange_weak(previousPeak, held, std::memory_order_relaxed))
+	{
+	}
+}
+
+int64_t MemoryAccounting::Get(const Stage stage)
+{
+	return s_Bytes[(int)stage].load(std::memory_order_relaxed);
+}
+
+int64_t MemoryAccounting::GetPeak(const Stage stage)
+{
+	return s_Peaks[(int)stage].load(std::memory_order_relaxed);
+}
+
+int64_t MemoryAccounting::GetTotal()
+{
+	int64_t total = 0;
+	for (int i = 0; i < StageCount; i++)
+	{
+		total += Get((Stage)i);
+	}
+	return total;
+}
+
+void MemoryAccounting::SetLimit(const Stage stage, const int64_t bytes)
+{
+	s_Limits[(int)stage].store(bytes, std::memory_order_relaxed);
+}
+
+void MemoryAccounting::ParseLimit(const std::string& spec)
+{
+	size_t pos = spec.find('=');
+	if (pos == std::string::npos || pos == 0 || pos == spec.size() - 1)
+	{
+		throw std::invalid_argument("invalid memory limit \"" + spec + "\", expected the format stage=MiB");
+	}
+
+	const std::string name = spec.substr(0, pos);
+	const int64_t mebibytes = std::atoll(spec.c_str() + pos + 1);
+	if (mebibytes <= 0)
+	{
+		throw std::invalid_argument("invalid memory limit \"" + spec + "\", the limit must be a positive number of MiB");
+	}
+
+	for (int i = 0; i < StageCount; i++)
+	{
+		if (name == StageName((Stage)i))
+		{
+			SetLimit((Stage)i, mebibytes * 1024 * 1024);
+			return;
+		}
+	}
+	throw std::invalid_argument("invalid memory limit \"" + spec + "\", the stage must be one of changes, fileGroups, blobStreams, gitIndexes or labels");
+}
+
+std::string MemoryAccounting::OverLimit()
+{
+	std::string over;
+	for (int i = 0; i < StageCount; i++)
+	{
+		const int64_t limit = s_Limits[i].load(std::memory_order_relaxed);
+		const int64_t bytes = Get((Stage)i);
+		if (limit > 0 && bytes > limit)
+		{
+			over += (over.empty() ? "" : ", ") + std::string(StageName((Stage)i)) + " " + FormatBytes(bytes) + "/" + FormatBytes(limit);
+		}
+	}
+	return over;
+}
+
+std::string MemoryAccounting::Summary()
+{
+	std::string summary;
+	for (int i = 0; i < StageCount; i++)
+	{
+		summary += (i == 0 ? "" : ", ") + std::string(StageName((Stage)i)) + " " + FormatBytes(Get((Stage)i));
+	}
+	return summary;
+}
+
+std::string MemoryAccounting::PeakSummary()
+{
+	std::string summary;
+	for (int i = 0; i < StageCount; i++)
+	{
+		summary += (i == 0 ? "" : ", ") + std::string(StageName((Stage)i)) + " " + FormatBytes(GetPeak((Stage)i));
+	}
+	return summary;
+}
+
+void MemoryAccounting::UpdateMetrics()
+{
+	for (int i = 0; i < StageCount; i++)
+	{
+		const std::string labels = "stage=\"" + std::string(StageName((Stage)i)) + "\"";
+		Metrics::Gauge("p4_fusion_memory_bytes", "Estimated bytes held by each stage of the conversion.", labels).Set((double)Get((Stage)i));
+		Metrics::Gauge("p4_fusion_memory_limit_bytes", "Soft memory limit of each stage, 0 if it has none.", labels).Set((double)s_Limits[i].load(std::memory_order_relaxed));
+	}
+}
+
+std::string MemoryAccounting::FormatBytes(const int64_t bytes)
+{
+	static const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	double value = (double)bytes;
+	int unit = 0;
+	while ((value >= 1024 || value <= -1024) && unit < 4)
+	{
+		value /= 1024;
+		unit++;
+	}
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << units[unit];
+	return out.str();
+}
+
+int64_t MemoryAccounting::StringBytes(const std::string& str)
+{
+	// Strings that fit the small string buffer keep their data inside the
+	// object itself.
+	const char* data = str.data();
+	const char* object = reinterpret_cast<const char*>(&str);
+	if (data >= object && data < object + sizeof(std::string))
+	{
+		return 0;
+	}
+	return (int64_t)str.capacity() + 1;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * MemoryAccounting tracks how many bytes each stage of the conversion holds,
+ * so that a run that runs out of memory can tell where the memory went.
+ *
+ * The numbers are estimates computed from the sizes of the data structures
+ * and strings each stage keeps, not measurements of the allocator. They are
+ * updated when a stage takes or releases data, and are cheap enough to read
+ * for every progress line.
+ *
+ * Every stage can have a soft limit. Main stops queueing changelists for
+ * download ahead of the committer while any stage is over its limit, which
+ * lets the stages that grow with the lookahead drain as changelists are
+ * committed.
+ */
+class MemoryAccounting
+{
+public:
+	enum class Stage
+	{
+		// Metadata of the changelists that are not committed yet.
+		Changes,
+		// Files of downloaded changelists, grouped by branch.
+		FileGroups,
+		// Buffers of blobs that are being written to the object database.
+		BlobStreams,
+		// In-memory git indexes of the branches being committed to.
+		GitIndexes,
+		// Label details and the map of revisions to labels.
+		Labels,
+	};
+	static constexpr int StageCount = 5;
+
+	// StageName returns the name of the stage used in arguments, metrics and logs.
+	static const char* StageName(Stage stage);
+
+	// Add changes the bytes held by a stage, negative values release bytes.
+	static void Add(Stage stage, int64_t bytes);
+	static int64_t Get(Stage stage);
+	// GetPeak returns the most bytes the stage held at any time.
+	static int64_t GetPeak(Stage stage);
+	static int64_t GetTotal();
+
+	// SetLimit sets the soft limit of a stage, 0 removes it.
+	static void SetLimit(Stage stage, int64_t bytes);
+	// ParseLimit sets a limit in the format "stage=MiB", e.g. "fileGroups=2048".
+	static void ParseLimit(const std::string& spec);
+	// OverLimit returns the names of the stages over their limit, or an empty
+	// string if all stages are within their limits.
+	static std::string OverLimit();
+
+	// Summary formats the bytes held by every stage for the log.
+	static std::string Summary();
+	// PeakSummary formats the peak bytes of every stage for the log.
+	static std::string PeakSummary();
+	// UpdateMetrics publishes the bytes held and limits as gauges.
+	static void UpdateMetrics();
+
+	// FormatBytes formats a byte count for humans, e.g. 12.3MiB.
+	static std::string FormatBytes(int64_t bytes);
+	// StringBytes returns the heap memory held by a string, which is 0 for
+	// strings short enough to be stored inline.
+	static int64_t StringBytes(const std::string& str);
+
+	/*
+	 * Reservation holds bytes of a stage for its life time. Set replaces the
+	 * number of bytes it holds.
+	 */
+	class Reservation
+	{
+	public:
+		explicit Reservation(Stage stage)
+		    : m_Stage(stage)
+		{
+		}
+		~Reservation() { Set(0); }
+		Reservation(const Reservation&) = delete;
+		Reservation& operator=(const Reservation&) = delete;
+
+		void Set(int64_t bytes)
+		{
+			Add(m_Stage, bytes - m_Bytes);
+			m_Bytes = bytes;
+		}
+
+	private:
+		Stage m_Stage;
+		int64_t m_Bytes = 0;
+	};
+
+private:
+	static std::atomic<int64_t> s_Bytes[StageCount];
+	static std::atomic<int64_t> s_Peaks[StageCount];
+	static std::atomic<int64_t> s_Limits[StageCount];
+};
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "metrics.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "log.h"
+
+std::mutex Metrics::s_Mutex;
+std::map<std::string, Metrics::Family> Metrics::s_Families;
+
+Metric& Metrics::Counter(const std::string& name, const std::string& help, const std::string& labels)
+{
+	return get("counter", name, help, labels);
+}
+
+Metric& Metrics::Gauge(const std::string& name, const std::string& help, const std::string& labels)
+{
+	return get("gauge", name, help, labels);
+}
+
+Metric& Metrics::get(const std::string& type, const std::string& name, const std::string& help, const std::string& labels)
+{
+	std::lock_guard<std::mutex> lock(s_Mutex);
+
+	auto familyIt = s_Families.find(name);
+	if (familyIt == s_Families.end())
+	{
+		familyIt = s_Families.emplace(name, Family { .type = type, .help = help, .series = {} }).first;
+	}
+	else if (familyIt->second.type != type)
+	{
+		throw std::invalid_argument("metric " + name + " was already registered as a " + familyIt->second.type);
+	}
+
+	std::unique_ptr<Metric>& metric = familyIt->second.series[labels];
+	if (!metric)
+	{
+		metric = std::make_unique<Metric>();
+	}
+	return *metric;
+}
+
+std::string Metrics::Render()
+{
+	std::ostringstream out;
+	// Enough digits to print byte counters without an exponent, while
+	// keeping fractional seconds short.
+	out.precision(15);
+
+	std::lock_guard<std::mutex> lock(s_Mutex);
+	for (const auto& [name, family] : s_Families)
+	{
+		out << "# HELP " << name << " " << family.help << "\n";
+		out << "# TYPE " << name << " " << family.type << "\n";
+		for (const auto& [labels, metric] : family.series)
+		{
+			out << name;
+			if (!labels.empty())
+			{
+				out << "{" << labels << "}";
+			}
+			out << " " << metric->Get() << "\n";
+		}
+	}
+	return out.str();
+}
+
+void Metrics::WriteTextfile(const std::string& path)
+{
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::out | std::ios::trunc);
+		if (!file)
+		{
+			throw std::runtime_error("failed to open metrics file " + tmpPath);
+		}
+		file << Render();
+		if (!file)
+		{
+			throw std::runtime_error("failed to write metrics file " + tmpPath);
+		}
+	}
+	if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		throw std::runtime_error("failed to rename metrics file to " + path);
+	}
+}
+
+MetricsExporter::MetricsExporter(const std::string& path, const int interval, std::function<void()> update)
+    : m_Path(path)
+    , m_Update(std::move(update))
+    , m_ShouldStop(false)
+{
+	write();
+	SUCCESS("Writing metrics to " << m_Path << " every " << interval << " seconds")
+
+	m_Writer = std::async(std::launch::async, [interval, this]()
+	    {
+		while (true)
+		{
+			// Check every 100ms if the thread should be stopped.
+			int loops = interval * 10;
+			for (int i = 0; i < loops; i++)
+			{
+				if (m_ShouldStop)
+				{
+					return;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+			write();
+		} });
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	m_ShouldStop = true;
+	m_Writer.get();
+	// Write the final state, so that the file reflects the finished run.
+	write();
+}
+
+void MetricsExporter::write()
+{
+	try
+	{
+		if (m_Update)
+		{
+			m_Update();
+		}
+		Metrics::WriteTextfile(m_Path);
+	}
+	catch (const std::exception& e)
+	{
+		// Metrics are best effort, never fail the conversion because of them.
+		WARN("Failed to write metrics: " << e.what())
+	}
+}
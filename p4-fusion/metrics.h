@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+ * Metric is a single time series, either a counter or a gauge. Updates are
+ * lock-free, so metrics can be updated from hot paths.
+ */
+class Metric
+{
+public:
+	void Add(double delta = 1) { m_Value.fetch_add(delta, std::memory_order_relaxed); }
+	void Set(double value) { m_Value.store(value, std::memory_order_relaxed); }
+	[[nodiscard]] double Get() const { return m_Value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<double> m_Value { 0 };
+};
+
+/*
+ * Metrics is the process wide registry of metrics, rendered in the Prometheus
+ * text exposition format.
+ *
+ * Looking up a metric takes a lock, so callers on hot paths should look it up
+ * once and keep the reference, which stays valid for the life time of the
+ * process. Labels are passed preformatted, e.g. `command="print"`.
+ */
+class Metrics
+{
+public:
+	static Metric& Counter(const std::string& name, const std::string& help, const std::string& labels = "");
+	static Metric& Gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+
+	// Render returns all metrics in the Prometheus text format.
+	static std::string Render();
+	// WriteTextfile atomically replaces the file at path with the rendered metrics,
+	// so that the node_exporter textfile collector never reads a partial file.
+	static void WriteTextfile(const std::string& path);
+
+private:
+	struct Family
+	{
+		std::string type;
+		std::string help;
+		std::map<std::string, std::unique_ptr<Metric>> series;
+	};
+
+	static std::mutex s_Mutex;
+	static std::map<std::string, Family> s_Families;
+
+	static Metric& get(const std::string& type, const std::string& name, const std::string& help, const std::string& labels);
+};
+
+/*
+ * MetricsExporter rewrites the metrics textfile every interval seconds until
+ * it is destroyed, and once more on destruction. update is called before each
+ * write to refresh gauges that are sampled rather than updated in place.
+ */
+class MetricsExporter
+{
+private:
+	std::string m_Path;
+	std::function<void()> m_Update;
+	std::atomic_bool m_ShouldStop;
+	std::future<void> m_Writer;
+
+	void write();
+
+public:
+	MetricsExporter(const std::string& path, int interval, std::function<void()> update);
+	MetricsExporter() = delete;
+	~MetricsExporter();
+};
@@ -9,7 +9,8 @@
 #include "utils/std_helpers.h"
 #include "p4/p4libs.h"
 #include "p4/signaler.h"
-#include "minitrace.h"
+#include "trace.h"
+#include "metrics.h"
 #include "commands/labels_result.h"
 #include "commands/label_result.h"
 
@@ -19,6 +20,9 @@ std::string P4API::P4USER;
 std::string P4API::P4CLIENT;
 int P4API::CommandRetries = 1;
 int P4API::CommandRefreshThreshold = 1;
+std::shared_ptr<ConcurrencyLimiter> P4API::CommandLimiter;
+std::shared_ptr<RateLimiter> P4API::RateLimits;
+std::shared_ptr<CommandArchive> P4API::Archive;
 std::mutex P4API::InitializationMutex;
 
 P4LibrariesRAII::P4LibrariesRAII()
@@ -58,6 +62,13 @@ P4LibrariesRAII::~P4LibrariesRAII()
 
 P4API::P4API()
 {
+	// Replays don't talk to a server, so there's no client to set up.
+	if (isReplaying())
+	{
+		AddClientSpecView(ClientSpec.mapping);
+		return;
+	}
+
 	{
 		// Acquire InitializationMutex lock to ensure thread-safe initialization:
 		std::lock_guard<std::mutex> lock(P4API::InitializationMutex);
@@ -75,12 +86,16 @@ P4API::P4API()
 
 bool P4API::Initialize()
 {
-	MTR_SCOPE("P4", __func__);
+	TRACE_SCOPE("P4", __func__);
 
 	// Acquire InitializationMutex lock to ensure thread-safe initialization:
 	std::lock_guard<std::mutex> lock(P4API::InitializationMutex);
 
 	m_Usage = 0;
+	if (!m_ClientAPI)
+	{
+		return true;
+	}
 
 	m_ClientAPI->SetPort(P4PORT.c_str());
 	m_ClientAPI->SetUser(P4USER.c_str());
@@ -101,6 +116,11 @@ bool P4API::Initialize()
 
 bool P4API::Deinitialize()
 {
+	if (!m_ClientAPI)
+	{
+		return true;
+	}
+
 	Error e;
 	m_ClientAPI->Final(&e);
 	return CheckErrors(e);
@@ -108,7 +128,7 @@ bool P4API::Deinitialize()
 
 bool P4API::Reinitialize()
 {
-	MTR_SCOPE("P4", __func__);
+	TRACE_SCOPE("P4", __func__);
 
 	bool status = Deinitialize() && Initialize();
 	return status;
@@ -144,6 +164,79 @@ bool P4API::CheckErrors(Error& e)
 	return true;
 }
 
+P4API::CommandCounters& P4API::countersFor(const char* command)
+{
+	auto it = m_CommandCounters.find(command);
+	if (it == m_CommandCounters.end())
+	{
+		const std::string labels = std::string("command=\"") + command + "\"";
+		CommandCounters counters {
+			.total = &Metrics::Counter("p4_commands_total", "Perforce commands sent, including retries.", labels),
+			.errors = &Metrics::Counter("p4_command_errors_total", "Perforce commands that failed or lost their connection.", labels),
+		};
+		it = m_CommandCounters.insert({ command, counters }).first;
+	}
+	return it->second;
+}
+
+void P4API::RunCommand(const char* command, std::vector<char*>& argsCharArray, Result& result)
+{
+	// Wait for the rate limits first, so we don't hold a concurrency slot
+	// while being throttled.
+	if (RateLimits)
+	{
+		RateLimits->ThrottleCommand(command);
+	}
+	if (CommandLimiter)
+	{
+		CommandLimiter->Acquire();
+	}
+	const TimePoint start = Timer::Now();
+
+	CommandCounters& counters = countersFor(command);
+	counters.total->Add();
+
+	try
+	{
+		if (isReplaying())
+		{
+			Archive->Replay(command, argsCharArray, result);
+		}
+		else if (Archive)
+		{
+			Archive->Record(command, argsCharArray, result, [this, command, &argsCharArray](ClientUser* user)
+			    {
+				    m_ClientAPI->SetArgv(argsCharArray.size(), argsCharArray.data());
+				    m_ClientAPI->Run(command, user); });
+		}
+		else
+		{
+			m_ClientAPI->SetArgv(argsCharArray.size(), argsCharArray.data());
+			m_ClientAPI->Run(command, &result);
+		}
+	}
+	catch (...)
+	{
+		// Output callbacks can throw, don't leak the slot in that case.
+		if (CommandLimiter)
+		{
+			CommandLimiter->Release(command, Timer::Now() - start, true);
+		}
+		counters.errors->Add();
+		throw;
+	}
+
+	const bool failed = isDropped() || result.GetError().IsError();
+	if (CommandLimiter)
+	{
+		CommandLimiter->Release(command, Timer::Now() - start, failed);
+	}
+	if (failed)
+	{
+		counters.errors->Add();
+	}
+}
+
 void P4API::AddClientSpecView(const std::vector<std::string>& viewStrings)
 {
 	m_ClientMapping.InsertTranslationMapping(viewStrings);
@@ -196,9 +289,15 @@ ChangesResult P4API::Changes(const std::string& path, const std::string& from, i
 	    { return {}; });
 }
 
+ChangesResult P4API::LatestChange(const std::string& path)
+{
+	return Run<ChangesResult>("changes", { "-s", "submitted", "-m", "1", path }, []() -> ChangesResult
+	    { return {}; });
+}
+
 DescribeResult P4API::Describe(const int cl)
 {
-	MTR_SCOPE("P4", __func__);
+	TRACE_SCOPE("P4", __func__);
 
 	return Run<DescribeResult>("describe", { "-s", // Omit the diffs
 	                                           std::to_string(cl) },
@@ -218,9 +317,9 @@ FileLogResult P4API::FileLog(const int changelist)
 	    { return {}; });
 }
 
-PrintResult P4API::PrintFiles(const std::vector<std::string>& fileRevisions, const std::function<void()>& onStat, const std::function<void(const char*, int)>& onOutput)
+PrintResult P4API::PrintFiles(const std::vector<std::string>& fileRevisions, const std::function<void(int64_t)>& onStat, const std::function<void(const char*, int)>& onOutput)
 {
-	MTR_SCOPE("P4", __func__);
+	TRACE_SCOPE("P4", __func__);
 
 	if (fileRevisions.empty())
 	{
@@ -231,18 +330,20 @@ PrintResult P4API::PrintFiles(const std::vector<std::string>& fileRevisions, con
 	    { return { onStat, onOutput }; });
 }
 
-UsersResult P4API::Users()
+UsersResult P4API::Users(const std::vector<std::string>& users)
 {
-	return Run<UsersResult>("users", {
-	                                     "-a" // Include service accounts
-	                                 },
-	    []() -> UsersResult
+	std::vector<std::string> args = {
+		"-a" // Include service accounts
+	};
+	args.insert(args.end(), users.begin(), users.end());
+
+	return Run<UsersResult>("users", args, []() -> UsersResult
 	    { return {}; });
 }
 
 LabelsResult P4API::Labels()
 {
-	MTR_SCOPE("P4", __func__);
+	TRACE_SCOPE("P4", __func__);
 
 	// -a - return all labels
 	// -t - add last updated at timestamp to labels
@@ -252,7 +353,7 @@ LabelsResult P4API::Labels()
 
 LabelResult P4API::Label(const std::string& labelName)
 {
-	MTR_SCOPE("P4", __func__);
+	TRACE_SCOPE("P4", __func__);
 
 	return Run<LabelResult>("label", { "-o", labelName },
 	    []() -> LabelResult
@@ -8,10 +8,16 @@
 
 #include <chrono>
 #include <cstdint>
+#include <map>
 #include <sstream>
 #include <thread>
 
 #include "common.h"
+#include "concurrency_limiter.h"
+#include "rate_limiter.h"
+#include "command_stats.h"
+#include "watchdog.h"
+#include "command_archive.h"
 
 #include "commands/file_map.h"
 #include "commands/changes_result.h"
@@ -25,6 +31,8 @@
 #include "commands/label_result.h"
 #include "commands/test_result.h"
 
+class Metric;
+
 /*
  * class P4LibrariesRAII can be used in the main function of the program
  * to initialize and destruct the P4 API in a RAII fashion.
@@ -36,6 +44,68 @@ public:
 	~P4LibrariesRAII();
 };
 
+/*
+ * TimedResult wraps a command result to note when the first output of the
+ * command arrived, whatever form it takes. Every output also counts as
+ * progress for the watchdog.
+ */
+template <class T>
+class TimedResult : public T
+{
+	void stamp()
+	{
+		if (firstOutput == TimePoint())
+		{
+			firstOutput = Timer::Now();
+		}
+		Watchdog::Progress();
+	}
+
+public:
+	TimePoint firstOutput;
+
+	explicit TimedResult(T&& result)
+	    : T(std::move(result))
+	{
+	}
+
+	void OutputStat(StrDict* varList) override
+	{
+		stamp();
+		T::OutputStat(varList);
+	}
+	int OutputStatPartial(StrDict* varList) override
+	{
+		stamp();
+		return T::OutputStatPartial(varList);
+	}
+	void OutputText(const char* data, int length) override
+	{
+		stamp();
+		T::OutputText(data, length);
+	}
+	void OutputBinary(const char* data, int length) override
+	{
+		stamp();
+		T::OutputBinary(data, length);
+	}
+	void OutputInfo(char level, const char* data) override
+	{
+		stamp();
+		T::OutputInfo(level, data);
+	}
+	void Message(Error* err) override
+	{
+		stamp();
+		T::Message(err);
+	}
+	void HandleError(Error* err) override
+	{
+		stamp();
+		T::HandleError(err);
+	}
+};
+
 class P4API
 {
 private:
@@ -46,12 +116,28 @@ private:
 	std::unique_ptr<ClientApi> m_ClientAPI;
 	FileMap m_ClientMapping;
 	int m_Usage = 0;
+	int m_LastRetries = 0;
+
+	// The metric counters of one command, resolved on its first run so that
+	// later runs don't go through the metrics registry.
+	struct CommandCounters
+	{
+		Metric* total;
+		Metric* errors;
+	};
+	std::map<std::string, CommandCounters> m_CommandCounters;
+	CommandCounters& countersFor(const char* command);
 
 	bool Initialize();
 	bool Deinitialize();
 	bool Reinitialize();
 	static bool CheckErrors(Error& e);
+	static bool isReplaying() { return Archive && Archive->IsReplaying(); }
+	// isDropped returns true when the connection to the server was lost.
+	bool isDropped() const { return m_ClientAPI && m_ClientAPI->Dropped(); }
 
+	// RunCommand sends a single command to the server, without any retries.
+	void RunCommand(const char* command, std::vector<char*>& argsCharArray, Result& result);
 	template <class T>
 	T Run(const char* command, const std::vector<std::string>& stringArguments, const std::function<T()>& creatorFunc);
 	template <class T>
@@ -65,20 +151,35 @@ public:
 	static ClientResult::ClientSpecData ClientSpec;
 	static int CommandRetries;
 	static int CommandRefreshThreshold;
+	// Shared by all P4API instances to bound the number of commands in flight.
+	// Null when adaptive concurrency is disabled.
+	static std::shared_ptr<ConcurrencyLimiter> CommandLimiter;
+	// Shared by all P4API instances to cap commands and bytes per second.
+	// Null when no rate limits are configured.
+	static std::shared_ptr<RateLimiter> RateLimits;
+	// Records the output of all commands, or replays recorded output instead
+	// of connecting to the server. Null when neither is enabled.
+	static std::shared_ptr<CommandArchive> Archive;
 
 	P4API();
 	~P4API();
 
+	// GetLastRetries returns how often the last command had to be retried.
+	int GetLastRetries() const { return m_LastRetries; }
+
 	static bool IsDepotPathValid(const std::string& depotPath);
 	bool IsDepotPathUnderClientSpec(const std::string& depotPath);
 
 	TestResult TestConnection(int retries);
 	ChangesResult Changes(const std::string& path, const std::string& from, int32_t maxCount);
+	// LatestChange lists only the most recent submitted changelist under path.
+	ChangesResult LatestChange(const std::string& path);
 	DescribeResult Describe(int cl);
 	FileLogResult FileLog(int changelist);
-	PrintResult PrintFiles(const std::vector<std::string>& fileRevisions, const std::function<void()>& onStat, const std::function<void(const char*, int)>& onOutput);
+	PrintResult PrintFiles(const std::vector<std::string>& fileRevisions, const std::function<void(int64_t)>& onStat, const std::function<void(const char*, int)>& onOutput);
 	ClientResult Client();
-	UsersResult Users();
+	// Users lists the given users, or all users if none are given.
+	UsersResult Users(const std::vector<std::string>& users);
 	LabelsResult Labels();
 	LabelResult Label(const std::string& labelName);
 	InfoResult Info();
@@ -101,13 +202,25 @@ inline T P4API::RunEx(const char* command, const std::vector<std::string>& strin
 		argsCharArray.push_back((char*)arg.c_str());
 	}
 
-	T clientUser = creatorFunc();
+	CommandStats& stats = CommandLatencies::For(command);
+	const TimePoint start = Timer::Now();
+
+	TimedResult<T> clientUser(creatorFunc());
+	auto runAttempt = [&]()
+	{
+		const TimePoint attemptStart = Timer::Now();
+		RunCommand(command, argsCharArray, clientUser);
+		if (clientUser.firstOutput != TimePoint())
+		{
+			stats.firstByte.Record(clientUser.firstOutput - attemptStart);
+		}
+	};
 
-	m_ClientAPI->SetArgv(argsCharArray.size(), argsCharArray.data());
-	m_ClientAPI->Run(command, &clientUser);
+	runAttempt();
 
-	int retries = commandRetries;
-	while (m_ClientAPI->Dropped() || clientUser.GetError().IsError())
+	// Replayed commands fail the same way every time, don't retry them.
+	int retries = isReplaying() ? 0 : commandRetries;
+	while (isDropped() || clientUser.GetError().IsError())
 	{
 		if (retries == 0)
 		{
@@ -116,7 +229,9 @@ inline T P4API::RunEx(const char* command, const std::vector<std::string>& strin
 
 		ERR("Connection dropped or command errored, retrying in 5 seconds.")
 		std::this_thread::sleep_for(std::chrono::seconds(5));
+		stats.retries++;
 
+		const TimePoint reconnectStart = Timer::Now();
 		if (Reinitialize())
 		{
 			SUCCESS("Reinitialized P4API")
@@ -125,18 +240,20 @@ inline T P4API::RunEx(const char* command, const std::vector<std::string>& strin
 		{
 			ERR("Could not reinitialize P4API")
 		}
+		stats.connect.Record(Timer::Now() - reconnectStart);
 
 		WARN("Retrying: p4 " << command << argsString)
 
-		clientUser = std::move(creatorFunc());
+		clientUser = TimedResult<T>(creatorFunc());
 
-		m_ClientAPI->SetArgv(argsCharArray.size(), argsCharArray.data());
-		m_ClientAPI->Run(command, &clientUser);
+		runAttempt();
 
 		retries--;
 	}
+	stats.total.Record(Timer::Now() - start);
+	m_LastRetries = isReplaying() ? 0 : commandRetries - retries;
 
-	if (m_ClientAPI->Dropped() || clientUser.GetError().IsFatal())
+	if (isDropped() || clientUser.GetError().IsFatal())
 	{
 		Deinitialize();
 		std::ostringstream oss;
@@ -145,13 +262,16 @@ inline T P4API::RunEx(const char* command, const std::vector<std::string>& strin
 	}
 
 	m_Usage++;
-	if (m_Usage > CommandRefreshThreshold)
+	if (!isReplaying() && m_Usage > CommandRefreshThreshold)
 	{
 		int refreshRetries = CommandRetries;
 		while (refreshRetries > 0)
 		{
 			WARN("Trying to refresh the connection due to age (" << m_Usage << " > " << CommandRefreshThreshold << ").")
-			if (Reinitialize())
+			const TimePoint reconnectStart = Timer::Now();
+			const bool reinitialized = Reinitialize();
+			stats.connect.Record(Timer::Now() - reconnectStart);
+			if (reinitialized)
 			{
 				SUCCESS("Connection was refreshed")
 				break;
@@ -170,7 +290,8 @@ inline T P4API::RunEx(const char* command, const std::vector<std::string>& strin
 		}
 	}
 
-	return clientUser;
+	// Hand back the plain result, without the timing wrapper.
+	return static_cast<T&&>(clientUser);
 }
 
 template <class T>
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "packed_refs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+namespace
+{
+void throwErrno(const std::string& what, const std::string& path)
+{
+	throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+}
+
+PackedRefs::PackedRefs(std::string repoPath)
+    : m_RepoPath(std::move(repoPath))
+{
+	if (m_RepoPath.back() != '/')
+	{
+		m_RepoPath += '/';
+	}
+}
+
+std::string PackedRefs::path(const std::string& name) const
+{
+	return m_RepoPath + name;
+}
+
+void PackedRefs::Set(const std::string& refName, const git_oid& target)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	git_oid_tostr(hex, sizeof(hex), &target);
+	m_Updates[refName] = hex;
+}
+
+void PackedRefs::Remove(const std::string& refName)
+{
+	m_Updates[refName] = "";
+}
+
+bool PackedRefs::conflicts(const std::map<std::string, Entry>& refs, const std::string& refName) const
+{
+	// A ref can't be the directory of another ref.
+	const auto it = refs.lower_bound(refName + "/");
+	if (it != refs.end() && it->first.starts_with(refName + "/"))
+	{
+		return true;
+	}
+	std::error_code ec;
+	if (std::filesystem::is_directory(path(refName), ec) && !std::filesystem::is_empty(path(refName), ec))
+	{
+		return true;
+	}
+	// And no directory of it can be a ref.
+	for (size_t pos = refName.find('/'); pos != std::string::npos; pos = refName.find('/', pos + 1))
+	{
+		const std::string parent = refName.substr(0, pos);
+		if (refs.contains(parent) || std::filesystem::is_regular_file(path(parent), ec))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void PackedRefs::removeLoose(const std::string& refName) const
+{
+	if (std::remove(path(refName).c_str()) != 0 && errno != ENOENT)
+	{
+		throwErrno("failed to remove loose ref", path(refName));
+	}
+	// Remove the directories left empty, they would conflict with refs of
+	// the same name later on.
+	std::error_code ec;
+	for (size_t pos = refName.rfind('/'); pos != std::string::npos && pos > 0; pos = refName.rfind('/', pos - 1))
+	{
+		const std::string parent = refName.substr(0, pos);
+		// Stop at the namespace, e.g. refs/tags.
+		if (std::count(parent.begin(), parent.end(), '/') < 2 || !std::filesystem::remove(path(parent), ec))
+		{
+			break;
+		}
+	}
+}
+
+std::vector<std::string> PackedRefs::Commit()
+{
+	TRACE_SCOPE("Git", __func__);
+
+	std::vector<std::string> rejected;
+	if (m_Updates.empty())
+	{
+		return rejected;
+	}
+
+	// Take the lock git and libgit2 use for packed-refs.
+	const std::string packedPath = path("packed-refs");
+	const std::string lockPath = packedPath + ".lock";
+	int lockFD = ::open(lockPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (lockFD < 0)
+	{
+		throwErrno("failed to lock", packedPath);
+	}
+
+	try
+	{
+		std::string traits = "peeled fully-peeled ";
+		std::map<std::string, Entry> refs;
+		{
+			std::ifstream file(packedPath);
+			std::string line;
+			std::string last;
+			while (std::getline(file, line))
+			{
+				if (line.starts_with("# pack-refs with:"))
+				{
+					// Keep the peeling traits, refs written here never peel.
+					traits = std::string(line.find(" peeled") != std::string::npos ? "peeled " : "")
+					    + (line.find(" fully-peeled") != std::string::npos ? "fully-peeled " : "");
+				}
+				else if (line.starts_with("^") && !last.empty())
+				{
+					refs[last].peeled = line;
+				}
+				else if (line.size() > GIT_OID_HEXSZ + 1 && line[GIT_OID_HEXSZ] == ' ')
+				{
+					last = line.substr(GIT_OID_HEXSZ + 1);
+					refs[last] = Entry { .target = line.substr(0, GIT_OID_HEXSZ), .peeled = "" };
+				}
+			}
+		}
+
+		for (const auto& [refName, target] : m_Updates)
+		{
+			if (target.empty())
+			{
+				refs.erase(refName);
+			}
+			else if (conflicts(refs, refName))
+			{
+				WARN("Not writing " << refName << ", it conflicts with another ref")
+				rejected.push_back(refName);
+			}
+			else
+			{
+				refs[refName] = Entry { .target = target, .peeled = "" };
+			}
+		}
+
+		// git expects the refs sorted by name, which std::map keeps them.
+		std::string contents = "# pack-refs with: " + traits + "sorted \n";
+		for (const auto& [refName, entry] : refs)
+		{
+			contents += entry.target + ' ' + refName + '\n';
+			if (!entry.peeled.empty())
+			{
+				contents += entry.peeled + '\n';
+			}
+		}
+
+		const char* data = contents.data();
+		size_t length = contents.size();
+		while (length > 0)
+		{
+			const ssize_t written = write(lockFD, data, length);
+			if (written < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (written < 0)
+			{
+				throwErrno("failed to write", lockPath);
+			}
+			data += written;
+			length -= written;
+		}
+		if (fsync(lockFD) != 0)
+		{
+			throwErrno("failed to sync", lockPath);
+		}
+		::close(lockFD);
+		lockFD = -1;
+		if (std::rename(lockPath.c_str(), packedPath.c_str()) != 0)
+		{
+			throwErrno("failed to replace", packedPath);
+		}
+	}
+	catch (...)
+	{
+		if (lockFD >= 0)
+		{
+			::close(lockFD);
+		}
+		std::remove(lockPath.c_str());
+		throw;
+	}
+
+	// Loose refs take precedence over packed ones, so only now that the
+	// packed values are in place, drop the loose files.
+	for (const auto& [refName, target] : m_Updates)
+	{
+		if (std::find(rejected.begin(), rejected.end(), refName) == rejected.end())
+		{
+			removeLoose(refName);
+		}
+	}
+	m_Updates.clear();
+	return rejected;
+}
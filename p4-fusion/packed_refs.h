@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "git2/oid.h"
+
+/*
+ * PackedRefs collects updates to many refs and writes all of them to the
+ * packed-refs file of a repository at once, instead of writing a loose ref
+ * file with a lock, rename and fsync per ref.
+ *
+ * Commit takes the packed-refs lock the same way git does, rewrites the file
+ * with the updates applied, renames it into place and then removes the loose
+ * files of the updated refs, which would otherwise shadow the packed values.
+ * If the process dies before the loose files are removed, they keep their
+ * old values, which the next run corrects.
+ *
+ * Only use it for refs that point directly at commits, like the tags created
+ * from labels, and while nothing else writes refs in the process.
+ */
+class PackedRefs
+{
+public:
+	explicit PackedRefs(std::string repoPath);
+	PackedRefs() = delete;
+
+	void Set(const std::string& refName, const git_oid& target);
+	void Remove(const std::string& refName);
+	[[nodiscard]] size_t Updates() const { return m_Updates.size(); }
+
+	// Commit writes all updates and returns the refs that were not created
+	// because they conflict with another ref, like refs/tags/a and
+	// refs/tags/a/b.
+	std::vector<std::string> Commit();
+
+private:
+	struct Entry
+	{
+		std::string target;
+		// The peeled line of an annotated tag, kept as it is.
+		std::string peeled;
+	};
+
+	std::string m_RepoPath;
+	// Updates by ref name, an empty target removes the ref.
+	std::map<std::string, std::string> m_Updates;
+
+	[[nodiscard]] std::string path(const std::string& name) const;
+	[[nodiscard]] bool conflicts(const std::map<std::string, Entry>& refs, const std::string& refName) const;
+	void removeLoose(const std::string& refName) const;
+};
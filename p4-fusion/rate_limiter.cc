@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+
+#include "log.h"
+
+TokenBucket::TokenBucket(const double ratePerSecond)
+    : m_Rate(ratePerSecond)
+    , m_Burst(std::max(1.0, ratePerSecond))
+    , m_Tokens(std::max(1.0, ratePerSecond))
+    , m_LastRefill(Timer::Now())
+    , m_ThrottledNs(0)
+{
+	if (ratePerSecond <= 0)
+	{
+		throw std::invalid_argument("token bucket rate must be positive");
+	}
+}
+
+void TokenBucket::Take(const double tokens)
+{
+	std::chrono::duration<double> wait(0);
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+
+		const TimePoint now = Timer::Now();
+		const double elapsed = std::chrono::duration<double>(now - m_LastRefill).count();
+		m_LastRefill = now;
+		m_Tokens = std::min(m_Burst, m_Tokens + elapsed * m_Rate);
+
+		m_Tokens -= tokens;
+		if (m_Tokens < 0)
+		{
+			wait = std::chrono::duration<double>(-m_Tokens / m_Rate);
+		}
+	}
+
+	if (wait.count() > 0)
+	{
+		auto waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(wait);
+		std::this_thread::sleep_for(waitNs);
+		m_ThrottledNs += waitNs.count();
+	}
+}
+
+void RateLimiter::SetCommandRate(const double perSecond)
+{
+	m_AllCommands = std::make_unique<TokenBucket>(perSecond);
+}
+
+void RateLimiter::SetCommandRate(const std::string& command, const double perSecond)
+{
+	m_Commands[command] = std::make_unique<TokenBucket>(perSecond);
+}
+
+void RateLimiter::SetByteRate(const double perSecond)
+{
+	m_Bytes = std::make_unique<TokenBucket>(perSecond);
+}
+
+void RateLimiter::ParseCommandRate(const std::string& spec)
+{
+	size_t pos = spec.find('=');
+	if (pos == std::string::npos || pos == 0 || pos == spec.size() - 1)
+	{
+		throw std::invalid_argument("invalid command rate \"" + spec + "\", expected the format command=rate");
+	}
+
+	const std::string command = spec.substr(0, pos);
+	const int rate = std::atoi(spec.c_str() + pos + 1);
+	if (rate <= 0)
+	{
+		throw std::invalid_argument("invalid command rate \"" + spec + "\", rate must be a positive number");
+	}
+
+	SetCommandRate(command, rate);
+}
+
+void RateLimiter::ThrottleCommand(const std::string& command)
+{
+	auto it = m_Commands.find(command);
+	if (it != m_Commands.end())
+	{
+		it->second->Take(1);
+	}
+	if (m_AllCommands)
+	{
+		m_AllCommands->Take(1);
+	}
+}
+
+void RateLimiter::ThrottleBytes(const int bytes)
+{
+	if (m_Bytes)
+	{
+		m_Bytes->Take(bytes);
+	}
+}
+
+void RateLimiter::PrintSummary() const
+{
+	auto seconds = [](const std::unique_ptr<TokenBucket>& bucket)
+	{
+		return std::chrono::duration<double>(bucket->GetThrottledTime()).count();
+	};
+
+	if (m_AllCommands)
+	{
+		PRINT("Throttled " << seconds(m_AllCommands) << " thread-seconds by the limit of " << (int64_t)m_AllCommands->GetRate() << " commands/s")
+	}
+	for (const auto& [command, bucket] : m_Commands)
+	{
+		PRINT("Throttled " << seconds(bucket) << " thread-seconds by the limit of " << (int64_t)bucket->GetRate() << " " << command << " commands/s")
+	}
+	if (m_Bytes)
+	{
+		PRINT("Throttled " << seconds(m_Bytes) << " thread-seconds by the limit of " << (int64_t)m_Bytes->GetRate() << " bytes/s")
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "utils/timer.h"
+
+/*
+ * TokenBucket allows on average ratePerSecond tokens to be taken per second,
+ * with bursts of up to one second worth of tokens.
+ *
+ * Callers that find the bucket empty reserve their tokens anyway, driving the
+ * balance negative, and then sleep until the bucket would have refilled. Later
+ * callers therefore queue up behind earlier ones instead of racing for tokens,
+ * and requests larger than the burst size (like big print chunks) still pass.
+ */
+class TokenBucket
+{
+public:
+	explicit TokenBucket(double ratePerSecond);
+	TokenBucket() = delete;
+
+	// Take blocks until the given number of tokens is available.
+	void Take(double tokens);
+
+	[[nodiscard]] double GetRate() const { return m_Rate; }
+	// Total time callers spent blocked in Take, summed over all threads.
+	[[nodiscard]] std::chrono::nanoseconds GetThrottledTime() const { return std::chrono::nanoseconds(m_ThrottledNs.load()); }
+
+private:
+	std::mutex m_Mutex;
+	const double m_Rate;
+	const double m_Burst;
+	double m_Tokens;
+	TimePoint m_LastRefill;
+	std::atomic<int64_t> m_ThrottledNs;
+};
+
+/*
+ * RateLimiter enforces the request and bandwidth caps for all Perforce
+ * connections of this process. It must be fully configured before it is shared
+ * with the network threads.
+ */
+class RateLimiter
+{
+public:
+	// SetCommandRate limits the number of commands of all types per second.
+	void SetCommandRate(double perSecond);
+	// SetCommandRate limits the number of commands of the given type per second.
+	// This applies in addition to the limit for all commands.
+	void SetCommandRate(const std::string& command, double perSecond);
+	// SetByteRate limits the number of bytes received from print commands per second.
+	void SetByteRate(double perSecond);
+	// ParseCommandRate configures a per-command limit in the format "command=rate".
+	void ParseCommandRate(const std::string& spec);
+
+	[[nodiscard]] bool IsEmpty() const { return !m_AllCommands && !m_Bytes && m_Commands.empty(); }
+
+	// ThrottleCommand blocks until the given command may be sent to the server.
+	void ThrottleCommand(const std::string& command);
+	// ThrottleBytes blocks until the given number of received bytes may be processed.
+	void ThrottleBytes(int bytes);
+
+	// PrintSummary logs the configured limits and how long threads were throttled by each.
+	void PrintSummary() const;
+
+private:
+	std::unique_ptr<TokenBucket> m_AllCommands;
+	std::unique_ptr<TokenBucket> m_Bytes;
+	std::unordered_map<std::string, std::unique_ptr<TokenBucket>> m_Commands;
+};
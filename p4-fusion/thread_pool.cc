@@ -7,12 +7,17 @@
 #include "thread_pool.h"
 #include "common.h"
 #include "p4_api.h"
-#include "minitrace.h"
+#include "trace.h"
 #include "thread.h"
 #include "git_api.h"
 #include "signal.h"
+#include "metrics.h"
+#include "watchdog.h"
 
-void ThreadPool::AddJob(Job&& function)
+// Index of the worker running on this thread, or -1 outside of the pool.
+thread_local int t_WorkerIndex = -1;
+
+void ThreadPool::AddJob(Job&& function, const int64_t priority)
 {
 	// Fast path: if we're shutting down, don't even bother adding the job to
 	// the queue.
@@ -21,15 +26,10 @@ void ThreadPool::AddJob(Job&& function)
 		return;
 	}
 
-	std::lock_guard<std::mutex> lock(m_JobsMutex);
-	if (m_HasShutDownBeenCalled) // Check again, in case we shut down while waiting for the lock.
-	{
-		return;
-	}
-
-	m_Jobs.push_back(std::move(function));
-	// Inform the next available job handler that there's new work.
-	m_CV.notify_one();
+	// Jobs added by a worker are kept close to it, the queue wakes up the next
+	// available job handler if any is idle. Jobs added after the queue closed
+	// are dropped.
+	m_Jobs.Push(std::move(function), priority, t_WorkerIndex);
 }
 
 void ThreadPool::RaiseCaughtExceptions()
@@ -56,11 +56,8 @@ void ThreadPool::ShutDown()
 	auto stop = [this]()
 	{
 		// Signal that we want to shut down.
-		{
-			std::lock_guard<std::mutex> lock(m_JobsMutex);
-			m_HasShutDownBeenCalled = true;
-			m_CV.notify_all(); // Tell all the worker threads to stop waiting for new jobs.
-		}
+		m_HasShutDownBeenCalled = true;
+		m_Jobs.Close(); // Tell all the worker threads to stop waiting for new jobs.
 
 		// Wait for all worker threads to finish, then release them.
 		{
@@ -75,10 +72,7 @@ void ThreadPool::ShutDown()
 		}
 
 		// Clear the job queue.
-		{
-			std::lock_guard<std::mutex> lock(m_JobsMutex);
-			m_Jobs.clear();
-		}
+		m_Jobs.Clear();
 
 		SUCCESS("Thread pool shut down successfully")
 
@@ -97,53 +91,73 @@ void ThreadPool::ShutDown()
 	std::call_once(m_ShutdownFlag, stop);
 }
 
-ThreadPool::ThreadPool(const int size, const std::string& repoPath, const int tz)
-    : m_HasShutDownBeenCalled(false)
+ThreadPool::ThreadPool(const int size, const std::string& repoPath)
+    : m_Jobs(size / WorkersPerQueueShard)
+    , m_BusyWorkers(0)
+    , m_ConnectedWorkers(0)
+    , m_HasShutDownBeenCalled(false)
 {
 
 	startSignalHandlingThread();
 	startExceptionHandlingThread();
+	Watchdog::Init(size);
 
 	// Initialize the thread handlers
 	std::lock_guard<std::mutex> threadsLock(m_ThreadMutex);
 
+	const TimePoint start = Timer::Now();
 	for (int i = 0; i < size; i++)
 	{
-		// Initialize P4API here so we synchronously create them.
-		std::shared_ptr<P4API> p4 = std::make_shared<P4API>();
-		m_Threads.emplace_back([this, i, repoPath, p4, tz]()
+		m_Threads.emplace_back([this, i, size, repoPath, start]()
 		    {
 				// Add some human-readable info to the tracing.
-				MTR_META_THREAD_NAME(("Worker #" + std::to_string(i)).c_str());
+				Trace::SetThreadName("Worker #" + std::to_string(i));
+				t_WorkerIndex = i;
+				Watchdog::Attach(i);
+
+				// Every worker connects on its own thread, so the pool warms
+				// up while the caller goes on with its work. Jobs queued in
+				// the meantime wait for the first workers to connect.
+				std::unique_ptr<P4API> p4;
+				try
+				{
+					p4 = std::make_unique<P4API>();
+				}
+				catch (const std::exception& e)
+				{
+					ForwardException(e);
+					return;
+				}
+				if (++m_ConnectedWorkers == size)
+				{
+					SUCCESS("Connected all " << size << " network threads in " << std::chrono::duration<float>(Timer::Now() - start).count() << "s")
+				}
 
 			    // We initialize a separate GitAPI per thread, otherwise
 			    // internal locks will prevent the threads from working independently.
 			    // We only write blob objects to the ODB, which according to libgit2/libgit2#2491
-			    // is thread safe.
-			    GitAPI git(repoPath, tz);
+			    // is thread safe. Workers don't write commits, so the timezone
+			    // doesn't matter.
+			    GitAPI git(repoPath, 0);
 
-			    git.OpenRepository();
+			    // Without an object database to write to, the repository
+			    // isn't needed, and may not even exist.
+			    if (BlobWriter::ContentSink == BlobWriter::Sink::ObjectDatabase)
+			    {
+				    git.OpenRepository();
+			    }
 
 				// Job queue, we keep looking for new jobs until the shutdown
 				// event.
 				while (true)
 				{
 					Job job;
+					if (!m_Jobs.Pop(job, i)) // We're shutting down - exit.
 					{
-						std::unique_lock<std::mutex> lock(m_JobsMutex);
-
-						m_CV.wait(lock, [this]()
-							{ return !m_Jobs.empty() || m_HasShutDownBeenCalled; });
-
-						if (m_HasShutDownBeenCalled) // We're shutting down - exit.
-						{
-							break;
-						}
-
-						job = std::move(m_Jobs.front());
-						m_Jobs.pop_front();
+						break;
 					}
 
+					m_BusyWorkers++;
 					try
 					{
 						job(*p4, git);
@@ -152,6 +166,7 @@ ThreadPool::ThreadPool(const int size, const std::string& repoPath, const int tz
 					{
 						ForwardException(e);
 					}
+					m_BusyWorkers--;
 				} });
 	}
 }
@@ -8,7 +8,6 @@
 
 #include <thread>
 #include <deque>
-#include <functional>
 #include <atomic>
 #include <condition_variable>
 
@@ -16,10 +15,14 @@
 #include "p4_api.h"
 #include "git_api.h"
 #include "thread.h"
+#include "job_queue.h"
+#include "utils/unique_function.h"
 
 class P4API;
 
-typedef std::function<void(P4API&, GitAPI&)> Job;
+// Jobs are move-only and keep small captures inline, so queueing a job
+// doesn't allocate.
+typedef UniqueFunction<void(P4API&, GitAPI&)> Job;
 
 class ThreadPool
 {
@@ -30,10 +33,13 @@ private:
 	std::condition_variable m_ThreadExceptionCV;
 	std::deque<std::exception_ptr> m_ThreadExceptions;
 
-	std::deque<Job> m_Jobs;
-	std::mutex m_JobsMutex;
-
-	std::condition_variable m_CV;
+	// Workers always pick the job with the lowest priority value they can
+	// find. Callers use the sequence number of the changelist a job belongs to
+	// as its priority, so the work for the CL the committer is waiting on is
+	// never stuck behind lookahead work.
+	JobQueue<Job> m_Jobs;
+	std::atomic<int> m_BusyWorkers;
+	std::atomic<int> m_ConnectedWorkers;
 
 	std::once_flag m_ShutdownFlag;
 	std::atomic<bool> m_HasShutDownBeenCalled;
@@ -50,11 +56,15 @@ private:
 	void shutdownSignalHandlingThread();
 
 public:
-	ThreadPool(int size, const std::string& repoPath, int tz);
+	// Number of workers sharing one shard of the job queue.
+	static constexpr int WorkersPerQueueShard = 4;
+
+	ThreadPool(int size, const std::string& repoPath);
 	ThreadPool() = delete;
 	~ThreadPool();
 
-	void AddJob(Job&& function);
+	// AddJob queues a job. Jobs with a lower priority value run first.
+	void AddJob(Job&& function, int64_t priority);
 	void RaiseCaughtExceptions();
 	void ShutDown();
 	size_t GetThreadCount() const
@@ -62,6 +72,10 @@ public:
 		std::lock_guard<std::mutex> lock(m_ThreadMutex);
 		return m_Threads.size();
 	}
+	// Number of jobs waiting for a worker.
+	int64_t GetQueueDepth() const { return m_Jobs.Size(); }
+	// Number of workers currently running a job.
+	int GetBusyWorkers() const { return m_BusyWorkers.load(); }
 
 private:
 	void ForwardException(const std::exception& e);
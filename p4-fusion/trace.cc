@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "trace_format.h"
+
+std::atomic_bool Trace::s_Enabled(false);
+
+namespace
+{
+using TraceFormat::Event;
+
+// 128KiB per chunk.
+constexpr uint32_t ChunkEvents = 4096;
+
+struct Chunk
+{
+	// Number of events written by the owning thread so far.
+	std::atomic<uint32_t> size { 0 };
+	Event events[ChunkEvents];
+};
+
+/*
+ * ThreadBuffer holds the events of one thread. Only the owning thread appends
+ * to the current chunk, publishing every event through the chunk size, so
+ * the flusher can copy the written part at any time. The mutex is only taken
+ * by the owner when it replaces a full chunk, which happens once every
+ * ChunkEvents events.
+ */
+struct ThreadBuffer
+{
+	uint32_t id = 0;
+	// Only used by the owning thread.
+	uint32_t sampleCounter = 0;
+
+	std::mutex mutex;
+	// current is only replaced with the mutex held.
+	std::unique_ptr<Chunk> current = std::make_unique<Chunk>();
+	// The rest is guarded by the mutex.
+	// Number of events of the current chunk that were already flushed.
+	uint32_t flushed = 0;
+	// Full chunks with the number of their events that were already flushed.
+	std::vector<std::pair<std::unique_ptr<Chunk>, uint32_t>> full;
+	std::string name;
+	bool nameChanged = false;
+	// Set when the thread exits, its buffer is dropped after the next flush.
+	bool finished = false;
+};
+
+struct State
+{
+	std::mutex threadsMutex;
+	std::vector<std::shared_ptr<ThreadBuffer>> threads;
+	uint32_t nextThread = 0;
+
+	std::mutex stringsMutex;
+	std::unordered_map<const char*, uint16_t> stringIds;
+	std::vector<std::string> strings;
+
+	// Guards the file and everything written with it.
+	std::mutex fileMutex;
+	FILE* file = nullptr;
+	size_t stringsWritten = 0;
+
+	std::atomic<int64_t> startNs { 0 };
+	std::atomic<int> sampleEvery { 1 };
+	std::atomic<int64_t> minDurationNs { 0 };
+};
+
+// Never destroyed, threads may still end scopes while the process exits.
+State& state()
+{
+	static State* s = new State();
+	return *s;
+}
+
+struct ThreadHandle
+{
+	std::shared_ptr<ThreadBuffer> buffer;
+	// Caches the string ids of the global table for this thread.
+	std::unordered_map<const char*, uint16_t> stringIds;
+
+	~ThreadHandle()
+	{
+		if (buffer)
+		{
+			std::lock_guard<std::mutex> lock(buffer->mutex);
+			buffer->finished = true;
+		}
+	}
+};
+
+thread_local ThreadHandle t_Thread;
+
+ThreadBuffer& threadBuffer()
+{
+	if (!t_Thread.buffer)
+	{
+		auto buffer = std::make_shared<ThreadBuffer>();
+		State& s = state();
+		std::lock_guard<std::mutex> lock(s.threadsMutex);
+		buffer->id = s.nextThread++;
+		s.threads.push_back(buffer);
+		t_Thread.buffer = std::move(buffer);
+	}
+	return *t_Thread.buffer;
+}
+
+uint16_t stringId(const char* str)
+{
+	auto cached = t_Thread.stringIds.find(str);
+	if (cached != t_Thread.stringIds.end())
+	{
+		return cached->second;
+	}
+
+	State& s = state();
+	std::lock_guard<std::mutex> lock(s.stringsMutex);
+	auto it = s.stringIds.find(str);
+	if (it == s.stringIds.end())
+	{
+		it = s.stringIds.emplace(str, (uint16_t)s.strings.size()).first;
+		s.strings.emplace_back(str);
+	}
+	t_Thread.stringIds.emplace(str, it->second);
+	return it->second;
+}
+
+int64_t nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - state().startNs.load(std::memory_order_relaxed);
+}
+
+void append(ThreadBuffer& buffer, const Event& event)
+{
+	Chunk* chunk = buffer.current.get();
+	uint32_t size = chunk->size.load(std::memory_order_relaxed);
+	if (size == ChunkEvents)
+	{
+		std::lock_guard<std::mutex> lock(buffer.mutex);
+		buffer.full.emplace_back(std::move(buffer.current), buffer.flushed);
+		buffer.current = std::make_unique<Chunk>();
+		buffer.flushed = 0;
+		chunk = buffer.current.get();
+		size = 0;
+	}
+	chunk->events[size] = event;
+	chunk->size.store(size + 1, std::memory_order_release);
+}
+
+void write(FILE* file, const void* data, const size_t size)
+{
+	if (size > 0 && std::fwrite(data, size, 1, file) != 1)
+	{
+		throw std::runtime_error("failed to write trace file");
+	}
+}
+
+template <class Id>
+void writeText(FILE* file, const TraceFormat::RecordType type, const Id id, const std::string& text)
+{
+	const uint16_t length = (uint16_t)std::min<size_t>(text.size(), UINT16_MAX);
+	write(file, &type, sizeof(type));
+	write(file, &id, sizeof(id));
+	write(file, &length, sizeof(length));
+	write(file, text.data(), length);
+}
+}
+
+void Trace::Start(const std::string& path, const int sampleEvery, const int minDurationUs)
+{
+	State& s = state();
+	std::lock_guard<std::mutex> fileLock(s.fileMutex);
+	if (s.file)
+	{
+		throw std::logic_error("trace is already started");
+	}
+
+	FILE* file = std::fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		throw std::runtime_error("failed to create trace file " + path);
+	}
+	TraceFormat::Header header {};
+	std::memcpy(header.magic, TraceFormat::Magic, sizeof(header.magic));
+	header.version = TraceFormat::Version;
+	if (std::fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		std::fclose(file);
+		throw std::runtime_error("failed to write trace file " + path);
+	}
+
+	s.file = file;
+	s.stringsWritten = 0;
+	{
+		// Threads named before the start appear in the new file too.
+		std::lock_guard<std::mutex> threadsLock(s.threadsMutex);
+		for (const auto& thread : s.threads)
+		{
+			std::lock_guard<std::mutex> lock(thread->mutex);
+			thread->nameChanged = !thread->name.empty();
+		}
+	}
+	s.startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	s.sampleEvery = std::max(1, sampleEvery);
+	s.minDurationNs = (int64_t)std::max(0, minDurationUs) * 1000;
+	s_Enabled = true;
+}
+
+void Trace::Flush()
+{
+	State& s = state();
+	std::lock_guard<std::mutex> fileLock(s.fileMutex);
+	if (!s.file)
+	{
+		return;
+	}
+
+	std::vector<Event> events;
+	std::vector<std::pair<uint32_t, std::string>> names;
+	{
+		std::lock_guard<std::mutex> threadsLock(s.threadsMutex);
+		std::vector<std::shared_ptr<ThreadBuffer>> running;
+		for (auto& thread : s.threads)
+		{
+			std::lock_guard<std::mutex> lock(thread->mutex);
+			for (const auto& [chunk, flushed] : thread->full)
+			{
+				events.insert(events.end(), chunk->events + flushed, chunk->events + ChunkEvents);
+			}
+			thread->full.clear();
+
+			const uint32_t size = thread->current->size.load(std::memory_order_acquire);
+			events.insert(events.end(), thread->current->events + thread->flushed, thread->current->events + size);
+			thread->flushed = size;
+
+			if (thread->nameChanged)
+			{
+				names.emplace_back(thread->id, thread->name);
+				thread->nameChanged = false;
+			}
+
+			// A thread that had exited before this copy appends nothing after
+			// it, so its buffer can go. Checked in the same critical section,
+			// a thread exiting right after the copy is dropped next time.
+			if (!thread->finished)
+			{
+				running.push_back(thread);
+			}
+		}
+		s.threads = std::move(running);
+	}
+
+	// The strings are collected after the events, so every string an event
+	// refers to is written before it.
+	{
+		std::lock_guard<std::mutex> stringsLock(s.stringsMutex);
+		for (; s.stringsWritten < s.strings.size(); s.stringsWritten++)
+		{
+			writeText(s.file, TraceFormat::RecordType::String, (uint16_t)s.stringsWritten, s.strings[s.stringsWritten]);
+		}
+	}
+	for (const auto& [id, name] : names)
+	{
+		writeText(s.file, TraceFormat::RecordType::Thread, id, name);
+	}
+	if (!events.empty())
+	{
+		const TraceFormat::RecordType type = TraceFormat::RecordType::Events;
+		const uint32_t count = (uint32_t)events.size();
+		write(s.file, &type, sizeof(type));
+		write(s.file, &count, sizeof(count));
+		write(s.file, events.data(), events.size() * sizeof(Event));
+	}
+	if (std::fflush(s.file) != 0)
+	{
+		throw std::runtime_error("failed to flush trace file");
+	}
+}
+
+void Trace::Stop()
+{
+	s_Enabled = false;
+	State& s = state();
+	try
+	{
+		Flush();
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> fileLock(s.fileMutex);
+		std::fclose(s.file);
+		s.file = nullptr;
+		throw;
+	}
+	std::lock_guard<std::mutex> fileLock(s.fileMutex);
+	if (s.file)
+	{
+		std::fclose(s.file);
+		s.file = nullptr;
+	}
+}
+
+void Trace::SetThreadName(const std::string& name)
+{
+	if (!IsEnabled())
+	{
+		return;
+	}
+	ThreadBuffer& buffer = threadBuffer();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	buffer.name = name;
+	buffer.nameChanged = true;
+}
+
+void Trace::Counter(const char* name, const double value)
+{
+	if (!IsEnabled())
+	{
+		return;
+	}
+	ThreadBuffer& buffer = threadBuffer();
+	Event event {};
+	event.startNs = nowNs();
+	std::memcpy(&event.value, &value, sizeof(value));
+	event.thread = buffer.id;
+	event.name = stringId(name);
+	event.category = stringId("Counter");
+	event.type = TraceFormat::EventType::Counter;
+	append(buffer, event);
+}
+
+void Trace::Scope::begin(const char* category, const char* name)
+{
+	ThreadBuffer& buffer = threadBuffer();
+	const int sampleEvery = state().sampleEvery.load(std::memory_order_relaxed);
+	if (sampleEvery > 1 && buffer.sampleCounter++ % sampleEvery != 0)
+	{
+		return;
+	}
+	m_Category = category;
+	m_Name = name;
+	m_StartNs = nowNs();
+}
+
+void Trace::Scope::end()
+{
+	const int64_t duration = nowNs() - m_StartNs;
+	if (!IsEnabled() || duration < state().minDurationNs.load(std::memory_order_relaxed))
+	{
+		return;
+	}
+	ThreadBuffer& buffer = threadBuffer();
+	Event event {};
+	event.startNs = (uint64_t)m_StartNs;
+	event.value = (uint64_t)duration;
+	event.thread = buffer.id;
+	event.name = stringId(m_Name);
+	event.category = stringId(m_Category);
+	event.type = TraceFormat::EventType::Complete;
+	append(buffer, event);
+}
+
+CounterSampler::CounterSampler(const int intervalMs, std::function<void()> sample)
+    : m_ShouldStop(false)
+{
+	m_Sampler = std::async(std::launch::async, [intervalMs, sample = std::move(sample), this]()
+	    {
+		    const auto interval = std::chrono::milliseconds(std::max(1, intervalMs));
+		    auto next = std::chrono::steady_clock::now();
+		    while (!m_ShouldStop)
+		    {
+			    sample();
+			    next += interval;
+			    // Check at least every 100ms if the thread should be stopped.
+			    for (auto now = std::chrono::steady_clock::now(); !m_ShouldStop && now < next; now = std::chrono::steady_clock::now())
+			    {
+				    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(next - now, std::chrono::milliseconds(100)));
+			    }
+		    } });
+}
+
+CounterSampler::~CounterSampler()
+{
+	m_ShouldStop = true;
+	m_Sampler.get();
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <string>
+
+/*
+ * Trace records where the threads of p4-fusion spend their time, for viewing
+ * in a trace viewer after the run.
+ *
+ * Every thread appends fixed size events to its own chunked buffer without
+ * taking a lock. Flush collects the buffers of all threads and appends them
+ * to a binary file (see trace_format.h). Events are never dropped: when
+ * threads produce events faster than they are flushed, their buffers grow
+ * instead. The p4-fusion-trace tool converts the file to the Chrome trace
+ * event format, which chrome://tracing and Perfetto can open.
+ *
+ * To keep long runs manageable, scopes can be sampled: only every
+ * sampleEvery-th scope of a thread is recorded, and scopes that took less
+ * than minDurationUs are dropped. Counter samples are always recorded.
+ */
+class Trace
+{
+public:
+	// Start creates the trace file and starts recording. It throws if the
+	// file can't be created.
+	static void Start(const std::string& path, int sampleEvery, int minDurationUs);
+	// Flush appends all events recorded so far to the trace file.
+	static void Flush();
+	// Stop stops recording, flushes the remaining events and closes the file.
+	static void Stop();
+	static bool IsEnabled() { return s_Enabled.load(std::memory_order_relaxed); }
+
+	// SetThreadName names the calling thread in the trace.
+	static void SetThreadName(const std::string& name);
+	// Counter records a sample of a counter track. name must stay valid for
+	// the whole run, e.g. a string literal.
+	static void Counter(const char* name, double value);
+
+	/*
+	 * Scope records the time between its construction and destruction as an
+	 * event. category and name must stay valid for the whole run, e.g. string
+	 * literals or __func__. Use the TRACE_SCOPE macro instead.
+	 */
+	class Scope
+	{
+	public:
+		Scope(const char* category, const char* name)
+		{
+			if (IsEnabled())
+			{
+				begin(category, name);
+			}
+		}
+		~Scope()
+		{
+			if (m_Name)
+			{
+				end();
+			}
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char* m_Category = nullptr;
+		// Null if the scope isn't recorded.
+		const char* m_Name = nullptr;
+		int64_t m_StartNs = 0;
+
+		void begin(const char* category, const char* name);
+		void end();
+	};
+
+private:
+	static std::atomic_bool s_Enabled;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(category, name) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(category, name)
+
+/*
+ * CounterSampler calls sample every intervalMs milliseconds on a background
+ * thread for as long as it lives. sample is expected to record counters with
+ * Trace::Counter.
+ */
+class CounterSampler
+{
+public:
+	CounterSampler(int intervalMs, std::function<void()> sample);
+	CounterSampler() = delete;
+	~CounterSampler();
+
+private:
+	std::atomic_bool m_ShouldStop;
+	std::future<void> m_Sampler;
+};
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstdint>
+
+/*
+ * TraceFormat describes the binary trace files written by Trace and read by
+ * the p4-fusion-trace converter. All integers are stored in the byte order of
+ * the machine that wrote the file.
+ *
+ * A file starts with a Header, followed by records. Every record starts with
+ * a RecordType byte:
+ *
+ *   String: uint16 id, uint16 length, length bytes of text.
+ *   Thread: uint32 thread, uint16 length, length bytes of the thread name.
+ *   Events: uint32 count, count Event structs.
+ *
+ * Strings and thread names are always written before the first event that
+ * refers to them. A thread name may be written again when it changes.
+ */
+namespace TraceFormat
+{
+constexpr char Magic[8] = { 'P', '4', 'F', 'T', 'R', 'A', 'C', 'E' };
+// Version 2 widened thread ids to 32 bits, as every thread of a long run
+// gets a new id.
+constexpr uint32_t Version = 2;
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+enum class RecordType : uint8_t
+{
+	String = 1,
+	Thread = 2,
+	Events = 3,
+};
+
+enum class EventType : uint8_t
+{
+	// A scope, value is its duration in nanoseconds.
+	Complete = 1,
+	// A sample of a counter track, value holds the bits of a double.
+	Counter = 2,
+};
+
+struct Event
+{
+	// Nanoseconds since the trace was started.
+	uint64_t startNs;
+	uint64_t value;
+	uint32_t thread;
+	// Ids of String records.
+	uint16_t name;
+	uint16_t category;
+	EventType type;
+	uint8_t reserved[7];
+};
+
+static_assert(sizeof(Header) == 16, "trace header layout changed");
+static_assert(sizeof(Event) == 32, "trace event layout changed");
+}
@@ -8,36 +8,66 @@
 
 #include <future>
 #include <filesystem>
-#include "minitrace.h"
+#include "trace.h"
+#include "command_stats.h"
 
 /*
- * Tracer wraps the minitrace library, making sure that we regularly flush and
- * finalize traces on shutdown.
+ * Tracer starts the trace if it is enabled, making sure that we regularly
+ * flush it and finalize it on shutdown. Alongside the trace, it keeps the
+ * Perforce command latency report up to date if a path is given for it.
  */
 class Tracer
 {
 private:
 	std::atomic_bool shouldStop;
 	std::future<void> flusher;
+	std::string latencyPath;
+
+	void flush()
+	{
+		try
+		{
+			Trace::Flush();
+		}
+		catch (const std::exception& e)
+		{
+			WARN("Failed to write trace: " << e.what())
+		}
+		if (latencyPath.empty())
+		{
+			return;
+		}
+		try
+		{
+			CommandLatencies::WriteReport(latencyPath);
+		}
+		catch (const std::exception& e)
+		{
+			WARN("Failed to write latency report: " << e.what())
+		}
+	}
 
 public:
-	Tracer(const std::string& traceFileDir, int flushRate)
+	Tracer(const std::string& traceFileDir, const std::string& latencyReportPath, int flushRate, bool enabled, int sampleEvery, int minDurationUs)
 	    : shouldStop(false)
+	    , latencyPath(latencyReportPath)
 	{
-#if !(MTR_ENABLED)
-		return;
-#endif
+		if (!enabled && latencyPath.empty())
+		{
+			return;
+		}
 
-		// Ensure the path exists.
-		std::filesystem::create_directories(traceFileDir);
-		const std::string tracePath = (traceFileDir + (traceFileDir.back() == '/' ? "" : "/") + "trace.json");
+		if (enabled)
+		{
+			// Ensure the path exists.
+			std::filesystem::create_directories(traceFileDir);
+			const std::string tracePath = traceFileDir + (traceFileDir.back() == '/' ? "" : "/") + "trace.bin";
 
-		mtr_init(tracePath.c_str());
-		MTR_META_PROCESS_NAME("p4-fusion");
-		MTR_META_THREAD_NAME("Main Thread");
-		MTR_META_THREAD_SORT_INDEX(0);
+			Trace::Start(tracePath, sampleEvery, minDurationUs);
+			Trace::SetThreadName("Main Thread");
 
-		SUCCESS("Set up tracer to write profile to " << tracePath)
+			SUCCESS("Set up tracer to write profile to " << tracePath)
+		}
 
 		flusher = std::async(std::launch::async, [flushRate, this]()
 		    {
@@ -55,24 +85,35 @@ public:
 					}
 					std::this_thread::sleep_for(std::chrono::milliseconds(100));
 				}
-				mtr_flush();
+				flush();
 			} });
 	}
 	~Tracer()
 	{
-#if !(MTR_ENABLED)
-		return;
-#endif
+		if (!flusher.valid())
+		{
+			return;
+		}
 
 		// Signal to flusher that it should stop working.
 		shouldStop = true;
 		// Wait for flusher to shut down.
 		flusher.get();
 		// Do a final flush.
-		mtr_flush();
-		// And finally shut down the mtr library.
-		mtr_shutdown();
+		flush();
 
-		SUCCESS("Tracer shut down successfully")
+		if (Trace::IsEnabled())
+		{
+			// And finally close the trace file.
+			try
+			{
+				Trace::Stop();
+				SUCCESS("Tracer shut down successfully")
+			}
+			catch (const std::exception& e)
+			{
+				WARN("Failed to finish trace: " << e.what())
+			}
+		}
 	}
 };
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "user_cache.h"
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+
+#include "p4_api.h"
+#include "trace.h"
+
+constexpr const char* userCacheMagic = "p4-fusion users v1";
+
+namespace
+{
+// Fields are separated by tabs and entries by newlines, neither of which
+// belongs in a user name or email.
+std::string field(std::string value)
+{
+	std::replace_if(value.begin(), value.end(), [](const char c)
+	    { return c == '\t' || c == '\n' || c == '\r'; },
+	    ' ');
+	return value;
+}
+}
+
+UserCache::UserCache(std::string path, const int64_t ttlSeconds)
+    : m_Path(std::move(path))
+    , m_TTL(ttlSeconds)
+{
+	if (m_TTL > 0)
+	{
+		load();
+	}
+}
+
+void UserCache::load()
+{
+	std::ifstream file(m_Path);
+	std::string line;
+	if (!file || !std::getline(file, line))
+	{
+		return;
+	}
+	if (line != userCacheMagic)
+	{
+		WARN("User cache " << m_Path << " has an unknown format, it will be rebuilt")
+		return;
+	}
+
+	// Lines are "<fetched at>\t<user>\t<email>\t<full name>", or only
+	// "<fetched at>\t<user>" for users the server doesn't know.
+	while (std::getline(file, line))
+	{
+		const size_t userStart = line.find('\t');
+		if (userStart == std::string::npos || userStart == 0)
+		{
+			WARN("Ignoring malformed line in " << m_Path << ": " << line)
+			continue;
+		}
+		Entry entry {};
+		try
+		{
+			entry.fetchedAt = std::stoll(line.substr(0, userStart));
+		}
+		catch (const std::exception&)
+		{
+			WARN("Ignoring malformed line in " << m_Path << ": " << line)
+			continue;
+		}
+
+		const size_t emailStart = line.find('\t', userStart + 1);
+		const size_t nameStart = emailStart == std::string::npos ? std::string::npos : line.find('\t', emailStart + 1);
+		if (emailStart == std::string::npos)
+		{
+			entry.exists = false;
+			m_Users[line.substr(userStart + 1)] = std::move(entry);
+			continue;
+		}
+		if (nameStart == std::string::npos)
+		{
+			WARN("Ignoring malformed line in " << m_Path << ": " << line)
+			continue;
+		}
+		entry.exists = true;
+		entry.data.email = line.substr(emailStart + 1, nameStart - emailStart - 1);
+		entry.data.fullName = line.substr(nameStart + 1);
+		m_Users[line.substr(userStart + 1, emailStart - userStart - 1)] = std::move(entry);
+	}
+}
+
+void UserCache::save() const
+{
+	// Replace the file in one step, so that an interrupted run leaves the
+	// previous cache behind.
+	const std::string tmpPath = m_Path + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::trunc);
+		file << userCacheMagic << '\n';
+		for (const auto& [user, entry] : m_Users)
+		{
+			file << entry.fetchedAt << '\t' << field(user);
+			if (entry.exists)
+			{
+				file << '\t' << field(entry.data.email) << '\t' << field(entry.data.fullName);
+			}
+			file << '\n';
+		}
+		if (!file.flush())
+		{
+			throw std::runtime_error("failed to write " + tmpPath);
+		}
+	}
+	if (std::rename(tmpPath.c_str(), m_Path.c_str()) != 0)
+	{
+		throw std::runtime_error("failed to replace " + m_Path);
+	}
+}
+
+void UserCache::Resolve(P4API& p4, const std::vector<std::string>& users)
+{
+	TRACE_SCOPE("P4", __func__);
+
+	const int64_t now = std::time(nullptr);
+	std::vector<std::string> missing;
+	for (const std::string& user : users)
+	{
+		const auto it = m_Users.find(user);
+		if (it == m_Users.end() || now - it->second.fetchedAt >= m_TTL)
+		{
+			missing.push_back(user);
+		}
+	}
+	// Sorted batches keep the commands the same between runs, which replays
+	// of recorded runs rely on.
+	std::sort(missing.begin(), missing.end());
+	missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+	if (missing.empty())
+	{
+		SUCCESS("Found all " << users.size() << " authors in the user cache")
+		return;
+	}
+
+	PRINT("Requesting details of " << missing.size() << " authors from the Perforce server")
+	size_t found = 0;
+	for (size_t begin = 0; begin < missing.size(); begin += BatchSize)
+	{
+		const std::vector<std::string> batch(missing.begin() + (ptrdiff_t)begin, missing.begin() + (ptrdiff_t)std::min(begin + BatchSize, missing.size()));
+		UsersResult usersRes = p4.Users(batch);
+		if (usersRes.HasError())
+		{
+			throw std::runtime_error("Failed to retrieve user details for mapping: " + usersRes.PrintError());
+		}
+
+		const std::unordered_map<UsersResult::UserID, UsersResult::UserData>& fetched = usersRes.GetUserEmails();
+		for (const std::string& user : batch)
+		{
+			const auto it = fetched.find(user);
+			if (it == fetched.end())
+			{
+				m_Users[user] = Entry { .fetchedAt = now, .exists = false, .data = {} };
+				continue;
+			}
+			m_Users[user] = Entry { .fetchedAt = now, .exists = true, .data = it->second };
+			found++;
+		}
+	}
+	SUCCESS("Received details of " << found << " authors, " << missing.size() - found << " authors are unknown to the Perforce server")
+
+	if (m_TTL > 0)
+	{
+		save();
+	}
+}
+
+const UsersResult::UserData* UserCache::Lookup(const std::string& user) const
+{
+	const auto it = m_Users.find(user);
+	if (it == m_Users.end() || !it->second.exists)
+	{
+		return nullptr;
+	}
+	return &it->second.data;
+}
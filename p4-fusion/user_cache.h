@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "commands/users_result.h"
+
+class P4API;
+
+/*
+ * UserCache maps the authors of changelists to their names and emails.
+ *
+ * Instead of listing every user of the server on every run, only the authors
+ * of the changelists being converted are looked up, with one p4 users command
+ * per batch of them. The results are kept in a file between runs, along with
+ * the time they were fetched, so an incremental run usually finds all of its
+ * authors in the file. Entries older than the TTL are fetched again when
+ * their user shows up, which picks up changed emails and names. Users the
+ * server doesn't know, like deleted ones, are remembered as missing too.
+ */
+class UserCache
+{
+public:
+	// Users asked for in one p4 users command.
+	static constexpr size_t BatchSize = 256;
+
+	// A ttlSeconds of 0 disables the file, all authors are fetched every run.
+	UserCache(std::string path, int64_t ttlSeconds);
+	UserCache() = delete;
+
+	// Resolve makes sure the cache holds fresh entries for all of users,
+	// fetching the missing and expired ones. It throws if a fetch fails.
+	void Resolve(P4API& p4, const std::vector<std::string>& users);
+	// Lookup returns nullptr for users the server doesn't know.
+	[[nodiscard]] const UsersResult::UserData* Lookup(const std::string& user) const;
+	[[nodiscard]] size_t Size() const { return m_Users.size(); }
+
+private:
+	struct Entry
+	{
+		int64_t fetchedAt;
+		bool exists;
+		UsersResult::UserData data;
+	};
+
+	std::string m_Path;
+	int64_t m_TTL;
+	std::unordered_map<std::string, Entry> m_Users;
+
+	void load();
+	void save() const;
+};
@@ -21,16 +21,41 @@ Arguments::Arguments(int argc, char** argv)
 	OptionalParameterList("--branch", "A branch to migrate under the depot path.  May be specified more than once.  If at least one is given and the noMerge option is false, then the Git repository will include merges between branches in the history.  You may use the formatting 'depot/path:git-alias', separating the Perforce branch sub-path from the git alias name by a ':'; if the depot path contains a ':', then you must provide the git branch alias.");
 	OptionalParameter("--noMerge", "false", "Disable performing a Git merge when a Perforce branch integrates (or copies, etc) into another branch.");
 	OptionalParameter("--networkThreads", std::to_string(std::thread::hardware_concurrency()), "Specify the number of threads in the threadpool for running network calls. Defaults to the number of logical CPUs.");
+	OptionalParameter("--adaptiveConcurrency", "false", "Adjust the number of Perforce commands in flight between --minNetworkThreads and --networkThreads based on command latency and errors, to back off when the server is overloaded.");
+	OptionalParameter("--minNetworkThreads", "1", "Lower bound for the number of Perforce commands in flight when --adaptiveConcurrency is enabled.");
+	OptionalParameter("--maxCommandRate", "0", "Maximum number of Perforce commands sent per second across all network threads. 0 means unlimited.");
+	OptionalParameterList("--commandRate", "Maximum number of Perforce commands of a single type sent per second, in the format 'command=rate', e.g. 'print=50'. May be specified more than once. Applies in addition to --maxCommandRate.");
+	OptionalParameter("--maxBytesPerSecond", "0", "Maximum number of bytes of file contents received from the Perforce server per second across all network threads. 0 means unlimited.");
 	OptionalParameter("--printBatch", "1", "Specify the p4 print batch size.");
+	OptionalParameterList("--memoryLimit", "Soft limit for the estimated memory held by a stage of the conversion, in the format 'stage=MiB', e.g. 'fileGroups=2048'. Stages are changes, fileGroups, blobStreams, gitIndexes and labels. While any stage is over its limit, no further CLs are queued for download ahead of the next CL to commit. May be specified more than once.");
 	OptionalParameter("--maxChanges", "-1", "Specify the max number of changelists which should be processed in a single run. -1 signifies unlimited range.");
 	OptionalParameter("--retries", "10", "Specify how many times a command should be retried before the process exits in a failure.");
 	OptionalParameter("--refresh", "100", "Specify how many times a connection should be reused before it is refreshed.");
 	OptionalParameter("--fsyncEnable", "false", "Enable fsync() while writing objects to disk to ensure they get written to permanent storage immediately instead of being cached. This is to mitigate data loss in events of hardware failure.");
 	OptionalParameter("--includeBinaries", "false", "Do not discard binary files while downloading changelists.");
+	OptionalParameter("--trace", "false", "Record a trace of what every thread is doing to trace.bin in the --src directory. Convert it for chrome://tracing or Perfetto with the p4-fusion-trace tool.");
+	OptionalParameter("--traceSample", "1", "Only record every n-th traced scope of each thread, to keep traces of long runs small. Counters are always recorded.");
+	OptionalParameter("--traceMinDuration", "0", "Do not record traced scopes that took fewer than this many microseconds.");
 	OptionalParameter("--flushRate", "30", "Interval in seconds at which the profiling data is flushed to the disk.");
+	OptionalParameter("--metricsFile", "", "Path of a file to periodically write metrics to, in the Prometheus text format. Point the node_exporter textfile collector at its directory. If not specified, no metrics are written.");
+	OptionalParameter("--metricsInterval", "15", "Interval in seconds at which the metrics file is rewritten.");
+	OptionalParameter("--latencyReport", "", "Path of a text file to keep the latency report of Perforce commands in, rewritten every --flushRate seconds. Only written together with --trace or --metricsFile.");
+	OptionalParameter("--ledger", "", "Path of a CSV file to append one row per committed CL to, with its file count, bytes downloaded, time spent queued, describing, filelogging, printing and committing, retries and commit SHAs. If not specified, no ledger is written.");
+	OptionalParameter("--record", "", "Path of a directory to record the output of all Perforce commands to, so that the conversion can be replayed later with --replay. If not specified, nothing is recorded.");
+	OptionalParameter("--replay", "", "Path of a directory with a recording made with --record. The output of Perforce commands is replayed from the recording instead of connecting to the server. The run must use the same depot path, branches and max changes as the recording.");
+	OptionalParameter("--replayLatency", "0", "Milliseconds every replayed Perforce command takes, to simulate the round trip to the server.");
+	OptionalParameter("--stallThreshold", "300", "Log what every network thread is doing when the next CL to commit has not finished downloading after this many seconds, and again for every further period of this length. 0 disables the report.");
+	OptionalParameter("--downloadOnly", "false", "Download all changelists like a conversion does, but discard the file contents and write nothing to the --src repository, to measure the throughput of the Perforce server on its own. An existing repository is only read, to resume after its latest CL.");
+	OptionalParameter("--hashContents", "false", "With --downloadOnly, compute the git object IDs of the downloaded files instead of discarding them unread, which adds the cost of hashing to the measurement.");
 	OptionalParameter("--noColor", "false", "Disable colored output.");
+	OptionalParameter("--logLevel", "info", "Only log messages of this level or more important ones: error, warning, success or info.");
+	OptionalParameter("--logFormat", "text", "Format of log messages, text or json. json writes one object per line, with the time, level, function, line and message.");
+	OptionalParameter("--daemonInterval", "0", "Keep running after converting the available changelists, and poll the server for new ones every this many milliseconds, converting them as they are submitted. Connections, authors and branch indexes are kept between syncs. 0 converts once and exits.");
+	OptionalParameter("--userCacheTTL", "86400", "Seconds for which the names and emails of changelist authors are kept in users.cache in the --src directory before they are fetched again. 0 disables the cache.");
 	OptionalParameter("--noConvertLabels", "false", "Whether or not to disable label to tag conversion.");
 	OptionalParameter("--labelCache", "", "Absolute path to a label cache file. If not specified, labels will not be cached.");
+	OptionalParameter("--labelThreads", "16", "Number of connections fetching the details of new or changed labels in parallel.");
+	OptionalParameter("--labelDetailsFromList", "false", "Take the revision and description of labels from the labels list where the server includes them, instead of fetching every label. Label views are not checked for these labels, so only use this if label views don't exclude --path.");
 
 	for (int i = 1; i < argc - 1; i += 2)
 	{
@@ -55,39 +80,86 @@ void Arguments::Print() const
 	auto srcPath = GetSourcePath();
 	auto fsyncEnable = GetFsyncEnable();
 	auto includeBinaries = GetIncludeBinaries();
+	auto downloadOnly = GetDownloadOnly();
+	auto hashContents = GetHashContents();
 	auto maxChanges = GetMaxChanges();
 	auto flushRate = GetFlushRate();
+	auto trace = GetTrace();
+	auto traceSample = GetTraceSample();
+	auto traceMinDuration = GetTraceMinDuration();
+	auto metricsFile = GetMetricsFile();
+	auto latencyReport = GetLatencyReport();
+	auto metricsInterval = GetMetricsInterval();
+	auto stallThreshold = GetStallThreshold();
+	auto ledger = GetLedger();
+	auto record = GetRecord();
+	auto replay = GetReplay();
+	auto replayLatency = GetReplayLatency();
 	auto branchNames = GetBranches();
 	auto noColor = GetNoColor();
+	auto logLevel = GetLogLevel();
+	auto logFormat = GetLogFormat();
 	auto P4PORT = GetPort();
 	auto P4USER = GetUsername();
 	auto P4CLIENT = GetClient();
 	auto CommandRetries = GetRetries();
 	auto CommandRefreshThreshold = GetRefresh();
 	auto networkThreads = GetNetworkThreads();
+	auto adaptiveConcurrency = GetAdaptiveConcurrency();
+	auto minNetworkThreads = GetMinNetworkThreads();
+	auto maxCommandRate = GetMaxCommandRate();
+	auto commandRates = GetCommandRates();
+	auto maxBytesPerSecond = GetMaxBytesPerSecond();
 	auto printBatch = GetPrintBatch();
+	auto memoryLimits = GetMemoryLimits();
 	auto lookAhead = GetLookAhead();
-	bool profiling(false);
-#if MTR_ENABLED
-	profiling = true;
-#endif
-	const std::string tracePath = (srcPath + (srcPath.back() == '/' ? "" : "/") + "trace.json");
+	auto daemonInterval = GetDaemonInterval();
+	auto userCacheTTL = GetUserCacheTTL();
+	auto noConvertLabels = GetNoConvertLabels();
+	auto labelCache = GetLabelCache();
+	auto labelThreads = GetLabelThreads();
+	auto labelDetailsFromList = GetLabelDetailsFromList();
+	const std::string tracePath = (srcPath + (srcPath.back() == '/' ? "" : "/") + "trace.bin");
 
 	PRINT("Perforce Port: " << P4PORT)
 	PRINT("Perforce User: " << P4USER)
 	PRINT("Perforce Client: " << P4CLIENT)
 	PRINT("Depot Path: " << depotPath)
 	PRINT("Network Threads: " << networkThreads)
+	PRINT("Adaptive Concurrency: " << adaptiveConcurrency << " (min " << minNetworkThreads << ")")
+	PRINT("Max Command Rate: " << maxCommandRate)
+	for (const auto& commandRate : commandRates)
+	{
+		PRINT("Command Rate: " << commandRate)
+	}
+	PRINT("Max Bytes Per Second: " << maxBytesPerSecond)
 	PRINT("Print Batch: " << printBatch)
 	PRINT("Look Ahead: " << lookAhead)
+	for (const auto& memoryLimit : memoryLimits)
+	{
+		PRINT("Memory Limit: " << memoryLimit << "MiB")
+	}
 	PRINT("Max Retries: " << CommandRetries)
 	PRINT("Max Changes: " << maxChanges)
 	PRINT("Refresh Threshold: " << CommandRefreshThreshold)
 	PRINT("Fsync Enable: " << fsyncEnable)
 	PRINT("Include Binaries: " << includeBinaries)
-	PRINT("Profiling: " << profiling << " (" << tracePath << ")")
+	PRINT("Download Only: " << downloadOnly << " (hash contents: " << hashContents << ")")
+	PRINT("Profiling: " << trace << " (" << tracePath << ")")
+	PRINT("Profiling Sampling: every " << traceSample << " scopes, at least " << traceMinDuration << "us")
 	PRINT("Profiling Flush Rate: " << flushRate)
+	PRINT("Ledger: " << (ledger.empty() ? "disabled" : ledger))
+	PRINT("Record: " << (record.empty() ? "disabled" : record))
+	PRINT("Replay: " << (replay.empty() ? "disabled" : replay) << " (latency " << replayLatency << "ms)")
+	PRINT("Daemon: " << (daemonInterval > 0 ? "every " + std::to_string(daemonInterval) + "ms" : "disabled"))
+	PRINT("User Cache TTL: " << userCacheTTL << "s")
+	PRINT("Convert Labels: " << !noConvertLabels << " (cache: " << (labelCache.empty() ? "disabled" : labelCache) << ", threads: " << labelThreads << ", details from list: " << labelDetailsFromList << ")")
+	PRINT("Stall Threshold: " << stallThreshold << "s")
+	PRINT("Metrics File: " << (metricsFile.empty() ? "disabled" : metricsFile) << " (every " << metricsInterval << "s)")
+	PRINT("Latency Report: " << (latencyReport.empty() ? "disabled" : latencyReport))
 	PRINT("No Colored Output: " << noColor)
+	PRINT("Log Level: " << logLevel)
+	PRINT("Log Format: " << logFormat)
 }
 
 std::string Arguments::GetParameter(const std::string& argName) const
@@ -112,6 +184,13 @@ int Arguments::GetParameterInt(const std::string& argName) const
 	return std::atoi(val.c_str());
 }
 
+// Like GetParameterInt, for values that may not fit into an int, like byte counts.
+int64_t Arguments::GetParameterInt64(const std::string& argName) const
+{
+	auto val = GetParameter(argName);
+	return std::atoll(val.c_str());
+}
+
 bool Arguments::GetParameterBool(const std::string& argName) const
 {
 	auto val = GetParameter(argName);
@@ -6,6 +6,7 @@
  */
 #pragma once
 
+#include <cstdint>
 #include <map>
 #include <string>
 #include <vector>
@@ -26,6 +27,7 @@ class Arguments
 
 	[[nodiscard]] std::string GetParameter(const std::string& argName) const;
 	[[nodiscard]] int GetParameterInt(const std::string& argName) const;
+	[[nodiscard]] int64_t GetParameterInt64(const std::string& argName) const;
 	[[nodiscard]] bool GetParameterBool(const std::string& argName) const;
 	[[nodiscard]] std::vector<std::string> GetParameterList(const std::string& argName) const;
 
@@ -46,7 +48,13 @@ public:
 	[[nodiscard]] std::string GetSourcePath() const { return GetParameter("--src"); };
 	[[nodiscard]] std::string GetClient() const { return GetParameter("--client"); };
 	[[nodiscard]] int GetNetworkThreads() const { return GetParameterInt("--networkThreads"); };
+	[[nodiscard]] bool GetAdaptiveConcurrency() const { return GetParameterBool("--adaptiveConcurrency"); };
+	[[nodiscard]] int GetMinNetworkThreads() const { return GetParameterInt("--minNetworkThreads"); };
+	[[nodiscard]] int GetMaxCommandRate() const { return GetParameterInt("--maxCommandRate"); };
+	[[nodiscard]] std::vector<std::string> GetCommandRates() const { return GetParameterList("--commandRate"); };
+	[[nodiscard]] int64_t GetMaxBytesPerSecond() const { return GetParameterInt64("--maxBytesPerSecond"); };
 	[[nodiscard]] int GetPrintBatch() const { return GetParameterInt("--printBatch"); };
+	[[nodiscard]] std::vector<std::string> GetMemoryLimits() const { return GetParameterList("--memoryLimit"); };
 	[[nodiscard]] int GetLookAhead() const { return GetParameterInt("--lookAhead"); };
 	[[nodiscard]] int GetRetries() const { return GetParameterInt("--retries"); };
 	[[nodiscard]] int GetRefresh() const { return GetParameterInt("--refresh"); };
@@ -54,10 +62,29 @@ public:
 	[[nodiscard]] bool GetIncludeBinaries() const { return GetParameterBool("--includeBinaries"); };
 	[[nodiscard]] int GetMaxChanges() const { return GetParameterInt("--maxChanges"); };
 	[[nodiscard]] int GetFlushRate() const { return GetParameterInt("--flushRate"); };
+	[[nodiscard]] bool GetTrace() const { return GetParameterBool("--trace"); };
+	[[nodiscard]] int GetTraceSample() const { return GetParameterInt("--traceSample"); };
+	[[nodiscard]] int GetTraceMinDuration() const { return GetParameterInt("--traceMinDuration"); };
+	[[nodiscard]] std::string GetMetricsFile() const { return GetParameter("--metricsFile"); };
+	[[nodiscard]] std::string GetLatencyReport() const { return GetParameter("--latencyReport"); };
+	[[nodiscard]] int GetMetricsInterval() const { return GetParameterInt("--metricsInterval"); };
+	[[nodiscard]] std::string GetLedger() const { return GetParameter("--ledger"); };
+	[[nodiscard]] std::string GetRecord() const { return GetParameter("--record"); };
+	[[nodiscard]] std::string GetReplay() const { return GetParameter("--replay"); };
+	[[nodiscard]] int GetReplayLatency() const { return GetParameterInt("--replayLatency"); };
+	[[nodiscard]] int GetStallThreshold() const { return GetParameterInt("--stallThreshold"); };
+	[[nodiscard]] bool GetDownloadOnly() const { return GetParameterBool("--downloadOnly"); };
+	[[nodiscard]] bool GetHashContents() const { return GetParameterBool("--hashContents"); };
 	[[nodiscard]] bool GetNoColor() const { return GetParameterBool("--noColor"); };
+	[[nodiscard]] std::string GetLogLevel() const { return GetParameter("--logLevel"); };
+	[[nodiscard]] std::string GetLogFormat() const { return GetParameter("--logFormat"); };
 	[[nodiscard]] bool GetNoMerge() const { return GetParameterBool("--noMerge"); };
 	[[nodiscard]] bool GetNoBaseCommit() const { return GetParameterBool("--noBaseCommit"); };
+	[[nodiscard]] int GetDaemonInterval() const { return GetParameterInt("--daemonInterval"); };
+	[[nodiscard]] int GetUserCacheTTL() const { return GetParameterInt("--userCacheTTL"); };
 	[[nodiscard]] bool GetNoConvertLabels() const { return GetParameterBool("--noConvertLabels"); };
 	[[nodiscard]] std::string GetLabelCache() const { return GetParameter("--labelCache"); };
+	[[nodiscard]] int GetLabelThreads() const { return GetParameterInt("--labelThreads"); };
+	[[nodiscard]] bool GetLabelDetailsFromList() const { return GetParameterBool("--labelDetailsFromList"); };
 	[[nodiscard]] std::vector<std::string> GetBranches() const { return GetParameterList("--branch"); };
 };
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+size_t LatencyHistogram::BucketIndex(uint64_t micros)
+{
+	micros = std::min(micros, (uint64_t(1) << MaxValueBits) - 1);
+	if (micros < 2 * SubBuckets)
+	{
+		return micros;
+	}
+
+	// Shift the value so that it falls into [SubBuckets, 2 * SubBuckets),
+	// and use the shift to pick the power of two range.
+	const int shift = (int)std::bit_width(micros) - SubBucketBits - 1;
+	return (shift + 1) * SubBuckets + ((micros >> shift) - SubBuckets);
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(const size_t index)
+{
+	if (index < 2 * SubBuckets)
+	{
+		return index;
+	}
+
+	const int shift = (int)(index / SubBuckets) - 1;
+	const uint64_t subBucket = index % SubBuckets + SubBuckets;
+	return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(const std::chrono::nanoseconds duration)
+{
+	const uint64_t micros = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+
+	m_Buckets[BucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+	m_Count.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t max = m_Max.load(std::memory_order_relaxed);
+	while (micros > max && !m_Max.compare_exchange_weak(max, micros, std::memory_order_relaxed))
+	{
+	}
+}
+
+std::chrono::microseconds LatencyHistogram::GetPercentile(const double fraction) const
+{
+	const uint64_t count = GetCount();
+	if (count == 0)
+	{
+		return std::chrono::microseconds(0);
+	}
+
+	// The rank of the value we are looking for, counting from 1.
+	const uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(fraction * (double)count));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BucketCount; i++)
+	{
+		seen += m_Buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+		{
+			// The bucket bound can overshoot the largest value recorded.
+			return std::min(std::chrono::microseconds(BucketUpperBound(i)), GetMax());
+		}
+	}
+	return GetMax();
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * LatencyHistogram records durations with a fixed relative precision, in the
+ * style of HdrHistogram.
+ *
+ * Values are tracked in microseconds. Below 2 * SubBuckets microseconds every
+ * value has its own bucket. Above that, each power of two range is split into
+ * SubBuckets linear buckets, so a reported percentile is never more than
+ * 1 / SubBuckets (about 3%) above the true value. Durations of over an hour
+ * are clamped into the last bucket; the exact maximum is tracked separately.
+ *
+ * Recording is lock-free, so all threads can share one histogram.
+ */
+class LatencyHistogram
+{
+public:
+	static constexpr int SubBucketBits = 5;
+	static constexpr uint64_t SubBuckets = 1 << SubBucketBits;
+	// 2^32 microseconds is about 71 minutes.
+	static constexpr int MaxValueBits = 32;
+	static constexpr size_t BucketCount = (MaxValueBits - SubBucketBits + 1) * SubBuckets;
+
+	void Record(std::chrono::nanoseconds duration);
+
+	[[nodiscard]] uint64_t GetCount() const { return m_Count.load(std::memory_order_relaxed); }
+	[[nodiscard]] std::chrono::microseconds GetMax() const { return std::chrono::microseconds(m_Max.load(std::memory_order_relaxed)); }
+	// GetPercentile returns the value at or below which the given fraction
+	// (between 0 and 1) of the recorded values fall, rounded up to the upper
+	// bound of its bucket.
+	[[nodiscard]] std::chrono::microseconds GetPercentile(double fraction) const;
+
+	// BucketIndex returns the bucket a value in microseconds is counted in.
+	static size_t BucketIndex(uint64_t micros);
+	// BucketUpperBound returns the highest value in microseconds counted in the bucket.
+	static uint64_t BucketUpperBound(size_t index);
+
+private:
+	std::array<std::atomic<uint64_t>, BucketCount> m_Buckets {};
+	std::atomic<uint64_t> m_Count { 0 };
+	std::atomic<uint64_t> m_Max { 0 };
+};
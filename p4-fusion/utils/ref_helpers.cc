@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "ref_helpers.h"
+
+#include <cstring>
+
+namespace
+{
+bool isForbidden(const char c)
+{
+	// Control characters, DEL, space and ~^:?*[\ are never allowed.
+	return (unsigned char)c < 0x20 || c == 0x7f || (c != '\0' && std::strchr(" ~^:?*[]\\", c) != nullptr);
+}
+
+bool endsWithLock(const std::string& str)
+{
+	return str.size() >= 5 && str.compare(str.size() - 5, 5, ".lock") == 0;
+}
+}
+
+std::string RefHelpers::SanitizeTagName(const std::string& label)
+{
+	// The rules apply in this order, every rule to the result of the ones
+	// before it:
+	//  1. Forbidden characters become underscores.
+	//  2. "@{" becomes an underscore.
+	//  3. Every pair of dots in a run of dots becomes an underscore.
+	//  4. A dot at the start or after a slash becomes an underscore, along
+	//     with the slash.
+	//  5. A component ending with ".lock" ends with "_lock" instead.
+	//  6. A trailing dot, a trailing slash and a leading slash become
+	//     underscores.
+	//  7. Runs of slashes collapse to one.
+	//  8. "@" becomes an underscore.
+	// Slashes are held back until the next character shows whether rule 4
+	// takes one of them, or rule 6 applies because they are trailing.
+	std::string result;
+	result.reserve(label.size());
+	size_t slashes = 0;
+
+	auto flushSlashes = [&result, &slashes]()
+	{
+		if (slashes == 0)
+		{
+			return;
+		}
+		if (result.empty())
+		{
+			// A leading slash becomes an underscore, the rest collapse.
+			result += slashes > 1 ? "_/" : "_";
+		}
+		else
+		{
+			if (endsWithLock(result))
+			{
+				result[result.size() - 5] = '_';
+			}
+			result += '/';
+		}
+		slashes = 0;
+	};
+
+	for (size_t i = 0; i < label.size();)
+	{
+		const char c = label[i];
+		if (c == '/')
+		{
+			slashes++;
+			i++;
+		}
+		else if (c == '.')
+		{
+			size_t dots = 0;
+			while (i < label.size() && label[i] == '.')
+			{
+				dots++;
+				i++;
+			}
+			if (dots == 1 && slashes > 0)
+			{
+				slashes--;
+				flushSlashes();
+				result += '_';
+			}
+			else if (dots == 1 && result.empty())
+			{
+				result += '_';
+			}
+			else
+			{
+				flushSlashes();
+				result.append(dots / 2, '_');
+				if (dots % 2 == 1)
+				{
+					result += '.';
+				}
+			}
+		}
+		else if (c == '@' && i + 1 < label.size() && label[i + 1] == '{')
+		{
+			flushSlashes();
+			result += '_';
+			i += 2;
+		}
+		else
+		{
+			flushSlashes();
+			result += isForbidden(c) ? '_' : c;
+			i++;
+		}
+	}
+
+	if (slashes > 0)
+	{
+		if (result.empty())
+		{
+			return slashes == 1 ? "_" : (slashes == 2 ? "__" : "_/_");
+		}
+		if (endsWithLock(result))
+		{
+			result[result.size() - 5] = '_';
+		}
+		result += slashes > 1 ? "/_" : "_";
+		return result;
+	}
+	if (endsWithLock(result))
+	{
+		result[result.size() - 5] = '_';
+	}
+	if (!result.empty() && result.back() == '.')
+	{
+		result.back() = '_';
+	}
+	if (result == "@" || result.empty())
+	{
+		result = "_";
+	}
+	return result;
+}
+
+bool RefHelpers::IsValidRefName(const std::string& refName)
+{
+	if (refName.empty() || refName == "@" || refName.front() == '/' || refName.back() == '/' || refName.back() == '.')
+	{
+		return false;
+	}
+	size_t componentStart = 0;
+	for (size_t i = 0; i <= refName.size(); i++)
+	{
+		if (i == refName.size() || refName[i] == '/')
+		{
+			const std::string component = refName.substr(componentStart, i - componentStart);
+			if (component.empty() || component.front() == '.' || endsWithLock(component))
+			{
+				return false;
+			}
+			componentStart = i + 1;
+			continue;
+		}
+		const char c = refName[i];
+		if (isForbidden(c) || (c == '.' && i + 1 < refName.size() && refName[i + 1] == '.') || (c == '@' && i + 1 < refName.size() && refName[i + 1] == '{'))
+		{
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <string>
+
+class RefHelpers
+{
+public:
+	// SanitizeTagName turns a label name into a valid tag name as specified
+	// by https://git-scm.com/docs/git-check-ref-format, in a single pass.
+	// Invalid characters and sequences are replaced with underscores.
+	static std::string SanitizeTagName(const std::string& label);
+	// IsValidRefName checks a full ref name, like refs/tags/name, against the
+	// rules of git check-ref-format.
+	static bool IsValidRefName(const std::string& refName);
+};
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <class Signature>
+class UniqueFunction;
+
+/*
+ * UniqueFunction is a move-only replacement for std::function.
+ *
+ * Callables up to InlineSize bytes are stored inside the object itself, so
+ * queueing one doesn't allocate. Larger callables fall back to the heap.
+ * Because it is never copied, it can hold move-only captures.
+ */
+template <class R, class... Args>
+class UniqueFunction<R(Args...)>
+{
+public:
+	static constexpr size_t InlineSize = 48;
+
+private:
+	struct VTable
+	{
+		R (*invoke)(void* storage, Args&&... args);
+		// Move-constructs the callable into dst and destroys the one in src.
+		void (*relocate)(void* dst, void* src) noexcept;
+		void (*destroy)(void* storage) noexcept;
+	};
+
+	template <class F>
+	static constexpr bool IsInline = sizeof(F) <= InlineSize
+	    && alignof(F) <= alignof(std::max_align_t)
+	    && std::is_nothrow_move_constructible_v<F>;
+
+	template <class F>
+	static constexpr VTable InlineVTable = {
+		[](void* storage, Args&&... args) -> R
+		{ return (*static_cast<F*>(storage))(std::forward<Args>(args)...); },
+		[](void* dst, void* src) noexcept
+		{
+			::new (dst) F(std::move(*static_cast<F*>(src)));
+			static_cast<F*>(src)->~F();
+		},
+		[](void* storage) noexcept
+		{ static_cast<F*>(storage)->~F(); },
+	};
+
+	template <class F>
+	static constexpr VTable HeapVTable = {
+		[](void* storage, Args&&... args) -> R
+		{ return (**static_cast<F**>(storage))(std::forward<Args>(args)...); },
+		[](void* dst, void* src) noexcept
+		{ *static_cast<F**>(dst) = *static_cast<F**>(src); },
+		[](void* storage) noexcept
+		{ delete *static_cast<F**>(storage); },
+	};
+
+	alignas(std::max_align_t) unsigned char m_Storage[InlineSize];
+	const VTable* m_VTable = nullptr;
+
+	void reset() noexcept
+	{
+		if (m_VTable)
+		{
+			m_VTable->destroy(m_Storage);
+			m_VTable = nullptr;
+		}
+	}
+
+public:
+	UniqueFunction() noexcept = default;
+	UniqueFunction(std::nullptr_t) noexcept { }
+
+	template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, UniqueFunction> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+	UniqueFunction(F&& f)
+	{
+		using Callable = std::decay_t<F>;
+		if constexpr (IsInline<Callable>)
+		{
+			::new (static_cast<void*>(m_Storage)) Callable(std::forward<F>(f));
+			m_VTable = &InlineVTable<Callable>;
+		}
+		else
+		{
+			*reinterpret_cast<Callable**>(m_Storage) = new Callable(std::forward<F>(f));
+			m_VTable = &HeapVTable<Callable>;
+		}
+	}
+
+	UniqueFunction(UniqueFunction&& other) noexcept
+	{
+		if (other.m_VTable)
+		{
+			other.m_VTable->relocate(m_Storage, other.m_Storage);
+			m_VTable = other.m_VTable;
+			other.m_VTable = nullptr;
+		}
+	}
+
+	UniqueFunction& operator=(UniqueFunction&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			if (other.m_VTable)
+			{
+				other.m_VTable->relocate(m_Storage, other.m_Storage);
+				m_VTable = other.m_VTable;
+				other.m_VTable = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	UniqueFunction(const UniqueFunction&) = delete;
+	UniqueFunction& operator=(const UniqueFunction&) = delete;
+
+	~UniqueFunction() { reset(); }
+
+	// Whether a callable of type F is stored without a heap allocation.
+	template <class F>
+	static constexpr bool StoresInline = IsInline<std::decay_t<F>>;
+
+	explicit operator bool() const noexcept { return m_VTable != nullptr; }
+
+	R operator()(Args... args)
+	{
+		if (!m_VTable)
+		{
+			throw std::bad_function_call();
+		}
+		return m_VTable->invoke(m_Storage, std::forward<Args>(args)...);
+	}
+};
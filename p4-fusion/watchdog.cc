@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include "watchdog.h"
+
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "metrics.h"
+#include "utils/timer.h"
+
+namespace
+{
+// Padded to a cache line, so that workers updating their slot don't slow
+// each other down.
+struct alignas(64) Slot
+{
+	std::atomic<int> changelist { 0 };
+	std::atomic<int> phase { (int)Watchdog::Phase::Idle };
+	std::atomic<int> batch { 0 };
+	std::atomic<int> batches { 0 };
+	std::atomic<int64_t> phaseStartNs { 0 };
+	std::atomic<int64_t> lastProgressNs { 0 };
+};
+
+std::unique_ptr<Slot[]> s_Slots;
+int s_SlotCount = 0;
+thread_local Slot* t_Slot = nullptr;
+
+std::atomic<int> s_CommitterChangelist { 0 };
+// Zero while the committer isn't waiting.
+std::atomic<int64_t> s_CommitterWaitStartNs { 0 };
+
+int64_t nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Timer::Now().time_since_epoch()).count();
+}
+
+double secondsSince(const int64_t ns, const int64_t now)
+{
+	return (double)(now - ns) / 1e9;
+}
+
+const char* phaseName(const Watchdog::Phase phase)
+{
+	switch (phase)
+	{
+	case Watchdog::Phase::Describe:
+		return "describe";
+	case Watchdog::Phase::FileLog:
+		return "filelog";
+	case Watchdog::Phase::Print:
+		return "print";
+	case Watchdog::Phase::BlobClose:
+		return "blob close";
+	case Watchdog::Phase::Idle:
+	default:
+		return "idle";
+	}
+}
+}
+
+void Watchdog::Init(const int workers)
+{
+	s_Slots = std::make_unique<Slot[]>(workers);
+	s_SlotCount = workers;
+}
+
+void Watchdog::Attach(const int worker)
+{
+	t_Slot = worker < s_SlotCount ? &s_Slots[worker] : nullptr;
+}
+
+void Watchdog::Progress()
+{
+	if (t_Slot)
+	{
+		t_Slot->lastProgressNs.store(nowNs(), std::memory_order_relaxed);
+	}
+}
+
+void Watchdog::CommitterWaiting(const int changelist)
+{
+	s_CommitterChangelist.store(changelist, std::memory_order_relaxed);
+	s_CommitterWaitStartNs.store(nowNs(), std::memory_order_relaxed);
+}
+
+void Watchdog::CommitterDone()
+{
+	s_CommitterWaitStartNs.store(0, std::memory_order_relaxed);
+}
+
+Watchdog::PhaseScope::PhaseScope(const int changelist, const Phase phase, const int batch, const int batches)
+    : m_PreviousPhase((int)Phase::Idle)
+    , m_PreviousPhaseStartNs(0)
+{
+	if (!t_Slot)
+	{
+		return;
+	}
+	m_PreviousPhase = t_Slot->phase.load(std::memory_order_relaxed);
+	m_PreviousPhaseStartNs = t_Slot->phaseStartNs.load(std::memory_order_relaxed);
+	const int64_t now = nowNs();
+	t_Slot->changelist.store(changelist, std::memory_order_relaxed);
+	t_Slot->batch.store(batch, std::memory_order_relaxed);
+	t_Slot->batches.store(batches, std::memory_order_relaxed);
+	t_Slot->phaseStartNs.store(now, std::memory_order_relaxed);
+	t_Slot->lastProgressNs.store(now, std::memory_order_relaxed);
+	t_Slot->phase.store((int)phase, std::memory_order_relaxed);
+}
+
+Watchdog::PhaseScope::~PhaseScope()
+{
+	if (t_Slot)
+	{
+		t_Slot->phaseStartNs.store(m_PreviousPhaseStartNs, std::memory_order_relaxed);
+		t_Slot->phase.store(m_PreviousPhase, std::memory_order_relaxed);
+	}
+}
+
+std::string Watchdog::Dump()
+{
+	const int64_t now = nowNs();
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(1) << std::left
+	    << std::setw(8) << "worker"
+	    << std::setw(12) << "CL"
+	    << std::setw(18) << "phase"
+	    << std::setw(16) << "since progress"
+	    << "in phase\n";
+
+	int busy = 0;
+	for (int i = 0; i < s_SlotCount; i++)
+	{
+		const Slot& slot = s_Slots[i];
+		const auto phase = (Phase)slot.phase.load(std::memory_order_relaxed);
+		if (phase == Phase::Idle)
+		{
+			continue;
+		}
+		busy++;
+
+		std::string phaseText = phaseName(phase);
+		if (phase == Phase::Print || phase == Phase::BlobClose)
+		{
+			phaseText += " " + std::to_string(slot.batch.load()) + "/" + std::to_string(slot.batches.load());
+		}
+		std::ostringstream progress;
+		progress << std::fixed << std::setprecision(1) << secondsSince(slot.lastProgressNs.load(), now) << "s";
+		out << std::setw(8) << i
+		    << std::setw(12) << slot.changelist.load()
+		    << std::setw(18) << phaseText
+		    << std::setw(16) << progress.str()
+		    << secondsSince(slot.phaseStartNs.load(), now) << "s\n";
+	}
+	if (busy == 0)
+	{
+		out << "(all workers are idle)\n";
+	}
+	return out.str();
+}
+
+void Watchdog::UpdateMetrics()
+{
+	const int64_t now = nowNs();
+	std::map<std::string, int> perPhase;
+	double oldestProgress = 0;
+	for (int i = 0; i < s_SlotCount; i++)
+	{
+		const Slot& slot = s_Slots[i];
+		const auto phase = (Phase)slot.phase.load(std::memory_order_relaxed);
+		if (phase == Phase::Idle)
+		{
+			continue;
+		}
+		perPhase[phaseName(phase)]++;
+		oldestProgress = std::max(oldestProgress, secondsSince(slot.lastProgressNs.load(), now));
+	}
+
+	for (const Phase phase : { Phase::Describe, Phase::FileLog, Phase::Print, Phase::BlobClose })
+	{
+		const std::string name = phaseName(phase);
+		Metrics::Gauge("p4_fusion_workers_in_phase", "Workers currently in each phase of downloading a changelist.", "phase=\"" + name + "\"").Set(perPhase[name]);
+	}
+	Metrics::Gauge("p4_fusion_oldest_progress_age_seconds", "Longest time any busy worker went without receiving data.").Set(oldestProgress);
+
+	const int64_t waitStart = s_CommitterWaitStartNs.load(std::memory_order_relaxed);
+	Metrics::Gauge("p4_fusion_committer_current_wait_seconds", "How long the committer has been waiting for the current changelist, 0 if it isn't waiting.").Set(waitStart == 0 ? 0 : secondsSince(waitStart, now));
+}
+
+Watchdog::Watchdog(const int stallThresholdSeconds)
+    : m_ShouldStop(false)
+{
+	if (stallThresholdSeconds <= 0)
+	{
+		return;
+	}
+
+	m_Monitor = std::async(std::launch::async, [stallThresholdSeconds, this]()
+	    {
+		    // The wait start of the last report, and how many reports it got.
+		    int64_t reportedWaitStart = 0;
+		    int reports = 0;
+		    while (!m_ShouldStop)
+		    {
+			    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+			    const int64_t waitStart = s_CommitterWaitStartNs.load(std::memory_order_relaxed);
+			    if (waitStart == 0)
+			    {
+				    continue;
+			    }
+			    if (waitStart != reportedWaitStart)
+			    {
+				    reportedWaitStart = waitStart;
+				    reports = 0;
+			    }
+
+			    const double waited = secondsSince(waitStart, nowNs());
+			    if (waited < (double)stallThresholdSeconds * (reports + 1))
+			    {
+				    continue;
+			    }
+			    reports++;
+
+			    WARN("Committer has been waiting " << (int)waited << "s for CL " << s_CommitterChangelist.load() << " to download. Busy workers:")
+			    std::istringstream table(Dump());
+			    std::string line;
+			    while (std::getline(table, line))
+			    {
+				    WARN("  " << line)
+			    }
+		    } });
+}
+
+Watchdog::~Watchdog()
+{
+	m_ShouldStop = true;
+	if (m_Monitor.valid())
+	{
+		m_Monitor.get();
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+
+/*
+ * Watchdog keeps track of what every worker of the thread pool is doing, so
+ * that a stalled run can tell which changelist and command it is stuck on.
+ *
+ * Each worker owns a slot that it updates without locking: the changelist it
+ * works on, its current phase and when it last received data from the
+ * server. The committer reports when it starts and stops waiting for a
+ * changelist. A monitor thread dumps all slots once the committer has been
+ * waiting for longer than the stall threshold, and again for every further
+ * threshold that passes.
+ */
+class Watchdog
+{
+public:
+	enum class Phase
+	{
+		Idle,
+		Describe,
+		FileLog,
+		Print,
+		BlobClose,
+	};
+
+	// Init allocates slots for the given number of workers. It must be called
+	// before the workers start.
+	static void Init(int workers);
+	// Attach binds the calling thread to the slot of the given worker.
+	static void Attach(int worker);
+
+	// Progress notes that the calling worker received data. It is cheap enough
+	// to be called for every chunk of output.
+	static void Progress();
+
+	// CommitterWaiting and CommitterDone bracket the wait for a changelist.
+	static void CommitterWaiting(int changelist);
+	static void CommitterDone();
+
+	// Dump formats the state of all busy workers as a table.
+	static std::string Dump();
+	// UpdateMetrics publishes the state of the workers as gauges.
+	static void UpdateMetrics();
+
+	/*
+	 * PhaseScope sets the phase of the calling worker for its life time, and
+	 * restores the previous phase when it ends. batch and batches describe which
+	 * print batch of the changelist is being processed, counting from 1.
+	 */
+	class PhaseScope
+	{
+	public:
+		PhaseScope(int changelist, Phase phase, int batch = 0, int batches = 0);
+		~PhaseScope();
+		PhaseScope(const PhaseScope&) = delete;
+		PhaseScope& operator=(const PhaseScope&) = delete;
+
+	private:
+		// Scopes nest, e.g. closing a blob happens while printing a batch.
+		int m_PreviousPhase;
+		int64_t m_PreviousPhaseStartNs;
+	};
+
+	// The monitor thread runs as long as this object lives. A
+	// threshold of 0 seconds disables stall reports.
+	Watchdog(int stallThresholdSeconds);
+	Watchdog() = delete;
+	~Watchdog();
+
+private:
+	std::atomic_bool m_ShouldStop;
+	std::future<void> m_Monitor;
+};
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <regex>
+#include <string>
+
+// LegacyConvertLabelToTag is the regex based label sanitizer that
+// RefHelpers::SanitizeTagName replaced, kept as the reference for the
+// differential test and the benchmark.
+inline std::string LegacyConvertLabelToTag(std::string input)
+{
+	std::string result = input;
+	std::regex invalidChars(R"([[:cntrl:]\x7f ~^:?\*\[\]\\])");
+	result = std::regex_replace(result, invalidChars, "_");
+	std::regex atBrace(R"(@\{)");
+	result = std::regex_replace(result, atBrace, "_");
+	std::regex consecutiveDots(R"(\.\.)");
+	while (std::regex_search(result, consecutiveDots))
+	{
+		result = std::regex_replace(result, consecutiveDots, "_");
+	}
+	std::regex dotComponent(R"(/\.|^\.|(\.\.))");
+	if (std::regex_search(result, dotComponent))
+	{
+		result = std::regex_replace(result, dotComponent, "_");
+	}
+	std::regex dotLock(R"(\.lock(?=/|$))");
+	result = std::regex_replace(result, dotLock, "_lock");
+	if (result.back() == '.')
+	{
+		result.back() = '_';
+	}
+	if (result.back() == '/')
+	{
+		result.back() = '_';
+	}
+	if (result.front() == '/')
+	{
+		result.front() = '_';
+	}
+	std::regex consecutiveSlashes(R"(//+)");
+	result = std::regex_replace(result, consecutiveSlashes, "/");
+	if (result == "@")
+	{
+		result = "_";
+	}
+	return result;
+}
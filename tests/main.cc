@@ -9,11 +9,30 @@
 #include "tests.common.h"
 #include "tests.utils.h"
 #include "tests.git.h"
+#include "tests.histogram.h"
+#include "tests.refs.h"
+#include "tests.limits.h"
+#include "tests.queue.h"
+#include "tests.function.h"
+#include "tests.trace.h"
+#include "tests.blob.h"
+#include "tests.tags.h"
+#include "tests.labels.h"
 
 int main()
 {
 	TEST_REPORT("Utils", TestUtils());
 	TEST_REPORT("GitAPI", TestGitAPI());
+	TEST_REPORT("LatencyHistogram", TestLatencyHistogram());
+	TEST_REPORT("RefHelpers", TestRefHelpers());
+	TEST_REPORT("ConcurrencyLimiter", TestConcurrencyLimiter());
+	TEST_REPORT("RateLimiter", TestRateLimiter());
+	TEST_REPORT("JobQueue", TestJobQueue());
+	TEST_REPORT("UniqueFunction", TestUniqueFunction());
+	TEST_REPORT("Trace", TestTrace());
+	TEST_REPORT("BlobWriter", TestBlobWriter());
+	TEST_REPORT("Tags", TestTags());
+	TEST_REPORT("LabelCache", TestLabelCache());
 
 	SUCCESS("All test cases passed");
 	return 0;
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include "tests.common.h"
+#include "git_api.h"
+
+// HashBlob hashes the contents in two chunks with the Hash sink.
+std::string HashBlob(const std::string& contents, int64_t expectedSize)
+{
+	BlobWriter writer(nullptr);
+	writer.ExpectSize(expectedSize);
+	const size_t half = contents.size() / 2;
+	writer.Write(contents.data(), (int)half);
+	writer.Write(contents.data() + half, (int)(contents.size() - half));
+	return writer.Close();
+}
+
+int TestBlobWriter()
+{
+	TEST_START();
+
+	Libgit2RAII git2(false);
+	const BlobWriter::Sink previousSink = BlobWriter::ContentSink;
+	BlobWriter::ContentSink = BlobWriter::Sink::Hash;
+
+	// Object IDs as computed by git hash-object.
+	const std::string helloWorld = "hello world\n";
+	const std::string helloWorldOID = "3b18e512dba79e4c8300dd08aeb37f8e728b8dad";
+	const std::string emptyOID = "e69de29bb2d1d6434b8b29ae775ad8c2e48c5391";
+
+	// Blobs of known size are hashed while streaming, others are buffered,
+	// both give the object ID git would.
+	TEST(HashBlob(helloWorld, (int64_t)helloWorld.size()), helloWorldOID);
+	TEST(HashBlob(helloWorld, -1), helloWorldOID);
+	TEST(HashBlob("", 0), emptyOID);
+	TEST(HashBlob("", -1), emptyOID);
+	{
+		// A blob closed without any writes is empty.
+		BlobWriter writer(nullptr);
+		writer.ExpectSize(0);
+		TEST(writer.Close(), emptyOID);
+	}
+
+	{
+		// A blob that doesn't match its announced size gets an object ID git
+		// wouldn't compute, but doesn't fail the measurement.
+		bool threw = false;
+		std::string oid;
+		try
+		{
+			oid = HashBlob(helloWorld, 5);
+		}
+		catch (const std::runtime_error&)
+		{
+			threw = true;
+		}
+		TEST(threw, false);
+		TEST(oid.size(), (size_t)GIT_OID_HEXSZ);
+		TEST(oid != helloWorldOID, true);
+	}
+
+	BlobWriter::ContentSink = previousSink;
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "tests.common.h"
+#include "utils/unique_function.h"
+
+// Counts its own destructions, to check that captures are destroyed exactly once.
+struct DestructionCounter
+{
+	int& count;
+	explicit DestructionCounter(int& c)
+	    : count(c)
+	{
+	}
+	~DestructionCounter() { count++; }
+};
+
+int TestUniqueFunction()
+{
+	TEST_START();
+
+	typedef UniqueFunction<int(int)> Function;
+
+	{
+		// The print batch job captures a pointer, a reference, two ints and a
+		// vector, which fills the inline storage exactly.
+		int base = 1;
+		int* self = &base;
+		const int batch = 2;
+		const int batches = 3;
+		std::vector<std::unique_ptr<int>> files;
+		files.push_back(std::make_unique<int>(4));
+		auto job = [self, &base, batch, batches, files = std::move(files)](int x)
+		{ return *self + base + batch + batches + *files.front() + x; };
+		TEST(sizeof(job), Function::InlineSize);
+		TEST(Function::StoresInline<decltype(job)>, true);
+
+		Function f(std::move(job));
+		TEST(bool(f), true);
+		TEST(f(10), 21);
+	}
+
+	{
+		// Larger callables go to the heap and behave the same.
+		std::array<int, 32> values {};
+		values[31] = 5;
+		auto job = [values](int x)
+		{ return values[31] + x; };
+		TEST(Function::StoresInline<decltype(job)>, false);
+
+		Function f(std::move(job));
+		TEST(f(1), 6);
+	}
+
+	{
+		// Moving transfers the callable and empties the source, for both
+		// storage kinds.
+		std::array<int, 32> values {};
+		values[0] = 7;
+		Function small([](int x)
+		    { return x * 2; });
+		Function large([values](int x)
+		    { return values[0] + x; });
+
+		Function movedSmall(std::move(small));
+		Function movedLarge(std::move(large));
+		TEST(bool(small), false);
+		TEST(bool(large), false);
+		TEST(movedSmall(4), 8);
+		TEST(movedLarge(4), 11);
+
+		Function assigned;
+		assigned = std::move(movedLarge);
+		TEST(bool(movedLarge), false);
+		TEST(assigned(1), 8);
+		assigned = std::move(movedSmall);
+		TEST(assigned(1), 2);
+	}
+
+	{
+		// Move-only captures are destroyed exactly once, wherever the
+		// callable ended up.
+		int inlineDestroyed = 0;
+		int heapDestroyed = 0;
+		{
+			auto counter = std::make_unique<DestructionCounter>(inlineDestroyed);
+			Function f([counter = std::move(counter)](int x)
+			    { return x; });
+			Function moved(std::move(f));
+			Function assigned;
+			assigned = std::move(moved);
+			TEST(inlineDestroyed, 0);
+		}
+		TEST(inlineDestroyed, 1);
+		{
+			std::array<char, 64> padding {};
+			auto counter = std::make_unique<DestructionCounter>(heapDestroyed);
+			Function f([padding, counter = std::move(counter)](int x)
+			    { return x + padding[0]; });
+			Function moved(std::move(f));
+			TEST(heapDestroyed, 0);
+		}
+		TEST(heapDestroyed, 1);
+
+		// Assigning over a function destroys the callable it held.
+		int replacedDestroyed = 0;
+		Function f([counter = std::make_unique<DestructionCounter>(replacedDestroyed)](int x)
+		    { return x; });
+		f = Function([](int x)
+		    { return x; });
+		TEST(replacedDestroyed, 1);
+	}
+
+	{
+		// Calling an empty function throws like std::function does.
+		Function empty;
+		Function null(nullptr);
+		TEST(bool(empty), false);
+		TEST(bool(null), false);
+
+		bool threw = false;
+		try
+		{
+			empty(1);
+		}
+		catch (const std::bad_function_call&)
+		{
+			threw = true;
+		}
+		TEST(threw, true);
+	}
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
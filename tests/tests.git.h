@@ -6,50 +6,70 @@
  */
 #pragma once
 
+#include <filesystem>
+#include <string>
+#include <vector>
+
 #include "tests.common.h"
 #include "git_api.h"
+#include "commands/change_list.h"
+
+// CommitTestFile converts a changelist that changes a single file, and
+// returns its commit.
+std::string CommitTestFile(GitAPI& git, const std::string& depotPath, const int number, std::string depotFile, std::string relativePath, std::string action, const std::string& contents, const std::string& targetBranch = "")
+{
+	ChangeList cl(number, "Change " + std::to_string(number), "test.user", 1700000000 + number);
+	std::string revision = std::to_string(number);
+	std::string type = "text";
+	FileData file(depotFile, revision, action, type);
+	file.SetRelativePath(relativePath);
+	if (!file.IsDeleted())
+	{
+		BlobWriter writer = git.WriteBlob();
+		writer.Write(contents.data(), (int)contents.size());
+		file.SetBlobOID(writer.Close());
+	}
+
+	std::vector<FileData> files = { file };
+	return git.WriteChangelistBranch(depotPath, cl, files, targetBranch, "test.user", "test@user", "");
+}
 
 int TestGitAPI()
 {
 	TEST_START();
 
-	GitAPI git(false);
-
-	TEST(git.InitializeRepository("/tmp/test-repo"), true);
-	git.CreateIndex();
-	git.AddFileToIndex("foo.txt", { 'x', 'y', 'z' }, false);
-	git.Commit(
-	    "//a/b/c/...",
-	    "12345678",
-	    "test.user",
-	    "test@user",
-	    0,
-	    "Test description",
-	    10000000,
-	    "");
-	TEST(git.IsHEADExists(), true);
-	TEST(git.IsRepositoryClonedFrom("//a/b/c/..."), true);
-	TEST(git.IsRepositoryClonedFrom("//a/b/c/d/..."), false);
-	TEST(git.IsRepositoryClonedFrom("//x/y/z/..."), false);
-	TEST(git.DetectLatestCL(), "12345678");
-
-	git.RemoveFileFromIndex("foo.txt");
-	git.Commit(
-	    "//a/b/c/...",
-	    "12345679",
-	    "test.user.2",
-	    "test2@user",
-	    0,
-	    "Test description",
-	    20000000,
-	    "");
-	TEST(git.IsHEADExists(), true);
-	TEST(git.IsRepositoryClonedFrom("//a/b/c/..."), true);
-	TEST(git.IsRepositoryClonedFrom("//a/b/c/d/..."), false);
-	TEST(git.IsRepositoryClonedFrom("//x/y/z/..."), false);
-	TEST(git.DetectLatestCL(), "12345679");
-
-	git.CloseIndex();
+	Libgit2RAII git2(false);
+	const std::filesystem::path dir = std::filesystem::temp_directory_path() / "p4-fusion-test-git";
+	std::filesystem::remove_all(dir);
+
+	{
+		GitAPI git(dir.string(), 0);
+		git.InitializeRepository(false);
+		// The base commit is there before any changelist.
+		TEST(git.IsHEADExists(), true);
+		TEST(git.IsRepositoryClonedFrom("//a/b/c/..."), false);
+
+		CommitTestFile(git, "//a/b/c/...", 12345678, "//a/b/c/foo.txt", "foo.txt", "add", "xyz");
+		TEST(git.IsHEADExists(), true);
+		TEST(git.IsRepositoryClonedFrom("//a/b/c/..."), true);
+		TEST(git.IsRepositoryClonedFrom("//a/b/c/d/..."), false);
+		TEST(git.IsRepositoryClonedFrom("//x/y/z/..."), false);
+		TEST(git.DetectLatestCL(), "12345678");
+
+		CommitTestFile(git, "//a/b/c/...", 12345679, "//a/b/c/foo.txt", "foo.txt", "delete", "");
+		TEST(git.IsRepositoryClonedFrom("//a/b/c/..."), true);
+		TEST(git.DetectLatestCL(), "12345679");
+	}
+
+	{
+		// A later run picks up where the previous one stopped.
+		GitAPI git(dir.string(), 0);
+		git.InitializeRepository(false);
+		TEST(git.IsRepositoryClonedFrom("//a/b/c/..."), true);
+		TEST(git.DetectLatestCL(), "12345679");
+	}
+
+	std::filesystem::remove_all(dir);
 
 	TEST_END();
 	return TEST_EXIT_CODE();
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include "tests.common.h"
+#include "utils/latency_histogram.h"
+
+int TestLatencyHistogram()
+{
+	TEST_START();
+
+	// Small values have a bucket of their own.
+	TEST(LatencyHistogram::BucketIndex(0), 0);
+	TEST(LatencyHistogram::BucketIndex(63), 63);
+	TEST(LatencyHistogram::BucketUpperBound(63), 63);
+	// Above that, buckets get wider with every power of two.
+	TEST(LatencyHistogram::BucketIndex(64), 64);
+	TEST(LatencyHistogram::BucketIndex(65), 64);
+	TEST(LatencyHistogram::BucketUpperBound(64), 65);
+	TEST(LatencyHistogram::BucketIndex(128), 96);
+	TEST(LatencyHistogram::BucketUpperBound(96), 131);
+	// Values past the range end up in the last bucket.
+	TEST(LatencyHistogram::BucketIndex(uint64_t(1) << 40), LatencyHistogram::BucketCount - 1);
+
+	{
+		// Every bucket starts right after the previous one ends, and bucket
+		// widths stay within the promised precision.
+		bool contiguous = true;
+		bool precise = true;
+		for (size_t i = 1; i < LatencyHistogram::BucketCount; i++)
+		{
+			const uint64_t lower = LatencyHistogram::BucketUpperBound(i - 1) + 1;
+			const uint64_t upper = LatencyHistogram::BucketUpperBound(i);
+			contiguous = contiguous && LatencyHistogram::BucketIndex(lower) == i && LatencyHistogram::BucketIndex(upper) == i;
+			precise = precise && (upper - lower) * LatencyHistogram::SubBuckets <= lower;
+		}
+		TEST(contiguous, true);
+		TEST(precise, true);
+	}
+
+	{
+		LatencyHistogram histogram;
+		TEST(histogram.GetPercentile(0.5).count(), 0);
+
+		for (int i = 1; i <= 1000; i++)
+		{
+			histogram.Record(std::chrono::milliseconds(i));
+		}
+		TEST(histogram.GetCount(), 1000);
+		TEST(histogram.GetMax().count(), 1000000);
+
+		const auto p50 = histogram.GetPercentile(0.5).count();
+		TEST(p50 >= 500000 && p50 <= 500000 + 500000 / LatencyHistogram::SubBuckets, true);
+		const auto p99 = histogram.GetPercentile(0.99).count();
+		TEST(p99 >= 990000 && p99 <= 1000000, true);
+		TEST(histogram.GetPercentile(1).count(), 1000000);
+	}
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
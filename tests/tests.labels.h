@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "tests.common.h"
+#include "labels_cache.h"
+
+LabelResult MakeLabel(const std::string& name, const std::string& update)
+{
+	LabelResult label;
+	label.label = name;
+	label.revision = "@42";
+	label.description = "Label " + name;
+	label.update = update;
+	label.views = { "//depot/main/...", "//depot/release/..." };
+	return label;
+}
+
+// WriteLegacyLabelCache writes labels in the format of version 1 caches.
+void WriteLegacyLabelCache(const std::string& path, const std::vector<LabelResult>& labels)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	auto writeSize = [&out](const size_t value)
+	{
+		out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	};
+	auto writeString = [&out, &writeSize](const std::string& str)
+	{
+		writeSize(str.size());
+		out.write(str.data(), (std::streamsize)str.size());
+	};
+
+	writeSize(labels.size());
+	for (const auto& label : labels)
+	{
+		const int version = 1;
+		out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+		writeString(label.label);
+		writeString(label.revision);
+		writeString(label.description);
+		writeString(label.update);
+		writeSize(label.views.size());
+		for (const auto& view : label.views)
+		{
+			writeString(view);
+		}
+	}
+}
+
+int TestLabelCache()
+{
+	TEST_START();
+
+	const std::filesystem::path dir = std::filesystem::temp_directory_path() / "p4-fusion-test-labels";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+
+	{
+		// The first commit writes a snapshot, later ones append to the journal,
+		// which is replayed when the cache is opened again.
+		const std::string path = (dir / "journal.cache").string();
+		{
+			LabelCache cache(path);
+			TEST(cache.Size(), 0);
+			cache.Put(MakeLabel("a", "1"));
+			cache.Put(MakeLabel("b", "1"));
+			cache.Commit();
+		}
+		{
+			LabelCache cache(path);
+			TEST(cache.JournalSize(), 0);
+			TEST(cache.Size(), 2);
+			cache.Put(MakeLabel("b", "2"));
+			cache.Put(MakeLabel("c", "1"));
+			cache.Remove("a");
+			cache.Commit();
+		}
+		LabelCache cache(path);
+		TEST(cache.JournalSize(), 3);
+		TEST(cache.Size(), 2);
+		TEST(cache.Get("a").has_value(), false);
+		TEST(cache.Get("b")->update, "2");
+		TEST(cache.Get("c")->description, "Label c");
+		TEST(cache.Get("c")->views.size(), 2);
+		TEST(cache.Get("d").has_value(), false);
+	}
+
+	{
+		// A record cut short at the end of the journal is dropped, along with
+		// the bytes it left behind, and the records before it are kept.
+		const std::string path = (dir / "torn.cache").string();
+		{
+			LabelCache cache(path);
+			cache.Put(MakeLabel("a", "1"));
+			cache.Commit();
+			cache.Put(MakeLabel("b", "1"));
+			cache.Commit();
+		}
+		const auto intact = std::filesystem::file_size(path);
+		{
+			LabelCache cache(path);
+			cache.Put(MakeLabel("c", "1"));
+			cache.Commit();
+		}
+		std::filesystem::resize_file(path, std::filesystem::file_size(path) - 3);
+
+		LabelCache cache(path);
+		TEST(std::filesystem::file_size(path), intact);
+		TEST(cache.Get("a").has_value(), true);
+		TEST(cache.Get("b").has_value(), true);
+		TEST(cache.Get("c").has_value(), false);
+
+		// New records go where the torn one was.
+		cache.Put(MakeLabel("d", "1"));
+		cache.Commit();
+		LabelCache reopened(path);
+		TEST(reopened.Size(), 3);
+		TEST(reopened.Get("d").has_value(), true);
+	}
+
+	{
+		// Version 1 caches are read once and rewritten as a snapshot.
+		const std::string path = (dir / "legacy.cache").string();
+		WriteLegacyLabelCache(path, { MakeLabel("a", "1"), MakeLabel("b", "2") });
+		{
+			LabelCache cache(path);
+			TEST(cache.Size(), 2);
+			TEST(cache.Get("b")->update, "2");
+			TEST(cache.Get("a")->views.size(), 2);
+			cache.Commit();
+		}
+		LabelCache cache(path);
+		TEST(cache.JournalSize(), 0);
+		TEST(cache.Size(), 2);
+		TEST(cache.Get("a")->revision, "@42");
+
+		// A damaged one is started over.
+		WriteLegacyLabelCache(path, { MakeLabel("a", "1") });
+		std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+		LabelCache damaged(path);
+		TEST(damaged.Size(), 0);
+	}
+
+	{
+		// Once the journal grows large, a commit folds it into a new snapshot
+		// without the removed labels.
+		const std::string path = (dir / "compact.cache").string();
+		{
+			LabelCache cache(path);
+			cache.Put(MakeLabel("removed", "1"));
+			cache.Commit();
+		}
+		{
+			LabelCache cache(path);
+			cache.Remove("removed");
+			for (int i = 0; i < 2000; i++)
+			{
+				cache.Put(MakeLabel("label-" + std::to_string(i), "1"));
+			}
+			cache.Commit();
+			TEST(cache.JournalSize(), 0);
+		}
+		LabelCache cache(path);
+		TEST(cache.JournalSize(), 0);
+		TEST(cache.Size(), 2000);
+		TEST(cache.Get("removed").has_value(), false);
+		TEST(cache.Get("label-1999")->label, "label-1999");
+	}
+
+	std::filesystem::remove_all(dir);
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
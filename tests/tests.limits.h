@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+#include "tests.common.h"
+#include "concurrency_limiter.h"
+#include "rate_limiter.h"
+
+// Acquires a slot and releases it again right away, as if a command of the
+// given latency had just finished.
+void RunLimitedCommand(ConcurrencyLimiter& limiter, const std::string& command, std::chrono::milliseconds latency, bool failed = false)
+{
+	limiter.Acquire();
+	limiter.Release(command, latency, failed);
+}
+
+int TestConcurrencyLimiter()
+{
+	TEST_START();
+
+	{
+		// The limit starts in the middle of the range and a full window of
+		// healthy commands grows it by one.
+		ConcurrencyLimiter limiter(2, 10);
+		TEST(limiter.GetLimit(), 6);
+		for (int i = 0; i < 7; i++)
+		{
+			RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(10));
+		}
+		TEST(limiter.GetLimit(), 7);
+		TEST(limiter.GetInFlight(), 0);
+
+		// It never grows past the maximum.
+		for (int i = 0; i < 1000; i++)
+		{
+			RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(10));
+		}
+		TEST(limiter.GetLimit(), 10);
+		TEST(limiter.GetDecreaseCount(), 0);
+	}
+
+	{
+		// A failed command shrinks the limit, and the failures right after it
+		// fall into the cooldown.
+		ConcurrencyLimiter limiter(1, 16);
+		TEST(limiter.GetLimit(), 8);
+		RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(10), true);
+		TEST(limiter.GetLimit(), 6);
+		RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(10), true);
+		TEST(limiter.GetLimit(), 6);
+		TEST(limiter.GetDecreaseCount(), 1);
+	}
+
+	{
+		// A command much slower than its running average shrinks the limit, a
+		// slightly slower one doesn't.
+		ConcurrencyLimiter limiter(1, 16);
+		RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(10));
+		RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(15));
+		TEST(limiter.GetDecreaseCount(), 0);
+		RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(100));
+		TEST(limiter.GetDecreaseCount(), 1);
+		TEST(limiter.GetLimit(), 6);
+	}
+
+	{
+		// The limit never drops below the minimum.
+		ConcurrencyLimiter limiter(3, 4);
+		for (int i = 0; i < 3; i++)
+		{
+			RunLimitedCommand(limiter, "describe", std::chrono::milliseconds(10), true);
+			std::this_thread::sleep_for(ConcurrencyLimiter::MinDecreaseCooldown);
+		}
+		TEST(limiter.GetLimit(), 3);
+	}
+
+	{
+		// The latency of print follows the file sizes, so a slow print doesn't
+		// count against the server but a failed one does.
+		ConcurrencyLimiter limiter(1, 16);
+		RunLimitedCommand(limiter, "print", std::chrono::milliseconds(10));
+		RunLimitedCommand(limiter, "print", std::chrono::milliseconds(5000));
+		TEST(limiter.GetDecreaseCount(), 0);
+		RunLimitedCommand(limiter, "print", std::chrono::milliseconds(10), true);
+		TEST(limiter.GetDecreaseCount(), 1);
+	}
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
+
+int TestRateLimiter()
+{
+	TEST_START();
+
+	auto throttledSeconds = [](const TokenBucket& bucket)
+	{
+		return std::chrono::duration<double>(bucket.GetThrottledTime()).count();
+	};
+
+	{
+		TokenBucket bucket(1000);
+
+		// A full bucket lets one second worth of tokens through at once.
+		bucket.Take(1000);
+		TEST(throttledSeconds(bucket), 0.0);
+
+		// Once it is empty, callers wait until their tokens have refilled.
+		bucket.Take(500);
+		const double afterEmpty = throttledSeconds(bucket);
+		TEST(afterEmpty > 0.4 && afterEmpty <= 0.5, true);
+
+		// Tokens refill at the configured rate while nobody takes any.
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		bucket.Take(200);
+		TEST(throttledSeconds(bucket), afterEmpty);
+
+		// The bucket never holds more than the burst size.
+		std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+		bucket.Take(1000);
+		TEST(throttledSeconds(bucket), afterEmpty);
+		bucket.Take(200);
+		const double afterBurst = throttledSeconds(bucket) - afterEmpty;
+		TEST(afterBurst > 0.15 && afterBurst <= 0.2, true);
+	}
+
+	{
+		// Rates below one token per second still allow single tokens through.
+		TokenBucket bucket(0.5);
+		bucket.Take(1);
+		TEST(throttledSeconds(bucket), 0.0);
+	}
+
+	{
+		RateLimiter limiter;
+		TEST(limiter.IsEmpty(), true);
+		limiter.ParseCommandRate("print=10");
+		TEST(limiter.IsEmpty(), false);
+
+		bool threw = false;
+		try
+		{
+			limiter.ParseCommandRate("print=0");
+		}
+		catch (const std::invalid_argument&)
+		{
+			threw = true;
+		}
+		TEST(threw, true);
+
+		threw = false;
+		try
+		{
+			limiter.ParseCommandRate("=10");
+		}
+		catch (const std::invalid_argument&)
+		{
+			threw = true;
+		}
+		TEST(threw, true);
+
+		// Byte rates beyond the range of an int are valid.
+		limiter.SetByteRate(int64_t(8) << 30);
+		limiter.ThrottleBytes(1 << 30);
+	}
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
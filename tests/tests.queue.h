@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "tests.common.h"
+#include "job_queue.h"
+
+int TestJobQueue()
+{
+	TEST_START();
+
+	{
+		// Without concurrent pushes the minimum hint always points at the
+		// lowest job, so a single worker pops everything in order.
+		JobQueue<int64_t> queue(8);
+		std::mt19937 rng(42);
+		for (int i = 0; i < 1000; i++)
+		{
+			const int64_t priority = rng() % 100;
+			queue.Push(int64_t(priority), priority);
+		}
+		TEST(queue.Size(), 1000);
+
+		bool ordered = true;
+		int64_t last = -1;
+		int64_t item = 0;
+		for (int i = 0; i < 1000; i++)
+		{
+			queue.Pop(item, 0);
+			ordered = ordered && item >= last;
+			last = item;
+		}
+		TEST(ordered, true);
+		TEST(queue.Size(), 0);
+	}
+
+	{
+		// A lower priority pushed between pops is the next one popped, even
+		// from a shard the worker doesn't own.
+		JobQueue<int64_t> queue(4);
+		for (int64_t priority = 10; priority < 20; priority++)
+		{
+			queue.Push(int64_t(priority), priority, 0);
+		}
+		int64_t item = 0;
+		queue.Pop(item, 0);
+		TEST(item, 10);
+		queue.Push(5, 5, 3);
+		queue.Pop(item, 0);
+		TEST(item, 5);
+		queue.Pop(item, 0);
+		TEST(item, 11);
+	}
+
+	{
+		// Jobs of the same priority in one shard keep their order.
+		JobQueue<int64_t> queue(1);
+		for (int64_t i = 0; i < 5; i++)
+		{
+			queue.Push(int64_t(i), 0);
+		}
+		bool fifo = true;
+		int64_t item = 0;
+		for (int64_t i = 0; i < 5; i++)
+		{
+			queue.Pop(item, 0);
+			fifo = fifo && item == i;
+		}
+		TEST(fifo, true);
+	}
+
+	{
+		// Concurrent producers and consumers see every job exactly once.
+		constexpr int Producers = 4;
+		constexpr int Consumers = 4;
+		constexpr int64_t JobsPerProducer = 10000;
+		JobQueue<int64_t> queue(Consumers);
+		std::vector<std::atomic<int>> seen(Producers * JobsPerProducer);
+
+		std::vector<std::thread> threads;
+		for (int c = 0; c < Consumers; c++)
+		{
+			threads.emplace_back([&queue, &seen, c]()
+			    {
+				    int64_t item = 0;
+				    while (queue.Pop(item, c))
+				    {
+					    seen[item]++;
+				    }
+			    });
+		}
+		std::vector<std::thread> producers;
+		for (int p = 0; p < Producers; p++)
+		{
+			producers.emplace_back([&queue, p]()
+			    {
+				    for (int64_t i = 0; i < JobsPerProducer; i++)
+				    {
+					    const int64_t item = p * JobsPerProducer + i;
+					    queue.Push(int64_t(item), item % 97);
+				    }
+			    });
+		}
+		for (auto& producer : producers)
+		{
+			producer.join();
+		}
+		while (queue.Size() > 0)
+		{
+			std::this_thread::yield();
+		}
+		queue.Close();
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		bool exactlyOnce = true;
+		for (const auto& count : seen)
+		{
+			exactlyOnce = exactlyOnce && count == 1;
+		}
+		TEST(exactlyOnce, true);
+	}
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
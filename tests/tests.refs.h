@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <random>
+
+#include "tests.common.h"
+#include "legacy_label_to_tag.h"
+#include "utils/ref_helpers.h"
+
+int TestRefHelpers()
+{
+	TEST_START();
+
+	TEST(RefHelpers::IsValidRefName("refs/tags/v1.0"), true);
+	TEST(RefHelpers::IsValidRefName("refs/tags/release/2024"), true);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a..b"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/.a"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a.lock"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a.lock/b"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a b"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a/"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a."), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags//a"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a@{b"), false);
+	TEST(RefHelpers::IsValidRefName("refs/tags/a\x7f"), false);
+	TEST(RefHelpers::IsValidRefName("@"), false);
+
+	TEST(RefHelpers::SanitizeTagName("v1.0"), "v1.0");
+	TEST(RefHelpers::SanitizeTagName("my label"), "my_label");
+	TEST(RefHelpers::SanitizeTagName("a..b"), "a_b");
+	TEST(RefHelpers::SanitizeTagName("a...b"), "a_.b");
+	TEST(RefHelpers::SanitizeTagName(".hidden"), "_hidden");
+	TEST(RefHelpers::SanitizeTagName("a/.b"), "a_b");
+	TEST(RefHelpers::SanitizeTagName("a.lock/b.lock"), "a_lock/b_lock");
+	TEST(RefHelpers::SanitizeTagName("a@{b}"), "a_b}");
+	TEST(RefHelpers::SanitizeTagName("//a//b//"), "_/a/b/_");
+	TEST(RefHelpers::SanitizeTagName("a."), "a_");
+	TEST(RefHelpers::SanitizeTagName("@"), "_");
+
+	{
+		// Differential test against the regex based sanitizer it replaced:
+		// every result must be a valid ref name, and where the old result
+		// was valid, both must agree.
+		const char* tokens[] = { "a", "b", ".", "/", "@", "{", "lock", ".lock", " ", "~", "\x01", "\x7f", "*", "[", "\\", "\xc3\xa9", "_", ":" };
+		constexpr size_t tokenCount = sizeof(tokens) / sizeof(tokens[0]);
+		std::mt19937_64 random(42);
+		int invalid = 0;
+		int different = 0;
+		for (int i = 0; i < 20000; i++)
+		{
+			std::string label;
+			const size_t length = 1 + random() % 12;
+			for (size_t t = 0; t < length; t++)
+			{
+				label += tokens[random() % tokenCount];
+			}
+
+			const std::string tag = RefHelpers::SanitizeTagName(label);
+			const std::string legacyTag = LegacyConvertLabelToTag(label);
+			if (!RefHelpers::IsValidRefName("refs/tags/" + tag))
+			{
+				ERR("Invalid tag " << tag << " for label " << label)
+				invalid++;
+			}
+			else if (RefHelpers::IsValidRefName("refs/tags/" + legacyTag) && tag != legacyTag)
+			{
+				ERR("Tag " << tag << " for label " << label << " differs from " << legacyTag)
+				different++;
+			}
+		}
+		TEST(invalid, 0);
+		TEST(different, 0);
+	}
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
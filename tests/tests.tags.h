@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "tests.common.h"
+#include "tests.git.h"
+#include "git2.h"
+#include "commands/label_result.h"
+
+// ResolveRef returns the object a ref or revision expression points at, or
+// an empty string if there is none.
+std::string ResolveRef(const std::string& repoPath, const std::string& spec)
+{
+	git_repository* repo = nullptr;
+	if (git_repository_open(&repo, repoPath.c_str()) != 0)
+	{
+		return "";
+	}
+	git_object* object = nullptr;
+	const bool found = git_revparse_single(&object, repo, spec.c_str()) == 0;
+	const std::string oid = found ? git_oid_tostr_s(git_object_id(object)) : "";
+	git_object_free(object);
+	git_repository_free(repo);
+	return oid;
+}
+
+// LabelOn returns a label map with a single label on a changelist.
+LabelMap LabelOn(const std::string& changelist, const std::string& label)
+{
+	LabelMap labels;
+	labels[changelist] = new std::unordered_map<std::string, LabelResult>();
+	(*labels[changelist])[label].label = label;
+	return labels;
+}
+
+int TestTags()
+{
+	TEST_START();
+
+	Libgit2RAII git2(false);
+	const std::filesystem::path dir = std::filesystem::temp_directory_path() / "p4-fusion-test-tags";
+	std::filesystem::remove_all(dir);
+	const std::string repoPath = dir.string();
+
+	std::string first;
+	std::string second;
+	{
+		// Tags point at the commits of their changelists, and only labels of
+		// converted changelists get tags.
+		GitAPI git(repoPath, 0);
+		git.InitializeRepository(false);
+		first = CommitTestFile(git, "//depot/...", 10, "//depot/a.txt", "a.txt", "add", "a at 10\n");
+		second = CommitTestFile(git, "//depot/...", 11, "//depot/a.txt", "a.txt", "edit", "a at 11\n");
+
+		LabelMap labels = LabelOn("10", "v1");
+		labels.merge(LabelOn("11", "v2"));
+		labels.merge(LabelOn("12", "v3"));
+		git.CreateTagsFromLabels(labels);
+
+		TEST(ResolveRef(repoPath, "refs/tags/v1"), first);
+		TEST(ResolveRef(repoPath, "refs/tags/v2"), second);
+		TEST(ResolveRef(repoPath, "refs/tags/v3"), "");
+	}
+
+	{
+		// Branches have no refs of their own yet, so converting to one is
+		// refused rather than committing it to HEAD. BranchSet strips the
+		// branch from the path, so //depot/main/a.txt and //depot/rel/a.txt
+		// would both overwrite a.txt there.
+		GitAPI git(repoPath, 0);
+		git.InitializeRepository(false);
+		const std::string head = ResolveRef(repoPath, "HEAD");
+		const std::string blob = ResolveRef(repoPath, "HEAD:a.txt");
+
+		for (const std::string branch : { "main", "rel" })
+		{
+			bool threw = false;
+			try
+			{
+				CommitTestFile(git, "//depot/...", 12, "//depot/" + branch + "/a.txt", "a.txt", "edit", branch + " at 12\n", branch);
+			}
+			catch (const std::runtime_error&)
+			{
+				threw = true;
+			}
+			TEST(threw, true);
+		}
+		TEST(ResolveRef(repoPath, "HEAD"), head);
+		TEST(ResolveRef(repoPath, "HEAD:a.txt"), blob);
+	}
+
+	{
+		// Tags deleted or moved outside of p4-fusion are written again, even
+		// though the record of the previous run says they are up to date.
+		git_repository* repo = nullptr;
+		git_repository_open(&repo, repoPath.c_str());
+		git_reference_remove(repo, "refs/tags/v1");
+		git_oid oid;
+		git_oid_fromstr(&oid, first.c_str());
+		git_reference* ref = nullptr;
+		git_reference_create(&ref, repo, "refs/tags/v2", &oid, true, "moved by hand");
+		git_reference_free(ref);
+		git_repository_free(repo);
+		TEST(ResolveRef(repoPath, "refs/tags/v1"), "");
+
+		GitAPI git(repoPath, 0);
+		git.InitializeRepository(false);
+		LabelMap labels = LabelOn("10", "v1");
+		labels.merge(LabelOn("11", "v2"));
+		git.CreateTagsFromLabels(labels);
+
+		TEST(ResolveRef(repoPath, "refs/tags/v1"), first);
+		TEST(ResolveRef(repoPath, "refs/tags/v2"), second);
+	}
+
+	{
+		// A later run that rebuilds the index from the history finds the same
+		// commits, and deletes the tags of labels that are gone.
+		std::filesystem::remove(dir / "changelists.idx");
+		GitAPI git(repoPath, 0);
+		git.InitializeRepository(false);
+		git.CreateTagsFromLabels(LabelOn("10", "v1"));
+
+		TEST(ResolveRef(repoPath, "refs/tags/v1"), first);
+		TEST(ResolveRef(repoPath, "refs/tags/v2"), "");
+	}
+
+	std::filesystem::remove_all(dir);
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
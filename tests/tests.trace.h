@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "tests.common.h"
+#include "trace.h"
+#include "trace_format.h"
+#include "trace_converter.h"
+
+// TraceContents is what a trace file holds, read back record by record.
+struct TraceContents
+{
+	bool valid = true;
+	uint32_t version = 0;
+	std::map<uint16_t, std::string> strings;
+	std::map<uint32_t, std::string> threadNames;
+	std::map<std::string, int> eventsByName;
+	std::set<uint32_t> threads;
+	// Set if an event refers to a string that wasn't written before it.
+	bool unknownString = false;
+};
+
+TraceContents ReadTraceFile(const std::string& path)
+{
+	TraceContents contents;
+	std::ifstream in(path, std::ios::binary);
+	TraceFormat::Header header {};
+	in.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!in || std::memcmp(header.magic, TraceFormat::Magic, sizeof(header.magic)) != 0)
+	{
+		contents.valid = false;
+		return contents;
+	}
+	contents.version = header.version;
+
+	auto readText = [&in]()
+	{
+		uint16_t length = 0;
+		in.read(reinterpret_cast<char*>(&length), sizeof(length));
+		std::string text(length, '\0');
+		in.read(text.data(), length);
+		return text;
+	};
+
+	TraceFormat::RecordType type;
+	while (in.read(reinterpret_cast<char*>(&type), sizeof(type)))
+	{
+		if (type == TraceFormat::RecordType::String)
+		{
+			uint16_t id = 0;
+			in.read(reinterpret_cast<char*>(&id), sizeof(id));
+			contents.strings[id] = readText();
+		}
+		else if (type == TraceFormat::RecordType::Thread)
+		{
+			uint32_t thread = 0;
+			in.read(reinterpret_cast<char*>(&thread), sizeof(thread));
+			contents.threadNames[thread] = readText();
+		}
+		else if (type == TraceFormat::RecordType::Events)
+		{
+			uint32_t count = 0;
+			in.read(reinterpret_cast<char*>(&count), sizeof(count));
+			for (uint32_t i = 0; i < count; i++)
+			{
+				TraceFormat::Event event {};
+				in.read(reinterpret_cast<char*>(&event), sizeof(event));
+				if (!contents.strings.count(event.name) || !contents.strings.count(event.category))
+				{
+					contents.unknownString = true;
+					continue;
+				}
+				contents.eventsByName[contents.strings[event.name]]++;
+				contents.threads.insert(event.thread);
+			}
+		}
+		else
+		{
+			contents.valid = false;
+			break;
+		}
+	}
+	return contents;
+}
+
+// ConvertTrace runs the converter on the file and returns the JSON it wrote.
+std::string ConvertTrace(const std::string& path, uint64_t fromNs, uint64_t toNs, uint64_t& events)
+{
+	std::ifstream in(path, std::ios::binary);
+	FILE* out = std::tmpfile();
+	TraceConverter converter(out, fromNs, toNs);
+	converter.Convert(in);
+	events = converter.GetEventCount();
+
+	std::string json(std::ftell(out), '\0');
+	std::rewind(out);
+	json.resize(std::fread(json.data(), 1, json.size(), out));
+	std::fclose(out);
+	return json;
+}
+
+int CountOccurrences(const std::string& text, const std::string& needle)
+{
+	int count = 0;
+	for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + 1))
+	{
+		count++;
+	}
+	return count;
+}
+
+int TestTrace()
+{
+	TEST_START();
+
+	const std::filesystem::path dir = std::filesystem::temp_directory_path() / "p4-fusion-test-trace";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	const std::string path = (dir / "trace.bin").string();
+
+	Trace::Start(path, 1, 0);
+	Trace::SetThreadName("Main Thread");
+	{
+		TRACE_SCOPE("Test", "MainScope");
+	}
+	Trace::Counter("QueueDepth", 3.5);
+
+	// Events of threads that exited before a flush are kept, and every
+	// thread gets an id of its own.
+	std::thread([]()
+	    {
+		    Trace::SetThreadName("Worker");
+		    for (int i = 0; i < 10; i++)
+		    {
+			    TRACE_SCOPE("Test", "WorkerScope");
+		    } })
+	    .join();
+	Trace::Flush();
+	std::thread([]()
+	    {
+		    for (int i = 0; i < 5; i++)
+		    {
+			    TRACE_SCOPE("Test", "LateScope");
+		    } })
+	    .join();
+	Trace::Stop();
+
+	{
+		const TraceContents contents = ReadTraceFile(path);
+		TEST(contents.valid, true);
+		TEST(contents.version, TraceFormat::Version);
+		TEST(contents.unknownString, false);
+		TEST(contents.eventsByName.at("MainScope"), 1);
+		TEST(contents.eventsByName.at("QueueDepth"), 1);
+		TEST(contents.eventsByName.at("WorkerScope"), 10);
+		TEST(contents.eventsByName.at("LateScope"), 5);
+		TEST(contents.threads.size(), 3);
+		TEST(contents.threadNames.size(), 2);
+	}
+
+	{
+		// Every scope, counter sample and thread name becomes one JSON event,
+		// plus the process name.
+		uint64_t events = 0;
+		const std::string json = ConvertTrace(path, 0, UINT64_MAX, events);
+		TEST(events, 20);
+		TEST(CountOccurrences(json, "\"ph\":\"X\""), 16);
+		TEST(CountOccurrences(json, "\"ph\":\"C\""), 1);
+		TEST(CountOccurrences(json, "\"name\":\"Worker\""), 1);
+		TEST(CountOccurrences(json, "\"args\":{\"value\":3.5}"), 1);
+		TEST(json.substr(json.size() - 4), std::string("\n]}\n"));
+
+		// A time window after the run keeps only the metadata.
+		ConvertTrace(path, UINT64_MAX - 1, UINT64_MAX, events);
+		TEST(events, 3);
+	}
+
+	{
+		// A trace cut off in the middle of a record converts up to it.
+		const std::string truncated = (dir / "truncated.bin").string();
+		std::filesystem::copy_file(path, truncated);
+		std::filesystem::resize_file(truncated, std::filesystem::file_size(path) - sizeof(TraceFormat::Event) / 2);
+		uint64_t events = 0;
+		const std::string json = ConvertTrace(truncated, 0, UINT64_MAX, events);
+		TEST(events, 19);
+		TEST(json.substr(json.size() - 4), std::string("\n]}\n"));
+
+		// Anything that isn't a trace is rejected.
+		std::ofstream(truncated, std::ios::binary | std::ios::trunc) << "not a trace";
+		bool threw = false;
+		try
+		{
+			ConvertTrace(truncated, 0, UINT64_MAX, events);
+		}
+		catch (const std::runtime_error&)
+		{
+			threw = true;
+		}
+		TEST(threw, true);
+	}
+
+	std::filesystem::remove_all(dir);
+
+	TEST_END();
+	return TEST_EXIT_CODE();
+}
@@ -6,7 +6,6 @@
  */
 #pragma once
 
-#include <array>
 #include "tests.common.h"
 #include "utils/std_helpers.h"
 #include "utils/time_helpers.h"
@@ -57,19 +56,14 @@ int TestUtils()
 	TEST(STDHelpers::EndsWith("//depot/path/.git", ".git"), true);
 
 	{
-		std::string depotPath = "//depot/path/";
-		std::string filePath = "//depot/path/foo/bar/crash.txt";
-		STDHelpers::Erase(filePath, depotPath);
-
-		TEST(filePath == "foo/bar/crash.txt", true);
+		std::string quoted = "\"//depot/path with spaces/...\"";
+		STDHelpers::StripSurrounding(quoted, '"');
+		TEST(quoted, "//depot/path with spaces/...");
 	}
 	{
-		std::string depotPath = "//depot/path/...";
-		std::string filePath = "//depot/path/foo/bar/crash.txt";
-		STDHelpers::Erase(filePath, depotPath);
-
-		TEST(filePath == "//depot/path/foo/bar/crash.txt", true);
-		TEST(filePath == "foo/bar/crash.txt", false);
+		std::string unquoted = "//depot/path/...";
+		STDHelpers::StripSurrounding(unquoted, '"');
+		TEST(unquoted, "//depot/path/...");
 	}
 
 	TEST(Time::GetTimezoneMinutes("2022/03/15 09:56:15 -0400 EDT"), -240);
@@ -83,17 +77,6 @@ int TestUtils()
 	TEST(Time::GetTimezoneMinutes("2022/03/09 22:59:04 +0000 GMT"), +0);
 	TEST(Time::GetTimezoneMinutes("2022/03/09 22:59:04 -0000 GMT"), +0);
 
-	{
-		auto actual = STDHelpers::SplitAt("depot/path/some/other", '/');
-		auto expected = std::array<std::string, 2> { "depot", "path/some/other" };
-		TEST(actual, expected);
-	}
-	{
-		auto actual = STDHelpers::SplitAt("//depot/path", '/', 2);
-		auto expected = std::array<std::string, 2> { "depot", "path" };
-		TEST(actual, expected);
-	}
-
 	TEST_END();
 	return TEST_EXIT_CODE();
 }
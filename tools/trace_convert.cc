@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+
+#include "log.h"
+#include "trace_converter.h"
+
+/*
+ * p4-fusion-trace converts a binary trace written by p4-fusion --trace into
+ * the Chrome trace event format, which chrome://tracing and
+ * https://ui.perfetto.dev can open. To keep the output small enough for the
+ * viewers, a time window of the run can be selected.
+ */
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		ERR("Usage: p4-fusion-trace <trace.bin> <trace.json> [from seconds] [to seconds]")
+		return 1;
+	}
+	const uint64_t fromNs = argc > 3 ? (uint64_t)(std::atof(argv[3]) * 1e9) : 0;
+	const uint64_t toNs = argc > 4 ? (uint64_t)(std::atof(argv[4]) * 1e9) : std::numeric_limits<uint64_t>::max();
+
+	std::ifstream in(argv[1], std::ios::binary);
+	if (!in)
+	{
+		ERR("Failed to open " << argv[1])
+		return 1;
+	}
+	FILE* out = std::fopen(argv[2], "w");
+	if (!out)
+	{
+		ERR("Failed to create " << argv[2])
+		return 1;
+	}
+
+	TraceConverter converter(out, fromNs, toNs);
+	try
+	{
+		converter.Convert(in);
+	}
+	catch (const std::exception& e)
+	{
+		ERR("Failed to convert " << argv[1] << ": " << e.what())
+		std::fclose(out);
+		return 1;
+	}
+	if (std::fclose(out) != 0)
+	{
+		ERR("Failed to write " << argv[2])
+		return 1;
+	}
+
+	SUCCESS("Wrote " << converter.GetEventCount() << " events to " << argv[2])
+	return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2024 Sourcegraph, Inc.
+ * All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ * For full license text, see the LICENSE.txt file in the repo root or https://opensource.org/licenses/BSD-3-Clause
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "trace_format.h"
+
+/*
+ * TraceConverter converts a binary trace written by p4-fusion --trace into
+ * the Chrome trace event format, record by record, so traces of any size can
+ * be converted. Only events starting between fromNs and toNs are kept.
+ */
+class TraceConverter
+{
+public:
+	TraceConverter(FILE* out, const uint64_t fromNs, const uint64_t toNs)
+	    : m_Out(out)
+	    , m_FromNs(fromNs)
+	    , m_ToNs(toNs)
+	{
+	}
+
+	// Convert writes the whole JSON document. It throws if the input isn't a
+	// trace file, a trace that ends in the middle of a record is converted up
+	// to that record.
+	void Convert(std::istream& in)
+	{
+		TraceFormat::Header header {};
+		if (!read(in, header) || std::memcmp(header.magic, TraceFormat::Magic, sizeof(header.magic)) != 0)
+		{
+			throw std::runtime_error("not a p4-fusion trace file");
+		}
+		if (header.version != TraceFormat::Version)
+		{
+			throw std::runtime_error("unsupported trace version " + std::to_string(header.version));
+		}
+
+		std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", m_Out);
+		emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"p4-fusion\"}}");
+
+		try
+		{
+			convertRecords(in);
+		}
+		catch (const std::exception& e)
+		{
+			// A trace of a run that was killed ends in the middle of a
+			// record, keep everything before it.
+			WARN("Stopped converting at an invalid record: " << e.what())
+		}
+
+		std::fputs("\n]}\n", m_Out);
+	}
+
+	[[nodiscard]] uint64_t GetEventCount() const { return m_Events; }
+
+private:
+	template <class T>
+	static bool read(std::istream& in, T& value)
+	{
+		return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+	}
+
+	static std::string readText(std::istream& in)
+	{
+		uint16_t length = 0;
+		if (!read(in, length))
+		{
+			throw std::runtime_error("truncated text record");
+		}
+		std::string text(length, '\0');
+		if (!in.read(text.data(), length))
+		{
+			throw std::runtime_error("truncated text record");
+		}
+		return text;
+	}
+
+	static std::string escape(const std::string& text)
+	{
+		std::string out;
+		out.reserve(text.size());
+		for (const char c : text)
+		{
+			switch (c)
+			{
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			case '\n':
+				out += "\\n";
+				break;
+			default:
+				if ((unsigned char)c < 0x20)
+				{
+					char buf[8];
+					std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				}
+				else
+				{
+					out += c;
+				}
+			}
+		}
+		return out;
+	}
+
+	FILE* m_Out;
+	uint64_t m_FromNs;
+	uint64_t m_ToNs;
+	std::vector<std::string> m_Strings;
+	uint64_t m_Events = 0;
+
+	void convertRecords(std::istream& in)
+	{
+		TraceFormat::RecordType type;
+		while (read(in, type))
+		{
+			switch (type)
+			{
+			case TraceFormat::RecordType::String:
+			{
+				uint16_t id = 0;
+				if (!read(in, id))
+				{
+					throw std::runtime_error("truncated string record");
+				}
+				if (m_Strings.size() <= id)
+				{
+					m_Strings.resize(id + 1);
+				}
+				m_Strings[id] = escape(readText(in));
+				break;
+			}
+			case TraceFormat::RecordType::Thread:
+			{
+				uint32_t thread = 0;
+				if (!read(in, thread))
+				{
+					throw std::runtime_error("truncated thread record");
+				}
+				emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(thread) + ",\"args\":{\"name\":\"" + escape(readText(in)) + "\"}}");
+				break;
+			}
+			case TraceFormat::RecordType::Events:
+			{
+				uint32_t count = 0;
+				if (!read(in, count))
+				{
+					throw std::runtime_error("truncated events record");
+				}
+				for (uint32_t i = 0; i < count; i++)
+				{
+					TraceFormat::Event event {};
+					if (!read(in, event))
+					{
+						throw std::runtime_error("truncated events record");
+					}
+					convert(event);
+				}
+				break;
+			}
+			default:
+				throw std::runtime_error("unknown record type " + std::to_string((int)type));
+			}
+		}
+	}
+
+	const std::string& string(const uint16_t id) const
+	{
+		if (id >= m_Strings.size())
+		{
+			throw std::runtime_error("event refers to unknown string " + std::to_string(id));
+		}
+		return m_Strings[id];
+	}
+
+	void emit(const std::string& json)
+	{
+		if (m_Events++ > 0)
+		{
+			std::fputs(",\n", m_Out);
+		}
+		std::fputs(json.c_str(), m_Out);
+	}
+
+	void convert(const TraceFormat::Event& event)
+	{
+		if (event.startNs < m_FromNs || event.startNs > m_ToNs)
+		{
+			return;
+		}
+
+		// Chrome expects microseconds, keep the nanoseconds as fractions.
+		char timing[96];
+		if (event.type == TraceFormat::EventType::Complete)
+		{
+			std::snprintf(timing, sizeof(timing), "\"ts\":%.3f,\"dur\":%.3f", (double)event.startNs / 1000.0, (double)event.value / 1000.0);
+			emit("{\"name\":\"" + string(event.name) + "\",\"cat\":\"" + string(event.category) + "\",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(event.thread) + "," + timing + "}");
+		}
+		else if (event.type == TraceFormat::EventType::Counter)
+		{
+			double value = 0;
+			std::memcpy(&value, &event.value, sizeof(value));
+			std::snprintf(timing, sizeof(timing), "\"ts\":%.3f,\"args\":{\"value\":%.17g}", (double)event.startNs / 1000.0, value);
+			emit("{\"name\":\"" + string(event.name) + "\",\"ph\":\"C\",\"pid\":1," + timing + "}");
+		}
+	}
+};